@@ -14,11 +14,13 @@ typedef struct AABB{
 AABB pad(AABB bbox);
 
 void print_aabb(const AABB *bbox) {
-    printf("bbox: (x[%f, %f], y[%f, %f], z[%f, %f])\n", bbox->x.min, bbox->x.max, bbox->y.min, bbox->y.max, bbox->z.min, bbox->z.max);
+    printf("bbox: (x[%f, %f], y[%f, %f], z[%f, %f])\n", (double) bbox->x.min, (double) bbox->x.max,
+           (double) bbox->y.min, (double) bbox->y.max, (double) bbox->z.min, (double) bbox->z.max);
 }
 
 AABB create_empty_aabb() {
-    return (AABB){0};
+    // Inverted intervals, so the union with any box is that box
+    return (AABB) {.x = EMPTY, .y = EMPTY, .z = EMPTY};
 }
 
 AABB create_aabb_for_interval(Interval x, Interval y, Interval z) {
@@ -67,6 +69,15 @@ Point3 center_aabb(const AABB *bbox) {
     };
 }
 
+real surface_area_aabb(const AABB *bbox) {
+    real dx = size_interval(bbox->x);
+    real dy = size_interval(bbox->y);
+    real dz = size_interval(bbox->z);
+    if (dx < 0 || dy < 0 || dz < 0) return 0;
+
+    return 2 * (dx * dy + dy * dz + dz * dx);
+}
+
 Interval get_axis_from_aabb(const AABB *bbox, int n) {
     if (n == 1) return bbox->y;
     if (n == 2) return bbox->z;
@@ -76,7 +87,7 @@ Interval get_axis_from_aabb(const AABB *bbox, int n) {
 
 AABB pad(AABB aabb) {
     // Return an AABB that has no side narrower than some delta, padding if necessary.
-    double delta = 0.0001;
+    real delta = (real) 0.0001;
     Interval new_x = (size_interval(aabb.x) >= delta) ? aabb.x : expand_interval(delta, aabb.x);
     Interval new_y = (size_interval(aabb.y) >= delta) ? aabb.y : expand_interval(delta, aabb.y);
     Interval new_z = (size_interval(aabb.z) >= delta) ? aabb.z : expand_interval(delta, aabb.z);
@@ -84,21 +95,32 @@ AABB pad(AABB aabb) {
     return create_aabb_for_interval(new_x, new_y, new_z);
 }
 
-bool hit_aabb(const Ray *ray, Interval ray_t, const AABB *bbox) {
-    for (int a = 0; a < 3; a++) {
-        double axis_ratio_min = (get_axis_from_aabb(bbox, a).min - origin_dim(ray, a)) / dir_dim(ray, a);
-        double axis_ratio_max = (get_axis_from_aabb(bbox, a).max - origin_dim(ray, a)) / dir_dim(ray, a);
-
-        double t0 = fmin(axis_ratio_min, axis_ratio_max);
-        double t1 = fmax(axis_ratio_min, axis_ratio_max);
-
-        ray_t.min = fmax(t0, ray_t.min);
-        ray_t.max = fmin(t1, ray_t.max);
-
-        if (ray_t.max <= ray_t.min) {
-            return false;
-        }
-    }
+// Slab test that also reports where the ray enters the box, clipped to ray_t.
+// The sign bits pick the near and far plane of each slab (Williams et al.),
+// so there are no divides and no per-axis early exits.
+bool hit_aabb_entry(const Ray *ray, Interval ray_t, const AABB *bbox, real *t_entry) {
+    real near_x = ray->sign[0] ? bbox->x.max : bbox->x.min;
+    real far_x = ray->sign[0] ? bbox->x.min : bbox->x.max;
+    real near_y = ray->sign[1] ? bbox->y.max : bbox->y.min;
+    real far_y = ray->sign[1] ? bbox->y.min : bbox->y.max;
+    real near_z = ray->sign[2] ? bbox->z.max : bbox->z.min;
+    real far_z = ray->sign[2] ? bbox->z.min : bbox->z.max;
+
+    real tx0 = (near_x - ray->origin.x) * ray->inv_direction.x;
+    real tx1 = (far_x - ray->origin.x) * ray->inv_direction.x;
+    real ty0 = (near_y - ray->origin.y) * ray->inv_direction.y;
+    real ty1 = (far_y - ray->origin.y) * ray->inv_direction.y;
+    real tz0 = (near_z - ray->origin.z) * ray->inv_direction.z;
+    real tz1 = (far_z - ray->origin.z) * ray->inv_direction.z;
+
+    real t0 = fmax(fmax(tx0, ty0), fmax(tz0, ray_t.min));
+    real t1 = fmin(fmin(tx1, ty1), fmin(tz1, ray_t.max));
+
+    *t_entry = t0;
+    return t0 < t1;
+}
 
-    return true;
+bool hit_aabb(const Ray *ray, Interval ray_t, const AABB *bbox) {
+    real t_entry;
+    return hit_aabb_entry(ray, ray_t, bbox, &t_entry);
 }
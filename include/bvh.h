@@ -1,51 +1,214 @@
 #pragma once
 
+#include <assert.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "aabb.h"
 #include "quad.h"
+#include "simd.h"
 #include "sphere.h"
+#include "transform.h"
 #include "triangle.h"
 
+// Nodes live in one array in depth-first order. The left child of an interior
+// node is the next node in the array, the right child is at offset. Leaves
+// reference the primitives [offset, offset + count) of the tree's primitive array.
+// Nodes take 64 bytes in the double build and 32 in the float build.
 typedef struct BvhNode {
-    struct BvhNode *left;
-    struct BvhNode *right;
     AABB bbox;
-    const Sphere *sphere;
-    const Triangle *triangle;
-    const Quad *quad;
-    int triangle_count;
+    int offset;     // right child for interior nodes, first primitive for leaves
+    uint16_t count; // number of primitives, 0 for interior nodes
+    uint16_t axis;  // split axis of interior nodes
+} __attribute__((aligned(32))) BvhNode;
+
+// One child per simd lane: 4 in the double build, 8 in the float build
+#ifdef RT_SIMD
+#define WIDE_BVH_WIDTH SIMD_LANES
+#else
+#define WIDE_BVH_WIDTH 4
+#endif
+
+// Node of the optional wide form of the tree, see collapse_bvh_wide. Child bounds are
+// stored structure-of-arrays so one ray is tested against every child at once.
+typedef struct WideBvhNode {
+    real min_x[WIDE_BVH_WIDTH], min_y[WIDE_BVH_WIDTH], min_z[WIDE_BVH_WIDTH];
+    real max_x[WIDE_BVH_WIDTH], max_y[WIDE_BVH_WIDTH], max_z[WIDE_BVH_WIDTH];
+    int child[WIDE_BVH_WIDTH]; // wide node index, or first primitive of a leaf child
+    int count[WIDE_BVH_WIDTH]; // primitives in a leaf child, 0 for interior children
+    int child_count;           // used lanes, always the first ones
+} __attribute__((aligned(32))) WideBvhNode;
+
+// Grid steps per axis of a compressed node
+#define BVH_QUANT_STEPS 255
+
+// Wide node with the child bounds quantized to 8 bits, see compress_bvh_wide. Child
+// planes lie on a grid over the node's own box, origin + q * scale on each axis, and are
+// rounded outwards so a child's box always contains its primitives. A node takes 128
+// bytes, two cache lines, in both builds: half a WideBvhNode in double, 4/9 in float.
+typedef struct CompressedBvhNode {
+    real origin[3]; // min corner of the box around every child
+    real scale[3];  // grid step, a power of two so origin + q * scale rounds only once
+    uint8_t min_x[WIDE_BVH_WIDTH], min_y[WIDE_BVH_WIDTH], min_z[WIDE_BVH_WIDTH];
+    uint8_t max_x[WIDE_BVH_WIDTH], max_y[WIDE_BVH_WIDTH], max_z[WIDE_BVH_WIDTH];
+    int child[WIDE_BVH_WIDTH];      // same as WideBvhNode
+    uint16_t count[WIDE_BVH_WIDTH]; // leaf sizes fit, see BVH_MAX_LEAF_SIZE
+    uint16_t child_count;
+} __attribute__((aligned(64))) CompressedBvhNode;
+
+// Leaves reference their primitives through these: the primitive type in the top
+// two bits, the index into that type's arrays in the rest.
+typedef uint32_t PrimRef;
+
+typedef enum PrimType {
+    PRIM_SPHERE,
+    PRIM_TRIANGLE,
+    PRIM_QUAD,
+    PRIM_INSTANCE
+} PrimType;
+
+#define PRIM_REF_TYPE_SHIFT 30
+#define PRIM_REF_INDEX_MASK ((1u << PRIM_REF_TYPE_SHIFT) - 1)
+
+PrimRef make_prim_ref(PrimType type, int index) {
+    return ((PrimRef) type << PRIM_REF_TYPE_SHIFT) | (PrimRef) index;
+}
+
+PrimType prim_ref_type(PrimRef ref) {
+    return (PrimType) (ref >> PRIM_REF_TYPE_SHIFT);
+}
+
+int prim_ref_index(PrimRef ref) {
+    return (int) (ref & PRIM_REF_INDEX_MASK);
+}
+
+struct Bvh;
+
+typedef enum BvhSplitMethod {
+    BVH_SPLIT_SAH,
+    BVH_SPLIT_MEDIAN,
+    BVH_SPLIT_SPATIAL // SAH that may also split primitives, see build_bvh_spatial_recursive
+} BvhSplitMethod;
+
+typedef struct BvhBuildConfig {
+    BvhSplitMethod split_method;
+    int num_bins;      // SAH centroid bins per axis, split candidates are the planes between them
+    int max_leaf_size; // most primitives in a leaf, SAH may stop splitting earlier when a leaf is cheaper
+    double spatial_split_budget; // spatial splits only: extra references allowed, as a fraction of the primitives
+} BvhBuildConfig;
+
+// Placement of a shared tree in the scene, object_to_world may be any invertible affine map
+typedef struct Instance {
+    const struct Bvh *bvh;
+    Transform object_to_world;
+} Instance;
+
+// What a tree keeps of an instance, rays are moved into object space on entry
+typedef struct BvhInstance {
+    const struct Bvh *bvh;
+    Transform world_to_object;
+} BvhInstance;
+
+typedef struct Bvh {
+    BvhNode *nodes;
+    int node_count;
+
+    // Leaf references, every leaf covers a contiguous range of them.
+    // A tree can mix primitive types.
+    PrimRef *prim_refs;
+    int prim_count;
+
+    // Primitives of each type, stored in the order the leaves reference them.
+    // Leaf tests only read the intersection arrays (sphere and triangle blocks, quads),
+    // shading data is looked up once the closest hit is known.
+    SphereBlock *sphere_blocks;
+    int *sphere_mat_ids;
     int sphere_count;
+    TriangleBlock *triangle_blocks;
+    TriangleShading *triangle_shading;
+    int triangle_count;
+    QuadGeom *quads;
+    int *quad_mat_ids;
     int quad_count;
-} BvhNode;
 
-void print_bvh(const BvhNode *node, int level) {
+    // Instanced trees are shared and not owned, they hold no instances themselves
+    BvhInstance *instances;
+    int instance_count;
+
+    // What refit_bvh needs: the scene primitive every reference was built from,
+    // the build settings and the SAH cost of the freshly built tree, see
+    // calculate_refit_sah_cost for spatial splits. Those can reference a primitive
+    // more than once, prim_count then exceeds source_count.
+    int *prim_sources;
+    int source_count;
+    BvhBuildConfig config;
+    double build_sah_cost;
+
+    // Wide form of the same tree, NULL unless collapse_bvh_wide was called.
+    // When present, traversal uses it instead of the binary nodes.
+    WideBvhNode *wide_nodes;
+    int wide_node_count;
+
+    // Quantized wide form, NULL unless compress_bvh_wide was called. It replaces
+    // wide_nodes, the two are never both present.
+    CompressedBvhNode *compressed_nodes;
+    int compressed_node_count;
+} Bvh;
+
+bool is_leaf(const BvhNode *node) {
+    return node->count > 0;
+}
+
+void print_bvh_node(const Bvh *bvh, int index, int level) {
+    const BvhNode *node = &bvh->nodes[index];
     for (int i = 0; i < level; i++) {
         printf("\t");
     }
     printf("Node level %d: ", level); print_aabb(&node->bbox);
-    if (node->left != NULL) {
-        print_bvh(node->left, level + 1);
-    } 
-    if (node->right != NULL) {
-        print_bvh(node->right, level + 1);
+    if (!is_leaf(node)) {
+        print_bvh_node(bvh, index + 1, level + 1);
+        print_bvh_node(bvh, node->offset, level + 1);
     }
 }
 
-int count_bvh(const BvhNode *node) {
-    if (node == NULL) {
-        return 0;
+void print_bvh(const Bvh *bvh) {
+    if (bvh->node_count > 0) {
+        print_bvh_node(bvh, 0, 0);
     }
-    int l = count_bvh(node->left);        
-    int r = count_bvh(node->right);
+}
 
-    return 1 + l + r;
+int count_bvh(const Bvh *bvh) {
+    return bvh->node_count;
 }
 
-void analyze_depth(const BvhNode *node, int currentDepth, int *maxDepth, int *totalLeaves, int *depthSum) {
-    if (node == NULL) return;
+// Bytes held by the nodes and primitives of the tree
+size_t bvh_memory_usage(const Bvh *bvh) {
+    return sizeof(BvhNode) * (size_t) bvh->node_count
+        + sizeof(WideBvhNode) * (size_t) bvh->wide_node_count
+        + sizeof(CompressedBvhNode) * (size_t) bvh->compressed_node_count
+        + (sizeof(PrimRef) + sizeof(int)) * (size_t) bvh->prim_count
+        + sizeof(SphereBlock) * (size_t) sphere_block_count(bvh->sphere_count)
+        + sizeof(int) * (size_t) bvh->sphere_count
+        + sizeof(TriangleBlock) * (size_t) triangle_block_count(bvh->triangle_count)
+        + sizeof(TriangleShading) * (size_t) bvh->triangle_count
+        + (sizeof(QuadGeom) + sizeof(int)) * (size_t) bvh->quad_count
+        + sizeof(BvhInstance) * (size_t) bvh->instance_count;
+}
 
-    if (node->left == NULL && node->right == NULL) {
+// Bytes of the nodes traversal reads: the compressed, wide or binary ones. The binary
+// nodes are kept next to the other forms for refitting and ray packets.
+size_t bvh_traversal_node_bytes(const Bvh *bvh) {
+    if (bvh->compressed_nodes != NULL) return sizeof(CompressedBvhNode) * (size_t) bvh->compressed_node_count;
+    if (bvh->wide_nodes != NULL) return sizeof(WideBvhNode) * (size_t) bvh->wide_node_count;
+    return sizeof(BvhNode) * (size_t) bvh->node_count;
+}
+
+void analyze_depth(const Bvh *bvh, int index, int currentDepth, int *maxDepth, int *totalLeaves, int *depthSum) {
+    if (index >= bvh->node_count) return;
+
+    const BvhNode *node = &bvh->nodes[index];
+    if (is_leaf(node)) {
         // Leaf node
         *totalLeaves += 1;
         *depthSum += currentDepth;
@@ -53,8 +216,8 @@ void analyze_depth(const BvhNode *node, int currentDepth, int *maxDepth, int *to
         return;
     }
 
-    analyze_depth(node->left, currentDepth + 1, maxDepth, totalLeaves, depthSum);
-    analyze_depth(node->right, currentDepth + 1, maxDepth, totalLeaves, depthSum);
+    analyze_depth(bvh, index + 1, currentDepth + 1, maxDepth, totalLeaves, depthSum);
+    analyze_depth(bvh, node->offset, currentDepth + 1, maxDepth, totalLeaves, depthSum);
 }
 
 // Function to calculate the overlap volume between two AABBs
@@ -69,214 +232,1621 @@ double overlap_volume(AABB a, AABB b) {
     return 0; // No overlap
 }
 
-// Recursive function to calculate the total overlap volume in the BVH
-double calculate_total_overlap(const BvhNode *node) {
-    if (node == NULL || node->left == NULL || node->right == NULL) {
-        return 0; // Base case: no overlap if node or its children are NULL
+// Function to calculate the total overlap volume between siblings in the BVH
+double calculate_total_overlap(const Bvh *bvh) {
+    double overlap = 0;
+    for (int i = 0; i < bvh->node_count; i++) {
+        const BvhNode *node = &bvh->nodes[i];
+        if (!is_leaf(node)) {
+            overlap += overlap_volume(bvh->nodes[i + 1].bbox, bvh->nodes[node->offset].bbox);
+        }
+    }
+
+    return overlap;
+}
+
+void free_bvh(Bvh *bvh) {
+    if (bvh == NULL) {
+        return;
+    }
+
+    free(bvh->nodes);
+    free(bvh->wide_nodes);
+    free(bvh->compressed_nodes);
+    free(bvh->prim_refs);
+    free(bvh->prim_sources);
+    free(bvh->sphere_blocks);
+    free(bvh->sphere_mat_ids);
+    free(bvh->triangle_blocks);
+    free(bvh->triangle_shading);
+    free(bvh->quads);
+    free(bvh->quad_mat_ids);
+    free(bvh->instances);
+    free(bvh);
+}
+
+
+// Builders
+
+#define BVH_SAH_TRAVERSAL_COST 1.0
+#define BVH_SAH_INTERSECT_COST 1.0
+#define BVH_MAX_BINS 64
+
+// Traversal keeps a fixed-size stack, which holds at most one entry per tree level.
+// Past BVH_MAX_SAH_DEPTH the SAH builder falls back to balanced median splits,
+// which keeps every tree within BVH_STACK_SIZE levels.
+#define BVH_STACK_SIZE 64
+#define BVH_MAX_SAH_DEPTH 32
+
+// Leaf sizes have to fit BvhNode.count
+#define BVH_MAX_LEAF_SIZE UINT16_MAX
+
+BvhBuildConfig default_bvh_build_config() {
+    return (BvhBuildConfig) {.split_method = BVH_SPLIT_SAH, .num_bins = 16, .max_leaf_size = 4, .spatial_split_budget = 0.25};
+}
+
+BvhBuildConfig clamp_bvh_build_config(BvhBuildConfig config) {
+    if (config.num_bins < 2) config.num_bins = 2;
+    if (config.num_bins > BVH_MAX_BINS) config.num_bins = BVH_MAX_BINS;
+    if (config.max_leaf_size < 1) config.max_leaf_size = 1;
+    if (config.max_leaf_size > BVH_MAX_LEAF_SIZE) config.max_leaf_size = BVH_MAX_LEAF_SIZE;
+    if (!(config.spatial_split_budget > 0)) config.spatial_split_budget = 0;
+
+    return config;
+}
+
+// Primitives a tree is built over, any of the arrays may be empty
+typedef struct BvhPrimitives {
+    const Sphere *spheres;
+    int sphere_count;
+    const Triangle *triangles;
+    int triangle_count;
+    const Quad *quads;
+    int quad_count;
+    const Instance *instances;
+    int instance_count;
+} BvhPrimitives;
+
+// Which of the scene's arrays build prim index refers to, index becomes the position in that array.
+// Build prims are numbered spheres first, then triangles, quads and instances.
+PrimType bvh_primitive_type(const BvhPrimitives *scene, int *index) {
+    if (*index < scene->sphere_count) return PRIM_SPHERE;
+    *index -= scene->sphere_count;
+    if (*index < scene->triangle_count) return PRIM_TRIANGLE;
+    *index -= scene->triangle_count;
+    if (*index < scene->quad_count) return PRIM_QUAD;
+    *index -= scene->quad_count;
+    return PRIM_INSTANCE;
+}
+
+AABB bvh_primitive_bbox(const BvhPrimitives *scene, int index) {
+    switch (bvh_primitive_type(scene, &index)) {
+        case PRIM_SPHERE:
+            return create_aabb_for_sphere(&scene->spheres[index]);
+        case PRIM_TRIANGLE:
+            return create_aabb_for_triangle(&scene->triangles[index]);
+        case PRIM_QUAD:
+            return create_aabb_for_quad(scene->quads[index]);
+        default: {
+            const Instance *instance = &scene->instances[index];
+            assert(instance->bvh->instance_count == 0 && instance->bvh->node_count > 0);
+            return transform_aabb(&instance->object_to_world, &instance->bvh->nodes[0].bbox);
+        }
     }
+}
+
+// Per-primitive data the builders work on, instead of moving whole primitives around
+typedef struct BvhBuildPrim {
+    AABB bbox;
+    Point3 centroid;
+    int index;
+} BvhBuildPrim;
+
+// State shared by the recursive builders, nodes are appended in depth-first order
+typedef struct BvhBuilder {
+    BvhNode *nodes;
+    int node_count;
+    BvhBuildPrim *prims;
+    BvhBuildConfig config;
 
-    double overlap = overlap_volume(node->left->bbox, node->right->bbox);
-    return overlap + calculate_total_overlap(node->left) + calculate_total_overlap(node->right);
+    // Spatial splits: the primitives to clip, how many references the leaves hold so far
+    // and how many more the budget allows
+    const BvhPrimitives *scene;
+    int prim_count;
+    int spare_refs;
+} BvhBuilder;
+
+BvhBuildPrim make_build_prim(AABB bbox, int index) {
+    return (BvhBuildPrim) {
+        .bbox = bbox,
+        .centroid = {
+            .x = (bbox.x.min + bbox.x.max) / 2,
+            .y = (bbox.y.min + bbox.y.max) / 2,
+            .z = (bbox.z.min + bbox.z.max) / 2,
+        },
+        .index = index
+    };
 }
 
-// TODO: Implement a memory pool to keep number scene objects fixed
-BvhNode* allocate_bvh();
+real centroid_dim(const BvhBuildPrim *prim, int axis) {
+    if (axis == 1) return prim->centroid.y;
+    if (axis == 2) return prim->centroid.z;
 
-void free_bvh(BvhNode *node) {
-    if (node == NULL) {
-        return; // Base case: node is null
+    return prim->centroid.x;
+}
+
+// Append a node bounding prims [start, start + length), returns its index
+int push_bvh_node(BvhBuilder *builder, int start, int length) {
+    int index = builder->node_count++;
+    BvhNode *node = &builder->nodes[index];
+
+    node->bbox = create_empty_aabb();
+    for (int i = start; i < start + length; i++) {
+        node->bbox = create_aabb_for_aabb(&node->bbox, &builder->prims[i].bbox);
     }
+    node->offset = start;
+    node->count = (uint16_t) length; // only kept for leaves, which never exceed BVH_MAX_LEAF_SIZE
+    node->axis = 0;
 
-    // Recursively free left and right subtrees
+    return index;
+}
+
+void split_bvh_node(BvhBuilder *builder, int index, int axis, int right) {
+    builder->nodes[index].offset = right;
+    builder->nodes[index].count = 0;
+    builder->nodes[index].axis = (uint16_t) axis;
+}
+
+
+// Binned Surface Area Heuristic builder
+
+typedef struct BvhBin {
+    AABB bbox;
+    int count;
+} BvhBin;
 
-    free_bvh(node->left);
-    free_bvh(node->right);
+int bin_index(real c, Interval bounds, int num_bins) {
+    int b = (int) ((real) num_bins * (c - bounds.min) / size_interval(bounds));
+    if (b < 0) return 0;
+    if (b >= num_bins) return num_bins - 1;
 
-    // Finally, free the node itself
-    free((Sphere*) node->sphere);
-    free((Triangle*) node->triangle);
-    free(node);
+    return b;
 }
 
-int sortAxis;
+// Find the cheapest binned split of prims, returns false if the centroids can't be separated.
+bool find_sah_split(const BvhBuildPrim prims[], int length, const AABB *bbox, int num_bins, int *best_axis, int *best_bin, double *best_cost) {
+    AABB centroid_bounds = create_empty_aabb();
+    for (int i = 0; i < length; i++) {
+        AABB c = create_aabb_for_point(prims[i].centroid, prims[i].centroid);
+        centroid_bounds = create_aabb_for_aabb(&centroid_bounds, &c);
+    }
+
+    double parent_area = surface_area_aabb(bbox);
+    bool found = false;
+    *best_cost = INFINITY;
 
-int compareCentroids(const void* a, const void* b) {
-    Vec3* centroidA = (Vec3*)a;
-    Vec3* centroidB = (Vec3*)b;
+    for (int axis = 0; axis < 3; axis++) {
+        Interval bounds = get_axis_from_aabb(&centroid_bounds, axis);
+        if (size_interval(bounds) <= 0) continue;
+
+        BvhBin bins[BVH_MAX_BINS];
+        for (int b = 0; b < num_bins; b++) {
+            bins[b] = (BvhBin) {.bbox = create_empty_aabb(), .count = 0};
+        }
+        for (int i = 0; i < length; i++) {
+            int b = bin_index(centroid_dim(&prims[i], axis), bounds, num_bins);
+            bins[b].count++;
+            bins[b].bbox = create_aabb_for_aabb(&bins[b].bbox, &prims[i].bbox);
+        }
+
+        // Sweep from the right to get the area and count on the right of every plane
+        double right_area[BVH_MAX_BINS];
+        int right_count[BVH_MAX_BINS];
+        AABB right_box = create_empty_aabb();
+        int count = 0;
+        for (int b = num_bins - 1; b > 0; b--) {
+            right_box = create_aabb_for_aabb(&right_box, &bins[b].bbox);
+            count += bins[b].count;
+            right_area[b] = surface_area_aabb(&right_box);
+            right_count[b] = count;
+        }
 
-    if (sortAxis == 0) { // Sorting along the x-axis
-        return (centroidA->x > centroidB->x) - (centroidA->x < centroidB->x);
-    } else if (sortAxis == 1) { // Sorting along the y-axis
-        return (centroidA->y > centroidB->y) - (centroidA->y < centroidB->y);
-    } else { // Sorting along the z-axis
-        return (centroidA->z > centroidB->z) - (centroidA->z < centroidB->z);
+        AABB left_box = create_empty_aabb();
+        count = 0;
+        for (int b = 1; b < num_bins; b++) {
+            left_box = create_aabb_for_aabb(&left_box, &bins[b - 1].bbox);
+            count += bins[b - 1].count;
+            if (count == 0 || right_count[b] == 0) continue;
+
+            double left_area = surface_area_aabb(&left_box);
+            double cost = BVH_SAH_TRAVERSAL_COST + BVH_SAH_INTERSECT_COST
+                * (count * left_area + right_count[b] * right_area[b]) / parent_area;
+            if (cost < *best_cost) {
+                *best_cost = cost;
+                *best_axis = axis;
+                *best_bin = b;
+                found = true;
+            }
+        }
     }
+
+    return found;
 }
 
-// Function to build the BVH
-BvhNode* build_bvh_sphere_fast(Sphere spheres[], int length, int depth) {
-    BvhNode* node = (BvhNode*)malloc(sizeof(BvhNode));
-    node->left = node->right = NULL;
-    node->triangle = NULL;
-    node->sphere = NULL;
-    node->sphere_count = 0;
+// Move every primitive whose centroid falls left of the split plane to the front, returns the split index.
+int partition_build_prims(BvhBuildPrim prims[], int length, int axis, int split_bin, int num_bins) {
+    AABB centroid_bounds = create_empty_aabb();
+    for (int i = 0; i < length; i++) {
+        AABB c = create_aabb_for_point(prims[i].centroid, prims[i].centroid);
+        centroid_bounds = create_aabb_for_aabb(&centroid_bounds, &c);
+    }
+    Interval bounds = get_axis_from_aabb(&centroid_bounds, axis);
 
-    if (length <= 0) {
-        return node;
+    int mid = 0;
+    for (int i = 0; i < length; i++) {
+        if (bin_index(centroid_dim(&prims[i], axis), bounds, num_bins) < split_bin) {
+            BvhBuildPrim tmp = prims[mid];
+            prims[mid++] = prims[i];
+            prims[i] = tmp;
+        }
     }
 
-    // Compute overall bounding box for this node
-    node->bbox = create_aabb_for_sphere(&spheres[0]);
-    for (int i = 1; i < length; ++i) {
-        AABB tri_box = create_aabb_for_sphere(&spheres[i]);
-        node->bbox = create_aabb_for_aabb(&node->bbox, &tri_box);
+    return mid;
+}
+
+int build_bvh_median_recursive(BvhBuilder *builder, int start, int length);
+
+int build_bvh_sah_recursive(BvhBuilder *builder, int start, int length, int depth) {
+    if (depth >= BVH_MAX_SAH_DEPTH) {
+        return build_bvh_median_recursive(builder, start, length);
     }
 
-    // Base case: if there's only one triangle, this is a leaf node
+    int index = push_bvh_node(builder, start, length);
     if (length == 1) {
-        node->sphere = spheres;
-        node->sphere_count = 1;
-        return node;
+        return index;
     }
 
-    // Calculate centroids to determine splitting point
-    Vec3* centroids = (Vec3*)malloc(sizeof(Vec3) * length);
-    for (int i = 0; i < length; ++i) {
-        centroids[i] = spheres->center;
+    BvhBuildPrim *prims = builder->prims + start;
+    int axis = 0, split_bin;
+    double cost;
+    bool can_split = find_sah_split(prims, length, &builder->nodes[index].bbox, builder->config.num_bins, &axis, &split_bin, &cost);
+
+    // Stop when testing every primitive is no more expensive than the best split
+    bool fits_leaf = length <= builder->config.max_leaf_size;
+    if (fits_leaf && (!can_split || BVH_SAH_INTERSECT_COST * length <= cost)) {
+        return index;
     }
 
-    // Choose the axis to split based on the depth
-    Vec3 extent = diff_vec3((Vec3) {node->bbox.x.max, node->bbox.y.max, node->bbox.z.max}, (Vec3) {node->bbox.x.min, node->bbox.y.min, node->bbox.z.min});
-    if (extent.x > extent.y && extent.x > extent.z) sortAxis = 0;
-    if (extent.y > extent.x && extent.y > extent.z) sortAxis = 1;
-    if (extent.z > extent.x && extent.z > extent.y) sortAxis = 2;
+    int mid = length / 2; // coincident centroids, any split is as good as another
+    if (can_split) {
+        mid = partition_build_prims(prims, length, axis, split_bin, builder->config.num_bins);
+    }
 
-    // Sort centroids
-    qsort(centroids, length, sizeof(Vec3), compareCentroids);
+    build_bvh_sah_recursive(builder, start, mid, depth + 1);
+    int right = build_bvh_sah_recursive(builder, start + mid, length - mid, depth + 1);
+    split_bvh_node(builder, index, axis, right);
 
-    // Split triangles into two groups at the median
-    int median = length / 2;
+    return index;
+}
 
-    Sphere* leftSpheres = (Sphere*)malloc(sizeof(Sphere) * median);
-    Sphere* rightSpheres = (Sphere*)malloc(sizeof(Sphere) * (length - median));
-    int leftCount = 0, rightCount = 0;
 
-    for (int i = 0; i < length; ++i) {
-        if (i < median) {
-            leftSpheres[leftCount++] = spheres[i];
+// Median split builder
+
+int longest_axis_aabb(const AABB *bbox) {
+    double dx = size_interval(bbox->x);
+    double dy = size_interval(bbox->y);
+    double dz = size_interval(bbox->z);
+
+    if (dx >= dy && dx >= dz) return 0;
+    return (dy >= dz) ? 1 : 2;
+}
+
+// nth_element for build prims: afterwards prims[k] holds the k-th smallest centroid along
+// axis, with no larger centroid before it and no smaller one after it.
+void select_build_prims(BvhBuildPrim prims[], int length, int k, int axis) {
+    int lo = 0;
+    int hi = length - 1;
+    while (lo < hi) {
+        real pivot = centroid_dim(&prims[lo + (hi - lo) / 2], axis);
+        int i = lo;
+        int j = hi;
+        while (i <= j) {
+            while (centroid_dim(&prims[i], axis) < pivot) i++;
+            while (centroid_dim(&prims[j], axis) > pivot) j--;
+            if (i <= j) {
+                BvhBuildPrim tmp = prims[i];
+                prims[i++] = prims[j];
+                prims[j--] = tmp;
+            }
+        }
+
+        if (k <= j) {
+            hi = j;
+        } else if (k >= i) {
+            lo = i;
         } else {
-            rightSpheres[rightCount++] = spheres[i];
+            return;
         }
     }
+}
+
+int build_bvh_median_recursive(BvhBuilder *builder, int start, int length) {
+    int index = push_bvh_node(builder, start, length);
+
+    // Base case: few enough primitives, this is a leaf node
+    if (length <= builder->config.max_leaf_size) {
+        return index;
+    }
+
+    // Partition the primitives themselves around the median centroid of the longest axis
+    int median = length / 2;
+    int axis = longest_axis_aabb(&builder->nodes[index].bbox);
+    select_build_prims(builder->prims + start, length, median, axis);
 
     // Recursively build left and right children
-    node->left = build_bvh_sphere_fast(leftSpheres, leftCount, depth + 1);
-    node->right = build_bvh_sphere_fast(rightSpheres, rightCount, depth + 1);
+    build_bvh_median_recursive(builder, start, median);
+    int right = build_bvh_median_recursive(builder, start + median, length - median);
+    split_bvh_node(builder, index, axis, right);
 
-    free(centroids);
+    return index;
+}
 
-    return node;
+// Spatial split builder (Stich et al., SBVH)
+//
+// Besides the object splits of the SAH builder, a node can be cut at one of its bin
+// planes. References that straddle the plane go to both children, each clipped to its
+// side, so long or slanted triangles stop stretching the boxes of their siblings.
+// Every straddling reference is one more leaf entry, and with it one more copy of the
+// primitive, spatial_split_budget caps how many the whole tree adds.
+
+// Spatial splits are only tried where the children of the object split overlap by
+// more than this fraction of the root's surface area
+#define BVH_SPATIAL_SPLIT_ALPHA 1e-5
+
+real point_dim(Point3 p, int axis) {
+    if (axis == 1) return p.y;
+    if (axis == 2) return p.z;
+
+    return p.x;
+}
+
+Interval *aabb_axis(AABB *bbox, int axis) {
+    if (axis == 1) return &bbox->y;
+    if (axis == 2) return &bbox->z;
+
+    return &bbox->x;
 }
 
-// Function to build the BVH
-BvhNode* build_bvh_fast(Triangle triangles[], int length, int depth) {
-    BvhNode* node = (BvhNode*)malloc(sizeof(BvhNode));
-    node->left = node->right = NULL;
-    node->triangle = NULL;
-    node->sphere = NULL;
-    node->triangle_count = 0;
+bool is_empty_aabb(const AABB *bbox) {
+    return bbox->x.min > bbox->x.max || bbox->y.min > bbox->y.max || bbox->z.min > bbox->z.max;
+}
 
-    if (length <= 0) {
-        return node;
+// Box of the part of ref's primitive between lo and hi along axis, inside ref's box.
+// Triangles are clipped exactly, other primitives keep their box cut at the planes.
+// Empty if nothing of the primitive is left.
+AABB clip_build_prim(const BvhPrimitives *scene, const BvhBuildPrim *ref, int axis, real lo, real hi) {
+    AABB part = ref->bbox;
+    int index = ref->index;
+    if (bvh_primitive_type(scene, &index) == PRIM_TRIANGLE) {
+        const Triangle *t = &scene->triangles[index];
+        Point3 v[3] = {t->v1, t->v2, t->v3};
+        real planes[2] = {lo, hi};
+        part = create_empty_aabb();
+        for (int i = 0; i < 3; i++) {
+            Point3 a = v[i];
+            Point3 b = v[(i + 1) % 3];
+            real da = point_dim(a, axis);
+            real db = point_dim(b, axis);
+            if (da >= lo && da <= hi) {
+                AABB corner = create_aabb_for_point(a, a);
+                part = create_aabb_for_aabb(&part, &corner);
+            }
+            for (int k = 0; k < 2; k++) {
+                if ((da - planes[k]) * (db - planes[k]) < 0) {
+                    Point3 p = add_vec3(a, scale_vec3(diff_vec3(b, a), (planes[k] - da) / (db - da)));
+                    AABB crossing = create_aabb_for_point(p, p);
+                    part = create_aabb_for_aabb(&part, &crossing);
+                }
+            }
+        }
     }
 
-    // Compute overall bounding box for this node
-    node->bbox = create_aabb_for_triangle(&triangles[0]);
-    for (int i = 1; i < length; ++i) {
-        AABB tri_box = create_aabb_for_triangle(&triangles[i]);
-        node->bbox = create_aabb_for_aabb(&node->bbox, &tri_box);
+    for (int i = 0; i < 3; i++) {
+        Interval *bounds = aabb_axis(&part, i);
+        Interval limit = get_axis_from_aabb(&ref->bbox, i);
+        bounds->min = fmax(bounds->min, limit.min);
+        bounds->max = fmin(bounds->max, limit.max);
     }
+    Interval *slab = aabb_axis(&part, axis);
+    slab->min = fmax(slab->min, lo);
+    slab->max = fmin(slab->max, hi);
+
+    // Flat parts get the same padding as flat primitives
+    return is_empty_aabb(&part) ? create_empty_aabb() : pad(part);
+}
+
+real spatial_split_plane(Interval bounds, int bin, int num_bins) {
+    return bounds.min + size_interval(bounds) * (real) bin / (real) num_bins;
+}
+
+typedef struct BvhSpatialBin {
+    AABB bbox;   // clipped parts of the references in the bin
+    int entries; // references whose box starts in the bin
+    int exits;   // references whose box ends in it
+} BvhSpatialBin;
+
+// Find the cheapest split of bbox at a bin plane that stays within the reference budget,
+// returns false if there is none.
+bool find_spatial_split(const BvhBuilder *builder, const BvhBuildPrim refs[], int length, const AABB *bbox,
+                        int *best_axis, int *best_bin, double *best_cost) {
+    int num_bins = builder->config.num_bins;
+    double parent_area = surface_area_aabb(bbox);
+    bool found = false;
+    *best_cost = INFINITY;
+
+    for (int axis = 0; axis < 3; axis++) {
+        Interval bounds = get_axis_from_aabb(bbox, axis);
+        if (size_interval(bounds) <= 0) continue;
+
+        BvhSpatialBin bins[BVH_MAX_BINS];
+        for (int b = 0; b < num_bins; b++) {
+            bins[b] = (BvhSpatialBin) {.bbox = create_empty_aabb(), .entries = 0, .exits = 0};
+        }
+        for (int i = 0; i < length; i++) {
+            Interval extent = get_axis_from_aabb(&refs[i].bbox, axis);
+            int first = bin_index(extent.min, bounds, num_bins);
+            int last = bin_index(extent.max, bounds, num_bins);
+            bins[first].entries++;
+            bins[last].exits++;
+            if (first == last) {
+                bins[first].bbox = create_aabb_for_aabb(&bins[first].bbox, &refs[i].bbox);
+                continue;
+            }
+            for (int b = first; b <= last; b++) {
+                // The outer bins reach past the planes, so the whole primitive is binned
+                real lo = spatial_split_plane(bounds, b, num_bins);
+                real hi = spatial_split_plane(bounds, b + 1, num_bins);
+                if (b == first) lo = -INFINITY;
+                if (b == last) hi = INFINITY;
+                AABB part = clip_build_prim(builder->scene, &refs[i], axis, lo, hi);
+                bins[b].bbox = create_aabb_for_aabb(&bins[b].bbox, &part);
+            }
+        }
 
-    // Base case: if there's only one triangle, this is a leaf node
+        // Same sweeps as find_sah_split, references count on every side they reach
+        double right_area[BVH_MAX_BINS];
+        int right_count[BVH_MAX_BINS];
+        AABB right_box = create_empty_aabb();
+        int count = 0;
+        for (int b = num_bins - 1; b > 0; b--) {
+            right_box = create_aabb_for_aabb(&right_box, &bins[b].bbox);
+            count += bins[b].exits;
+            right_area[b] = surface_area_aabb(&right_box);
+            right_count[b] = count;
+        }
+
+        AABB left_box = create_empty_aabb();
+        count = 0;
+        for (int b = 1; b < num_bins; b++) {
+            left_box = create_aabb_for_aabb(&left_box, &bins[b - 1].bbox);
+            count += bins[b - 1].entries;
+            if (count == 0 || right_count[b] == 0) continue;
+            if (count + right_count[b] - length > builder->spare_refs) continue;
+
+            double left_area = surface_area_aabb(&left_box);
+            double cost = BVH_SAH_TRAVERSAL_COST + BVH_SAH_INTERSECT_COST
+                * (count * left_area + right_count[b] * right_area[b]) / parent_area;
+            if (cost < *best_cost) {
+                *best_cost = cost;
+                *best_axis = axis;
+                *best_bin = b;
+                found = true;
+            }
+        }
+    }
+
+    return found;
+}
+
+// Sort refs to the sides of the plane in front of split_bin, clipping the ones that straddle it
+// into both. left and right need room for length references each.
+void split_spatial_refs(const BvhBuilder *builder, const BvhBuildPrim refs[], int length, const AABB *bbox, int axis, int split_bin,
+                        BvhBuildPrim left[], int *left_count, BvhBuildPrim right[], int *right_count) {
+    int num_bins = builder->config.num_bins;
+    Interval bounds = get_axis_from_aabb(bbox, axis);
+    real plane = spatial_split_plane(bounds, split_bin, num_bins);
+
+    *left_count = 0;
+    *right_count = 0;
+    for (int i = 0; i < length; i++) {
+        Interval extent = get_axis_from_aabb(&refs[i].bbox, axis);
+        if (bin_index(extent.max, bounds, num_bins) < split_bin) {
+            left[(*left_count)++] = refs[i];
+        } else if (bin_index(extent.min, bounds, num_bins) >= split_bin) {
+            right[(*right_count)++] = refs[i];
+        } else {
+            AABB left_part = clip_build_prim(builder->scene, &refs[i], axis, -INFINITY, plane);
+            AABB right_part = clip_build_prim(builder->scene, &refs[i], axis, plane, INFINITY);
+            if (is_empty_aabb(&left_part) && is_empty_aabb(&right_part)) {
+                left_part = refs[i].bbox; // lost to rounding, keep the whole box on one side
+            }
+            if (!is_empty_aabb(&left_part)) left[(*left_count)++] = make_build_prim(left_part, refs[i].index);
+            if (!is_empty_aabb(&right_part)) right[(*right_count)++] = make_build_prim(right_part, refs[i].index);
+        }
+    }
+}
+
+// Surface area of the box both sides of the object split [0, mid), [mid, length) share
+double object_split_overlap(const BvhBuildPrim refs[], int length, int mid) {
+    AABB left = create_empty_aabb();
+    AABB right = create_empty_aabb();
+    for (int i = 0; i < length; i++) {
+        if (i < mid) {
+            left = create_aabb_for_aabb(&left, &refs[i].bbox);
+        } else {
+            right = create_aabb_for_aabb(&right, &refs[i].bbox);
+        }
+    }
+
+    AABB shared = create_empty_aabb();
+    for (int i = 0; i < 3; i++) {
+        Interval a = get_axis_from_aabb(&left, i);
+        Interval b = get_axis_from_aabb(&right, i);
+        *aabb_axis(&shared, i) = (Interval) {.min = fmax(a.min, b.min), .max = fmin(a.max, b.max)};
+    }
+    return is_empty_aabb(&shared) ? 0 : surface_area_aabb(&shared);
+}
+
+// Copy refs to the end of the leaf references, returns where they start
+int place_build_prims(BvhBuilder *builder, const BvhBuildPrim refs[], int length) {
+    int start = builder->prim_count;
+    memcpy(builder->prims + start, refs, sizeof(BvhBuildPrim) * length);
+    builder->prim_count += length;
+    return start;
+}
+
+// Unlike the other builders this one doesn't work in place: refs is the node's own list,
+// leaves copy theirs to builder->prims in depth-first order.
+int build_bvh_spatial_recursive(BvhBuilder *builder, BvhBuildPrim refs[], int length, int depth) {
+    if (depth >= BVH_MAX_SAH_DEPTH) {
+        return build_bvh_median_recursive(builder, place_build_prims(builder, refs, length), length);
+    }
     if (length == 1) {
-        node->triangle = triangles;
-        node->triangle_count = 1;
-        return node;
+        return push_bvh_node(builder, place_build_prims(builder, refs, length), length);
+    }
+
+    AABB bbox = create_empty_aabb();
+    for (int i = 0; i < length; i++) {
+        bbox = create_aabb_for_aabb(&bbox, &refs[i].bbox);
     }
+    int index = builder->node_count++;
+    builder->nodes[index].bbox = bbox;
 
-    // Calculate centroids to determine splitting point
-    Vec3* centroids = (Vec3*)malloc(sizeof(Vec3) * length);
-    for (int i = 0; i < length; ++i) {
-        centroids[i] = center_triangle(triangles[i]);
+    int axis = 0, split_bin, mid = length / 2;
+    double cost;
+    bool can_split = find_sah_split(refs, length, &bbox, builder->config.num_bins, &axis, &split_bin, &cost);
+    if (can_split) {
+        mid = partition_build_prims(refs, length, axis, split_bin, builder->config.num_bins);
+    } else {
+        cost = INFINITY;
     }
 
-    // Choose the axis to split based on the depth
-    Vec3 extent = diff_vec3((Vec3) {node->bbox.x.max, node->bbox.y.max, node->bbox.z.max}, (Vec3) {node->bbox.x.min, node->bbox.y.min, node->bbox.z.min});
-    if (extent.x > extent.y && extent.x > extent.z) sortAxis = 0;
-    if (extent.y > extent.x && extent.y > extent.z) sortAxis = 1;
-    if (extent.z > extent.x && extent.z > extent.y) sortAxis = 2;
+    int spatial_axis, spatial_bin;
+    double spatial_cost = INFINITY;
+    double root_area = surface_area_aabb(&builder->nodes[0].bbox);
+    if (builder->spare_refs > 0 && (!can_split || object_split_overlap(refs, length, mid) > BVH_SPATIAL_SPLIT_ALPHA * root_area)) {
+        find_spatial_split(builder, refs, length, &bbox, &spatial_axis, &spatial_bin, &spatial_cost);
+    }
 
-    // Sort centroids
-    qsort(centroids, length, sizeof(Vec3), compareCentroids);
+    // Stop when testing every primitive is no more expensive than the best split
+    bool fits_leaf = length <= builder->config.max_leaf_size;
+    if (fits_leaf && BVH_SAH_INTERSECT_COST * length <= fmin(cost, spatial_cost)) {
+        BvhNode *node = &builder->nodes[index];
+        node->offset = place_build_prims(builder, refs, length);
+        node->count = (uint16_t) length;
+        node->axis = 0;
+        return index;
+    }
 
-    // Split triangles into two groups at the median
-    int median = length / 2;
+    if (spatial_cost < cost) {
+        BvhBuildPrim *left = malloc(sizeof(BvhBuildPrim) * length);
+        BvhBuildPrim *right = malloc(sizeof(BvhBuildPrim) * length);
+        int left_count, right_count;
+        split_spatial_refs(builder, refs, length, &bbox, spatial_axis, spatial_bin, left, &left_count, right, &right_count);
+
+        // Clipping can leave a side empty after all, the object split is used then
+        if (left_count > 0 && right_count > 0) {
+            builder->spare_refs -= left_count + right_count - length;
+            build_bvh_spatial_recursive(builder, left, left_count, depth + 1);
+            int right_child = build_bvh_spatial_recursive(builder, right, right_count, depth + 1);
+            split_bvh_node(builder, index, spatial_axis, right_child);
+            free(left);
+            free(right);
+            return index;
+        }
+        free(left);
+        free(right);
+    }
+
+    build_bvh_spatial_recursive(builder, refs, mid, depth + 1);
+    int right_child = build_bvh_spatial_recursive(builder, refs + mid, length - mid, depth + 1);
+    split_bvh_node(builder, index, axis, right_child);
+
+    return index;
+}
+
+// Build the node array over *prims, the caller then gathers primitives in prims order.
+// Spatial splits replace *prims with the longer list of references the leaves hold.
+Bvh* build_bvh_nodes(BvhBuildPrim **prims, int *length, const BvhPrimitives *scene, BvhBuildConfig config) {
+    Bvh *bvh = calloc(1, sizeof(Bvh));
+    if (*length <= 0) {
+        return bvh;
+    }
+
+    BvhBuilder builder = {
+        .node_count = 0,
+        .prims = *prims,
+        .config = clamp_bvh_build_config(config),
+        .scene = scene
+    };
+
+    if (builder.config.split_method == BVH_SPLIT_SPATIAL) {
+        // Room for every reference the budget allows
+        int capacity = *length + (int) (builder.config.spatial_split_budget * *length);
+        builder.nodes = aligned_alloc(32, sizeof(BvhNode) * (2 * capacity - 1));
+        builder.prims = malloc(sizeof(BvhBuildPrim) * capacity);
+        builder.spare_refs = capacity - *length;
+        build_bvh_spatial_recursive(&builder, *prims, *length, 0);
+
+        free(*prims);
+        *prims = builder.prims;
+        *length = builder.prim_count;
+    } else if (builder.config.split_method == BVH_SPLIT_MEDIAN) {
+        builder.nodes = aligned_alloc(32, sizeof(BvhNode) * (2 * *length - 1));
+        build_bvh_median_recursive(&builder, 0, *length);
+    } else {
+        builder.nodes = aligned_alloc(32, sizeof(BvhNode) * (2 * *length - 1));
+        build_bvh_sah_recursive(&builder, 0, *length, 0);
+    }
+
+    bvh->nodes = builder.nodes;
+    bvh->node_count = builder.node_count;
+    bvh->config = builder.config;
+    return bvh;
+}
+
+// Copy scene primitive index into the slot of ref
+void store_bvh_primitive(Bvh *bvh, PrimRef ref, const BvhPrimitives *scene, int index) {
+    int k = prim_ref_index(ref);
+    switch (bvh_primitive_type(scene, &index)) {
+        case PRIM_SPHERE: {
+            const Sphere *s = &scene->spheres[index];
+            set_block_sphere(bvh->sphere_blocks, k, s->center, s->radius);
+            bvh->sphere_mat_ids[k] = s->mat_id;
+            break;
+        }
+        case PRIM_TRIANGLE: {
+            const Triangle *t = &scene->triangles[index];
+            TriangleGeom geom = make_triangle_geom(t);
+            set_block_triangle(bvh->triangle_blocks, k, &geom);
+            bvh->triangle_shading[k] = (TriangleShading) {.normal = t->normal, .mat_id = t->mat_id};
+            break;
+        }
+        case PRIM_QUAD: {
+            const Quad *q = &scene->quads[index];
+            bvh->quads[k] = make_quad_geom(q);
+            bvh->quad_mat_ids[k] = q->mat_id;
+            break;
+        }
+        default: {
+            const Instance *instance = &scene->instances[index];
+            bvh->instances[k] = (BvhInstance) {
+                .bvh = instance->bvh,
+                .world_to_object = invert_transform(&instance->object_to_world)
+            };
+            break;
+        }
+    }
+}
+
+double calculate_sah_cost(const Bvh *bvh);
+double calculate_refit_sah_cost(Bvh *bvh, BvhPrimitives scene);
+
+Bvh* build_bvh_primitives(BvhPrimitives scene, BvhBuildConfig config) {
+    int length = scene.sphere_count + scene.triangle_count + scene.quad_count + scene.instance_count;
+    assert(length <= (int) PRIM_REF_INDEX_MASK);
+
+    BvhBuildPrim *prims = malloc(sizeof(BvhBuildPrim) * length);
+    for (int i = 0; i < length; i++) {
+        prims[i] = make_build_prim(bvh_primitive_bbox(&scene, i), i);
+    }
+
+    int source_count = length;
+    Bvh *bvh = build_bvh_nodes(&prims, &length, &scene, config);
+    assert(length <= (int) PRIM_REF_INDEX_MASK);
+    bvh->prim_refs = malloc(sizeof(PrimRef) * length);
+    bvh->prim_sources = malloc(sizeof(int) * length);
+    bvh->prim_count = length;
+    bvh->source_count = source_count;
+
+    // Every reference gets its own copy of the primitive, spatial splits make some twice
+    int ref_counts[4] = {0};
+    for (int i = 0; i < length; i++) {
+        int index = prims[i].index;
+        ref_counts[bvh_primitive_type(&scene, &index)]++;
+    }
+    if (ref_counts[PRIM_SPHERE] > 0) {
+        // Lanes past the last sphere are never tested, but are kept initialized
+        size_t block_bytes = sizeof(SphereBlock) * (size_t) sphere_block_count(ref_counts[PRIM_SPHERE]);
+        bvh->sphere_blocks = aligned_alloc(32, block_bytes);
+        memset(bvh->sphere_blocks, 0, block_bytes);
+        bvh->sphere_mat_ids = malloc(sizeof(int) * ref_counts[PRIM_SPHERE]);
+    }
+    if (ref_counts[PRIM_TRIANGLE] > 0) {
+        size_t block_bytes = sizeof(TriangleBlock) * (size_t) triangle_block_count(ref_counts[PRIM_TRIANGLE]);
+        bvh->triangle_blocks = aligned_alloc(32, block_bytes);
+        memset(bvh->triangle_blocks, 0, block_bytes);
+        bvh->triangle_shading = malloc(sizeof(TriangleShading) * ref_counts[PRIM_TRIANGLE]);
+    }
+    if (ref_counts[PRIM_QUAD] > 0) {
+        bvh->quads = malloc(sizeof(QuadGeom) * ref_counts[PRIM_QUAD]);
+        bvh->quad_mat_ids = malloc(sizeof(int) * ref_counts[PRIM_QUAD]);
+    }
+    if (ref_counts[PRIM_INSTANCE] > 0) {
+        bvh->instances = malloc(sizeof(BvhInstance) * ref_counts[PRIM_INSTANCE]);
+    }
+
+    // Each type's arrays are filled in the order the leaves reference them
+    for (int i = 0; i < length; i++) {
+        int index = prims[i].index;
+        int type_index = index;
+        PrimType type = bvh_primitive_type(&scene, &type_index);
+        int k;
+        switch (type) {
+            case PRIM_SPHERE: k = bvh->sphere_count++; break;
+            case PRIM_TRIANGLE: k = bvh->triangle_count++; break;
+            case PRIM_QUAD: k = bvh->quad_count++; break;
+            default: k = bvh->instance_count++; break;
+        }
+        bvh->prim_refs[i] = make_prim_ref(type, k);
+        bvh->prim_sources[i] = index;
+        store_bvh_primitive(bvh, bvh->prim_refs[i], &scene, index);
+    }
+
+    free(prims);
+    if (config.split_method == BVH_SPLIT_SPATIAL) {
+        bvh->build_sah_cost = calculate_refit_sah_cost(bvh, scene);
+    } else {
+        bvh->build_sah_cost = calculate_sah_cost(bvh);
+    }
+    return bvh;
+}
+
+Bvh* build_bvh_spheres(const Sphere spheres[], int length, BvhBuildConfig config) {
+    return build_bvh_primitives((BvhPrimitives) {.spheres = spheres, .sphere_count = length}, config);
+}
+
+Bvh* build_bvh_triangles(const Triangle triangles[], int length, BvhBuildConfig config) {
+    return build_bvh_primitives((BvhPrimitives) {.triangles = triangles, .triangle_count = length}, config);
+}
+
+Bvh* build_bvh_quads(const Quad quads[], int length, BvhBuildConfig config) {
+    return build_bvh_primitives((BvhPrimitives) {.quads = quads, .quad_count = length}, config);
+}
+
+// Top-level tree over placed copies of other trees
+Bvh* build_bvh_instances(const Instance instances[], int length, BvhBuildConfig config) {
+    return build_bvh_primitives((BvhPrimitives) {.instances = instances, .instance_count = length}, config);
+}
+
+Bvh* build_bvh_sah(Sphere spheres[], int length, BvhBuildConfig config) {
+    config.split_method = BVH_SPLIT_SAH;
+    return build_bvh_spheres(spheres, length, config);
+}
+
+Bvh* build_bvh_tri_sah(Triangle triangles[], int length, BvhBuildConfig config) {
+    config.split_method = BVH_SPLIT_SAH;
+    return build_bvh_triangles(triangles, length, config);
+}
+
+// Median-split BVH, kept for callers of the old recursive builder
+Bvh* build_bvh_sphere_fast(Sphere spheres[], int length) {
+    BvhBuildConfig config = default_bvh_build_config();
+    config.split_method = BVH_SPLIT_MEDIAN;
+    return build_bvh_spheres(spheres, length, config);
+}
+
+// Median-split BVH over triangles
+Bvh* build_bvh_fast(Triangle triangles[], int length) {
+    BvhBuildConfig config = default_bvh_build_config();
+    config.split_method = BVH_SPLIT_MEDIAN;
+    return build_bvh_triangles(triangles, length, config);
+}
+
+Bvh* build_bvh(Sphere spheres[], int length, int max_spheres) {
+    BvhBuildConfig config = default_bvh_build_config();
+    config.max_leaf_size = max_spheres;
+    return build_bvh_spheres(spheres, length, config);
+}
+
+Bvh* build_bvh_tri(Triangle triangles[], int length, int max_triangles) {
+    BvhBuildConfig config = default_bvh_build_config();
+    config.max_leaf_size = max_triangles;
+    return build_bvh_triangles(triangles, length, config);
+}
+
+Bvh* build_bvh_quad(Quad quads[], int length, int max_quads) {
+    BvhBuildConfig config = default_bvh_build_config();
+    config.max_leaf_size = max_quads;
+    return build_bvh_quads(quads, length, config);
+}
 
-    Triangle* leftTriangles = (Triangle*)malloc(sizeof(Triangle) * median);
-    Triangle* rightTriangles = (Triangle*)malloc(sizeof(Triangle) * (length - median));
-    int leftCount = 0, rightCount = 0;
+// Expected cost of tracing a ray through the tree, in units of one primitive test.
+// Lower is better, compare alongside calculate_total_overlap.
+double calculate_sah_cost(const Bvh *bvh) {
+    if (bvh->node_count == 0) return 0;
 
-    for (int i = 0; i < length; ++i) {
-        if (i < median) {
-            leftTriangles[leftCount++] = triangles[i];
+    double root_area = surface_area_aabb(&bvh->nodes[0].bbox);
+    if (root_area <= 0) return 0;
+
+    double cost = 0;
+    for (int i = 0; i < bvh->node_count; i++) {
+        const BvhNode *node = &bvh->nodes[i];
+        double rel_area = (double) surface_area_aabb(&node->bbox) / root_area;
+        if (is_leaf(node)) {
+            cost += BVH_SAH_INTERSECT_COST * rel_area * node->count;
         } else {
-            rightTriangles[rightCount++] = triangles[i];
+            cost += BVH_SAH_TRAVERSAL_COST * rel_area;
         }
     }
 
-    // Recursively build left and right children
-    node->left = build_bvh_fast(leftTriangles, leftCount, depth + 1);
-    node->right = build_bvh_fast(rightTriangles, rightCount, depth + 1);
+    return cost;
+}
+
 
-    free(centroids);
+// Wide BVH
+
+// Collapse the binary subtree at binary_index into wide nodes, returns the wide node index.
+// Each wide node pulls in grandchildren, opening the child with the largest surface area
+// first, until all WIDE_BVH_WIDTH lanes are used or only leaves remain.
+int collapse_wide_node(Bvh *bvh, int binary_index) {
+    const BvhNode *nodes = bvh->nodes;
+    int index = bvh->wide_node_count++;
+
+    int slots[WIDE_BVH_WIDTH];
+    int n = 0;
+    if (is_leaf(&nodes[binary_index])) {
+        slots[n++] = binary_index; // only happens for a root leaf
+    } else {
+        slots[n++] = binary_index + 1;
+        slots[n++] = nodes[binary_index].offset;
+    }
 
+    while (n < WIDE_BVH_WIDTH) {
+        int best = -1;
+        double best_area = -1;
+        for (int i = 0; i < n; i++) {
+            double area = surface_area_aabb(&nodes[slots[i]].bbox);
+            if (!is_leaf(&nodes[slots[i]]) && area > best_area) {
+                best = i;
+                best_area = area;
+            }
+        }
+        if (best < 0) break;
+
+        int opened = slots[best];
+        slots[best] = opened + 1;
+        slots[n++] = nodes[opened].offset;
+    }
+
+    // Fill the lanes, unused ones get a degenerate box and are masked out by child_count
+    int child[WIDE_BVH_WIDTH] = {0};
+    int count[WIDE_BVH_WIDTH] = {0};
+    for (int i = 0; i < n; i++) {
+        const BvhNode *node = &nodes[slots[i]];
+        if (is_leaf(node)) {
+            child[i] = node->offset;
+            count[i] = node->count;
+        } else {
+            child[i] = collapse_wide_node(bvh, slots[i]);
+        }
+    }
+
+    WideBvhNode *wide = &bvh->wide_nodes[index];
+    *wide = (WideBvhNode) {.child_count = n};
+    for (int i = 0; i < n; i++) {
+        const AABB *b = &nodes[slots[i]].bbox;
+        wide->min_x[i] = b->x.min; wide->max_x[i] = b->x.max;
+        wide->min_y[i] = b->y.min; wide->max_y[i] = b->y.max;
+        wide->min_z[i] = b->z.min; wide->max_z[i] = b->z.max;
+        wide->child[i] = child[i];
+        wide->count[i] = count[i];
+    }
+
+    return index;
+}
+
+// Build the wide form of an already built tree, traversal switches over to it
+void collapse_bvh_wide(Bvh *bvh) {
+    free(bvh->wide_nodes);
+    free(bvh->compressed_nodes);
+    bvh->wide_nodes = NULL;
+    bvh->compressed_nodes = NULL;
+    bvh->wide_node_count = 0;
+    bvh->compressed_node_count = 0;
+    if (bvh->node_count == 0) {
+        return;
+    }
+
+    // Every wide node consumes at least one binary interior node, plus one for a root leaf
+    bvh->wide_nodes = aligned_alloc(32, sizeof(WideBvhNode) * bvh->node_count);
+    collapse_wide_node(bvh, 0);
+}
+
+
+
+// Compressed wide BVH
+
+// Grid step for [lo, hi]: the smallest power of two that covers it in BVH_QUANT_STEPS steps
+real quantize_step(real lo, real hi) {
+    int exponent;
+    frexp((double) (hi - lo) / BVH_QUANT_STEPS, &exponent);
+    real step = (real) ldexp(1.0, exponent);
+    while (lo + step * BVH_QUANT_STEPS < hi) {
+        step *= 2;
+    }
+    return step;
+}
+
+// Grid planes at or below value and at or above it. The floor and ceil give the answer
+// up to rounding, the loops make sure the plane computed like traversal does is outside.
+uint8_t quantize_min(real origin, real step, real value) {
+    int q = (int) fmax(0, fmin(BVH_QUANT_STEPS, floor((value - origin) / step)));
+    while (q > 0 && origin + (real) q * step > value) {
+        q--;
+    }
+    return (uint8_t) q;
+}
+
+uint8_t quantize_max(real origin, real step, real value) {
+    int q = (int) fmax(0, fmin(BVH_QUANT_STEPS, ceil((value - origin) / step)));
+    while (q < BVH_QUANT_STEPS && origin + (real) q * step < value) {
+        q++;
+    }
+    return (uint8_t) q;
+}
+
+CompressedBvhNode compress_wide_node(const WideBvhNode *wide) {
+    CompressedBvhNode node = {.child_count = (uint16_t) wide->child_count};
+    const real *mins[3] = {wide->min_x, wide->min_y, wide->min_z};
+    const real *maxs[3] = {wide->max_x, wide->max_y, wide->max_z};
+    uint8_t *q_mins[3] = {node.min_x, node.min_y, node.min_z};
+    uint8_t *q_maxs[3] = {node.max_x, node.max_y, node.max_z};
+
+    for (int axis = 0; axis < 3; axis++) {
+        real lo = mins[axis][0];
+        real hi = maxs[axis][0];
+        for (int i = 1; i < wide->child_count; i++) {
+            lo = fmin(lo, mins[axis][i]);
+            hi = fmax(hi, maxs[axis][i]);
+        }
+        node.origin[axis] = lo;
+        node.scale[axis] = quantize_step(lo, hi);
+        for (int i = 0; i < wide->child_count; i++) {
+            q_mins[axis][i] = quantize_min(lo, node.scale[axis], mins[axis][i]);
+            q_maxs[axis][i] = quantize_max(lo, node.scale[axis], maxs[axis][i]);
+        }
+    }
+    for (int i = 0; i < wide->child_count; i++) {
+        node.child[i] = wide->child[i];
+        node.count[i] = (uint16_t) wide->count[i];
+    }
     return node;
 }
 
+// Build the quantized wide form of an already built tree, traversal switches over to it.
+// Same topology as collapse_bvh_wide, whose nodes are only kept while compressing.
+void compress_bvh_wide(Bvh *bvh) {
+    collapse_bvh_wide(bvh);
+    if (bvh->wide_nodes == NULL) {
+        return;
+    }
+
+    bvh->compressed_node_count = bvh->wide_node_count;
+    bvh->compressed_nodes = aligned_alloc(64, sizeof(CompressedBvhNode) * (size_t) bvh->compressed_node_count);
+    for (int i = 0; i < bvh->wide_node_count; i++) {
+        bvh->compressed_nodes[i] = compress_wide_node(&bvh->wide_nodes[i]);
+    }
+
+    free(bvh->wide_nodes);
+    bvh->wide_nodes = NULL;
+    bvh->wide_node_count = 0;
+}
+
+
+// Refit
+
+// Tree quality is checked against the SAH cost right after the build
+#define BVH_DEFAULT_SAH_GROWTH 1.5
+
+// Refit the wide node at index and the ones below it, returns the box around all of them.
+// Leaf children take the boxes of their primitives in scene. Works on whichever wide form
+// the tree has and keeps its layout, the compressed form is quantized again node by node.
+AABB refit_wide_node(Bvh *bvh, const BvhPrimitives *scene, int index) {
+    WideBvhNode wide;
+    if (bvh->compressed_nodes != NULL) {
+        const CompressedBvhNode *node = &bvh->compressed_nodes[index];
+        wide = (WideBvhNode) {.child_count = node->child_count};
+        for (int i = 0; i < node->child_count; i++) {
+            wide.child[i] = node->child[i];
+            wide.count[i] = node->count[i];
+        }
+    } else {
+        wide = bvh->wide_nodes[index];
+    }
+
+    AABB bounds = create_empty_aabb();
+    for (int i = 0; i < wide.child_count; i++) {
+        AABB b = create_empty_aabb();
+        if (wide.count[i] > 0) {
+            for (int j = wide.child[i]; j < wide.child[i] + wide.count[i]; j++) {
+                AABB prim_box = bvh_primitive_bbox(scene, bvh->prim_sources[j]);
+                b = create_aabb_for_aabb(&b, &prim_box);
+            }
+        } else {
+            b = refit_wide_node(bvh, scene, wide.child[i]);
+        }
+        wide.min_x[i] = b.x.min; wide.max_x[i] = b.x.max;
+        wide.min_y[i] = b.y.min; wide.max_y[i] = b.y.max;
+        wide.min_z[i] = b.z.min; wide.max_z[i] = b.z.max;
+        bounds = create_aabb_for_aabb(&bounds, &b);
+    }
+
+    if (bvh->compressed_nodes != NULL) {
+        bvh->compressed_nodes[index] = compress_wide_node(&wide);
+    } else {
+        bvh->wide_nodes[index] = wide;
+    }
+    return bounds;
+}
+
+// Take the primitives from scene again after they moved and recompute every box bottom-up.
+// scene must hold the same primitives the tree was built from, in the same order. The
+// topology and memory are kept, so the tree can get worse as primitives drift apart.
+// This includes the wide forms: collapsing again could pick other nodes to open.
+// Instances pick up new transforms and the refitted bounds of the trees they place.
+// References of a spatial split get the whole primitive's box back, not the clipped one.
+void refit_bvh(Bvh *bvh, BvhPrimitives scene) {
+    assert(scene.sphere_count + scene.triangle_count + scene.quad_count + scene.instance_count == bvh->source_count);
+
+    // Children come after their parent in the node array
+    for (int i = bvh->node_count - 1; i >= 0; i--) {
+        BvhNode *node = &bvh->nodes[i];
+        if (!is_leaf(node)) {
+            node->bbox = create_aabb_for_aabb(&bvh->nodes[i + 1].bbox, &bvh->nodes[node->offset].bbox);
+            continue;
+        }
+
+        node->bbox = create_empty_aabb();
+        for (int j = node->offset; j < node->offset + node->count; j++) {
+            store_bvh_primitive(bvh, bvh->prim_refs[j], &scene, bvh->prim_sources[j]);
+            AABB prim_box = bvh_primitive_bbox(&scene, bvh->prim_sources[j]);
+            node->bbox = create_aabb_for_aabb(&node->bbox, &prim_box);
+        }
+    }
+
+    if ((bvh->wide_nodes != NULL || bvh->compressed_nodes != NULL) && bvh->node_count > 0) {
+        refit_wide_node(bvh, &scene, 0);
+    }
+}
+
+// SAH cost of the tree after refit_bvh on the primitives it was built from, the box
+// contents are left as they were. A spatial split tree loses its clipped leaf boxes to
+// the first refit, so its rebuild check is measured against this instead of the cost
+// right after the build, which no refit can get back to.
+double calculate_refit_sah_cost(Bvh *bvh, BvhPrimitives scene) {
+    AABB *boxes = malloc(sizeof(AABB) * (size_t) bvh->node_count);
+    for (int i = 0; i < bvh->node_count; i++) {
+        boxes[i] = bvh->nodes[i].bbox;
+    }
+
+    refit_bvh(bvh, scene);
+    double cost = calculate_sah_cost(bvh);
+
+    for (int i = 0; i < bvh->node_count; i++) {
+        bvh->nodes[i].bbox = boxes[i];
+    }
+    free(boxes);
+    return cost;
+}
+
+// True once the tree costs max_sah_growth times what it did when it was built. The cost
+// is relative to the root box, so a primitive that dwarfs the rest (a ground sphere)
+// also dwarfs the decay of everything else.
+bool bvh_needs_rebuild(const Bvh *bvh, double max_sah_growth) {
+    return calculate_sah_cost(bvh) > max_sah_growth * bvh->build_sah_cost;
+}
+
+// Refit after primitives moved, or build a new tree with the same settings when refitting
+// has degraded it too far. Returns the tree to use from now on, bvh is freed if replaced.
+Bvh* update_bvh(Bvh *bvh, BvhPrimitives scene, double max_sah_growth) {
+    refit_bvh(bvh, scene);
+    if (!bvh_needs_rebuild(bvh, max_sah_growth)) {
+        return bvh;
+    }
+
+    Bvh *rebuilt = build_bvh_primitives(scene, bvh->config);
+    if (bvh->compressed_nodes != NULL) {
+        compress_bvh_wide(rebuilt);
+    } else if (bvh->wide_nodes != NULL) {
+        collapse_bvh_wide(rebuilt);
+    }
+    free_bvh(bvh);
+    return rebuilt;
+}
+
+// Slab test of one ray against every child box of a wide node. Writes the entry
+// distances and returns a bit mask of the children that are hit.
+int hit_wide_children(const WideBvhNode *node, const Ray *ray, Interval ray_t, real t_entry[WIDE_BVH_WIDTH]) {
+    // The sign bits pick which array holds the near plane of each slab
+    const real *near_x = ray->sign[0] ? node->max_x : node->min_x;
+    const real *far_x = ray->sign[0] ? node->min_x : node->max_x;
+    const real *near_y = ray->sign[1] ? node->max_y : node->min_y;
+    const real *far_y = ray->sign[1] ? node->min_y : node->max_y;
+    const real *near_z = ray->sign[2] ? node->max_z : node->min_z;
+    const real *far_z = ray->sign[2] ? node->min_z : node->max_z;
+    int lanes = (1 << node->child_count) - 1;
+
+#ifdef RT_SIMD
+    _Static_assert(SIMD_LANES == WIDE_BVH_WIDTH, "one child per simd lane");
+    vreal ox = vset1(ray->origin.x), oy = vset1(ray->origin.y), oz = vset1(ray->origin.z);
+    vreal ix = vset1(ray->inv_direction.x), iy = vset1(ray->inv_direction.y), iz = vset1(ray->inv_direction.z);
+
+    vreal t0 = vmax(vmax(vmul(vsub(vload(near_x), ox), ix), vmul(vsub(vload(near_y), oy), iy)),
+                    vmax(vmul(vsub(vload(near_z), oz), iz), vset1(ray_t.min)));
+    vreal t1 = vmin(vmin(vmul(vsub(vload(far_x), ox), ix), vmul(vsub(vload(far_y), oy), iy)),
+                    vmin(vmul(vsub(vload(far_z), oz), iz), vset1(ray_t.max)));
+
+    vstore(t_entry, t0);
+    return vmask_lt(t0, t1) & lanes;
+#else
+    int mask = 0;
+    for (int i = 0; i < WIDE_BVH_WIDTH; i++) {
+        real t0 = fmax(fmax((near_x[i] - ray->origin.x) * ray->inv_direction.x, (near_y[i] - ray->origin.y) * ray->inv_direction.y),
+                         fmax((near_z[i] - ray->origin.z) * ray->inv_direction.z, ray_t.min));
+        real t1 = fmin(fmin((far_x[i] - ray->origin.x) * ray->inv_direction.x, (far_y[i] - ray->origin.y) * ray->inv_direction.y),
+                         fmin((far_z[i] - ray->origin.z) * ray->inv_direction.z, ray_t.max));
+        t_entry[i] = t0;
+        mask |= (t0 < t1) << i;
+    }
+    return mask & lanes;
+#endif
+}
+
+// hit_wide_children for a compressed node. The child planes are rebuilt as
+// origin + q * scale and then go through the same slab test.
+int hit_compressed_children(const CompressedBvhNode *node, const Ray *ray, Interval ray_t, real t_entry[WIDE_BVH_WIDTH]) {
+    const uint8_t *near_x = ray->sign[0] ? node->max_x : node->min_x;
+    const uint8_t *far_x = ray->sign[0] ? node->min_x : node->max_x;
+    const uint8_t *near_y = ray->sign[1] ? node->max_y : node->min_y;
+    const uint8_t *far_y = ray->sign[1] ? node->min_y : node->max_y;
+    const uint8_t *near_z = ray->sign[2] ? node->max_z : node->min_z;
+    const uint8_t *far_z = ray->sign[2] ? node->min_z : node->max_z;
+    int lanes = (1 << node->child_count) - 1;
 
-BvhNode* build_bvh(Sphere spheres[], int length) {
-    return build_bvh_sphere_fast(spheres, length, 0);
+    // Plane minus ray origin is (origin - ray origin) + q * scale
+    real dx = node->origin[0] - ray->origin.x;
+    real dy = node->origin[1] - ray->origin.y;
+    real dz = node->origin[2] - ray->origin.z;
+
+#ifdef RT_SIMD
+    vreal ox = vset1(dx), oy = vset1(dy), oz = vset1(dz);
+    vreal sx = vset1(node->scale[0]), sy = vset1(node->scale[1]), sz = vset1(node->scale[2]);
+    vreal ix = vset1(ray->inv_direction.x), iy = vset1(ray->inv_direction.y), iz = vset1(ray->inv_direction.z);
+
+    vreal t0 = vmax(vmax(vmul(vadd(ox, vmul(vload_u8(near_x), sx)), ix), vmul(vadd(oy, vmul(vload_u8(near_y), sy)), iy)),
+                    vmax(vmul(vadd(oz, vmul(vload_u8(near_z), sz)), iz), vset1(ray_t.min)));
+    vreal t1 = vmin(vmin(vmul(vadd(ox, vmul(vload_u8(far_x), sx)), ix), vmul(vadd(oy, vmul(vload_u8(far_y), sy)), iy)),
+                    vmin(vmul(vadd(oz, vmul(vload_u8(far_z), sz)), iz), vset1(ray_t.max)));
+
+    vstore(t_entry, t0);
+    return vmask_lt(t0, t1) & lanes;
+#else
+    int mask = 0;
+    for (int i = 0; i < WIDE_BVH_WIDTH; i++) {
+        real t0 = fmax(fmax((dx + near_x[i] * node->scale[0]) * ray->inv_direction.x, (dy + near_y[i] * node->scale[1]) * ray->inv_direction.y),
+                         fmax((dz + near_z[i] * node->scale[2]) * ray->inv_direction.z, ray_t.min));
+        real t1 = fmin(fmin((dx + far_x[i] * node->scale[0]) * ray->inv_direction.x, (dy + far_y[i] * node->scale[1]) * ray->inv_direction.y),
+                         fmin((dz + far_z[i] * node->scale[2]) * ray->inv_direction.z, ray_t.max));
+        t_entry[i] = t0;
+        mask |= (t0 < t1) << i;
+    }
+    return mask & lanes;
+#endif
+}
+
+
+// Traversal
+
+// The ray in the instance's object space. The direction is transformed without
+// normalizing, so distances along it match the world space ray.
+Ray instance_ray(const BvhInstance *instance, const Ray *ray) {
+    return create_ray(transform_point(&instance->world_to_object, ray->origin),
+                      transform_vector(&instance->world_to_object, ray->direction));
+}
+
+bool ray_intersect_bvh_closest(const Bvh *bvh, const Ray *ray, Interval ray_t, PrimHit *hit, int *num_intersects);
+bool ray_occluded_bvh(const Bvh *bvh, const Ray *ray, Interval ray_t, int *num_intersects);
+
+// Hit of the referenced primitive inside ray_t, fills in everything but hit->prim.
+// u and v are left alone for spheres.
+bool intersect_prim_ref(const Bvh *bvh, PrimRef ref, const Ray *ray, const Interval *ray_t, PrimHit *hit, int *num_intersects) {
+    int index = prim_ref_index(ref);
+    switch (prim_ref_type(ref)) {
+        case PRIM_SPHERE:
+        {
+            SphereGeom geom = get_block_sphere(bvh->sphere_blocks, index);
+            return intersect_sphere_geom(ray, &geom, ray_t, &hit->t);
+        }
+        case PRIM_TRIANGLE:
+        {
+            TriangleGeom geom = get_block_triangle(bvh->triangle_blocks, index);
+            return intersect_triangle_geom(ray, &geom, ray_t, &hit->t, &hit->u, &hit->v);
+        }
+        case PRIM_QUAD:
+            return intersect_quad_geom(ray, &bvh->quads[index], ray_t, &hit->t, &hit->u, &hit->v);
+        default: {
+            const BvhInstance *instance = &bvh->instances[index];
+            Ray local = instance_ray(instance, ray);
+            PrimHit local_hit;
+            if (!ray_intersect_bvh_closest(instance->bvh, &local, *ray_t, &local_hit, num_intersects)) {
+                return false;
+            }
+            *hit = (PrimHit) {.t = local_hit.t, .sub_prim = local_hit.prim, .u = local_hit.u, .v = local_hit.v};
+            return true;
+        }
+    }
+}
+
+// Number of sphere or triangle references of the same type starting at slot i, up to end.
+// Both are stored in the order the leaves reference them, so a run is consecutive lanes
+// in the blocks. Zero for the other types.
+int block_run_length(const Bvh *bvh, int i, int end) {
+    PrimType type = prim_ref_type(bvh->prim_refs[i]);
+    if (type != PRIM_SPHERE && type != PRIM_TRIANGLE) {
+        return 0;
+    }
+    int run = 1;
+    while (i + run < end && prim_ref_type(bvh->prim_refs[i + run]) == type) {
+        run++;
+    }
+    return run;
+}
+
+// Closest hit of a run starting at slot i through the block kernels, fills in hit->t,
+// u and v. Returns the position of the hit inside the run or -1.
+int intersect_block_run(const Bvh *bvh, int i, int run, const Ray *ray, const Interval *ray_t, PrimHit *hit) {
+    PrimRef ref = bvh->prim_refs[i];
+    int k = prim_ref_index(ref);
+    int nearest = prim_ref_type(ref) == PRIM_SPHERE
+        ? intersect_sphere_blocks(ray, bvh->sphere_blocks, k, run, ray_t, &hit->t)
+        : intersect_triangle_blocks(ray, bvh->triangle_blocks, k, run, ray_t, &hit->t, &hit->u, &hit->v);
+    return nearest < 0 ? -1 : nearest - k;
+}
+
+// Tests the primitives [first, first + count) and keeps the closest hit in hit.
+// Runs of spheres or triangles go through the block kernels together.
+bool ray_intersect_bvh_prims(const Bvh *bvh, int first, int count, const Ray *ray, Interval ray_t, PrimHit *hit, int *num_intersects) {
+    bool hit_anything = false;
+    *num_intersects += count;
+    for (int i = first; i < first + count; i++) {
+        PrimHit candidate = {.sub_prim = -1};
+        int run = block_run_length(bvh, i, first + count);
+        if (run > 0) {
+            int nearest = intersect_block_run(bvh, i, run, ray, &ray_t, &candidate);
+            if (nearest >= 0) {
+                hit_anything = true;
+                ray_t.max = candidate.t;
+                candidate.prim = i + nearest;
+                *hit = candidate;
+            }
+            i += run - 1;
+            continue;
+        }
+
+        if (intersect_prim_ref(bvh, bvh->prim_refs[i], ray, &ray_t, &candidate, num_intersects)) {
+            hit_anything = true;
+            ray_t.max = candidate.t;
+            candidate.prim = i;
+            *hit = candidate;
+        }
+    }
+    return hit_anything;
+}
+
+// Fill in the hit record of the closest hit, the only place shading data is read
+void finalize_bvh_hit(const Bvh *bvh, const Ray *ray, const PrimHit *hit, HitRecord *record) {
+    PrimRef ref = bvh->prim_refs[hit->prim];
+    int index = prim_ref_index(ref);
+    switch (prim_ref_type(ref)) {
+        case PRIM_SPHERE:
+        {
+            SphereGeom geom = get_block_sphere(bvh->sphere_blocks, index);
+            finalize_sphere_hit(ray, &geom, bvh->sphere_mat_ids[index], hit, record);
+        }
+            break;
+        case PRIM_TRIANGLE:
+            finalize_triangle_hit(ray, &bvh->triangle_shading[index], hit, record);
+            break;
+        case PRIM_QUAD:
+            finalize_quad_hit(ray, &bvh->quads[index], bvh->quad_mat_ids[index], hit, record);
+            break;
+        default: {
+            // Shade in object space, then bring the point and normal back. The normal
+            // keeps its side of the ray, so front_face carries over.
+            const BvhInstance *instance = &bvh->instances[index];
+            Ray local = instance_ray(instance, ray);
+            PrimHit local_hit = {.t = hit->t, .prim = hit->sub_prim, .sub_prim = -1, .u = hit->u, .v = hit->v};
+            finalize_bvh_hit(instance->bvh, &local, &local_hit, record);
+            record->p = at(ray, hit->t);
+            record->normal = unit_vec(transform_normal(&instance->world_to_object, record->normal));
+            break;
+        }
+    }
+}
+
+typedef struct BvhStackEntry {
+    int index;      // node, or first primitive when count > 0
+    int count;      // primitives of a leaf entry
+    real t_entry; // where the ray enters the node's box
+} BvhStackEntry;
+
+// Iterative closest-hit traversal. Child boxes are tested from the parent, the child
+// nearer along the split axis is visited first and the far one is skipped once a
+// closer hit has been found.
+bool ray_intersect_binary_bvh(const Bvh *bvh, const Ray *ray, Interval ray_t, PrimHit *hit, int *num_intersects) {
+    BvhStackEntry stack[BVH_STACK_SIZE];
+    int top = 0;
+
+    (*num_intersects)++;
+    real t_root;
+    if (!hit_aabb_entry(ray, ray_t, &bvh->nodes[0].bbox, &t_root)) {
+        return false;
+    }
+    stack[top++] = (BvhStackEntry) {.index = 0, .t_entry = t_root};
+
+    bool hit_anything = false;
+    while (top > 0) {
+        BvhStackEntry entry = stack[--top];
+        if (entry.t_entry >= ray_t.max) {
+            continue; // a closer hit was found after this node was pushed
+        }
+
+        const BvhNode *node = &bvh->nodes[entry.index];
+        if (is_leaf(node)) {
+            if (ray_intersect_bvh_prims(bvh, node->offset, node->count, ray, ray_t, hit, num_intersects)) {
+                hit_anything = true;
+                ray_t.max = hit->t;
+            }
+            continue;
+        }
+
+        int near = entry.index + 1;
+        int far = node->offset;
+        if (ray->sign[node->axis]) {
+            near = node->offset;
+            far = entry.index + 1;
+        }
+
+        real t_near, t_far;
+        *num_intersects += 2;
+        bool hit_near = hit_aabb_entry(ray, ray_t, &bvh->nodes[near].bbox, &t_near);
+        bool hit_far = hit_aabb_entry(ray, ray_t, &bvh->nodes[far].bbox, &t_far);
+
+        // Push far first so the near child is popped next
+        if (hit_far) {
+            stack[top++] = (BvhStackEntry) {.index = far, .t_entry = t_far};
+        }
+        if (hit_near) {
+            stack[top++] = (BvhStackEntry) {.index = near, .t_entry = t_near};
+        }
+    }
+
+    return hit_anything;
+}
+
+#define WIDE_BVH_STACK_SIZE (BVH_STACK_SIZE * WIDE_BVH_WIDTH)
+
+// Children of wide node index hit inside ray_t, from the compressed nodes when the tree
+// has them. Writes their stack entries in slot order and returns how many there are.
+int hit_wide_node(const Bvh *bvh, int index, const Ray *ray, Interval ray_t, BvhStackEntry hits[WIDE_BVH_WIDTH], int *num_intersects) {
+    real t_entry[WIDE_BVH_WIDTH] __attribute__((aligned(32)));
+    int num_hits = 0;
+    if (bvh->compressed_nodes != NULL) {
+        const CompressedBvhNode *node = &bvh->compressed_nodes[index];
+        *num_intersects += node->child_count;
+        for (int mask = hit_compressed_children(node, ray, ray_t, t_entry); mask; mask &= mask - 1) {
+            int i = __builtin_ctz(mask);
+            hits[num_hits++] = (BvhStackEntry) {.index = node->child[i], .count = node->count[i], .t_entry = t_entry[i]};
+        }
+    } else {
+        const WideBvhNode *node = &bvh->wide_nodes[index];
+        *num_intersects += node->child_count;
+        for (int mask = hit_wide_children(node, ray, ray_t, t_entry); mask; mask &= mask - 1) {
+            int i = __builtin_ctz(mask);
+            hits[num_hits++] = (BvhStackEntry) {.index = node->child[i], .count = node->count[i], .t_entry = t_entry[i]};
+        }
+    }
+    return num_hits;
 }
 
-BvhNode* build_bvh_tri(Triangle triangles[], int length) {
-    return build_bvh_fast(triangles, length, 0);
+// Closest-hit traversal of the wide tree. Leaf children go on the stack like nodes,
+// hit children are pushed far to near so the nearest one is processed next.
+bool ray_intersect_wide_bvh(const Bvh *bvh, const Ray *ray, Interval ray_t, PrimHit *hit, int *num_intersects) {
+    BvhStackEntry stack[WIDE_BVH_STACK_SIZE];
+    int top = 0;
+    stack[top++] = (BvhStackEntry) {.index = 0, .count = 0, .t_entry = ray_t.min};
+
+    bool hit_anything = false;
+    while (top > 0) {
+        BvhStackEntry entry = stack[--top];
+        if (entry.t_entry >= ray_t.max) {
+            continue;
+        }
+
+        if (entry.count > 0) {
+            if (ray_intersect_bvh_prims(bvh, entry.index, entry.count, ray, ray_t, hit, num_intersects)) {
+                hit_anything = true;
+                ray_t.max = hit->t;
+            }
+            continue;
+        }
+
+        BvhStackEntry hits[WIDE_BVH_WIDTH];
+        int num_hits = hit_wide_node(bvh, entry.index, ray, ray_t, hits, num_intersects);
+
+        // Insertion sort the hit children onto the stack by decreasing entry distance
+        for (int i = 0; i < num_hits; i++) {
+            int k = top++;
+            while (k > top - 1 - i && stack[k - 1].t_entry < hits[i].t_entry) {
+                stack[k] = stack[k - 1];
+                k--;
+            }
+            stack[k] = hits[i];
+        }
+    }
+
+    return hit_anything;
 }
 
-bool ray_intersect_bvh(const BvhNode *node, const Ray *ray, Interval ray_t, HitRecord *record, int *num_intersects, int depth) {
-    if (node == NULL) {
+// Closest hit without filling in a hit record
+bool ray_intersect_bvh_closest(const Bvh *bvh, const Ray *ray, Interval ray_t, PrimHit *hit, int *num_intersects) {
+    if (bvh->node_count == 0) {
         return false;
     }
 
-    // Check for ray intersection with the node's AABB
+    return (bvh->wide_nodes != NULL || bvh->compressed_nodes != NULL)
+        ? ray_intersect_wide_bvh(bvh, ray, ray_t, hit, num_intersects)
+        : ray_intersect_binary_bvh(bvh, ray, ray_t, hit, num_intersects);
+}
+
+bool ray_intersect_bvh(const Bvh *bvh, const Ray *ray, Interval ray_t, HitRecord *record, int *num_intersects) {
+    PrimHit hit;
+    bool found = ray_intersect_bvh_closest(bvh, ray, ray_t, &hit, num_intersects);
+    if (found) {
+        finalize_bvh_hit(bvh, ray, &hit, record);
+    }
+    return found;
+}
+
+
+// Occlusion queries. These only answer whether anything lies inside ray_t and
+// return at the first hit they find, no hit record is written.
+
+bool ray_occluded_bvh_prims(const Bvh *bvh, int first, int count, const Ray *ray, Interval ray_t, int *num_intersects) {
+    for (int i = first; i < first + count; i++) {
+        int run = block_run_length(bvh, i, first + count);
+        if (run > 0) {
+            PrimHit hit;
+            *num_intersects += run;
+            if (intersect_block_run(bvh, i, run, ray, &ray_t, &hit) >= 0) {
+                return true;
+            }
+            i += run - 1;
+            continue;
+        }
+
+        (*num_intersects)++;
+        PrimRef ref = bvh->prim_refs[i];
+        if (prim_ref_type(ref) == PRIM_INSTANCE) {
+            // Any hit inside the instance will do, not just its closest one
+            const BvhInstance *instance = &bvh->instances[prim_ref_index(ref)];
+            Ray local = instance_ray(instance, ray);
+            if (ray_occluded_bvh(instance->bvh, &local, ray_t, num_intersects)) {
+                return true;
+            }
+            continue;
+        }
+
+        PrimHit hit;
+        if (intersect_prim_ref(bvh, ref, ray, &ray_t, &hit, num_intersects)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Children are still visited near first, a blocker close to the origin ends the search soonest
+bool ray_occluded_binary_bvh(const Bvh *bvh, const Ray *ray, Interval ray_t, int *num_intersects) {
+    int stack[BVH_STACK_SIZE];
+    int top = 0;
+
     (*num_intersects)++;
-    if (!hit_aabb(ray, ray_t, &node->bbox)) {
-        return false; // Ray does not intersect the bounding box
+    if (!hit_aabb(ray, ray_t, &bvh->nodes[0].bbox)) {
+        return false;
     }
+    stack[top++] = 0;
 
-    // Check if this is a leaf node
-    if (node->left == NULL && node->right == NULL && (node->sphere != NULL || node->triangle != NULL)) {
-        // Test intersection with the sphere at this leaf node
-        if (node->sphere != NULL) {
-            return ray_intersect_sphere(ray, node->sphere, &ray_t, record, num_intersects);
-        } else {
-            return ray_intersect_triangle(ray, node->triangle, &ray_t, record, num_intersects);
+    while (top > 0) {
+        int index = stack[--top];
+        const BvhNode *node = &bvh->nodes[index];
+        if (is_leaf(node)) {
+            if (ray_occluded_bvh_prims(bvh, node->offset, node->count, ray, ray_t, num_intersects)) {
+                return true;
+            }
+            continue;
+        }
+
+        int near = index + 1;
+        int far = node->offset;
+        if (ray->sign[node->axis]) {
+            near = node->offset;
+            far = index + 1;
+        }
+
+        *num_intersects += 2;
+        if (hit_aabb(ray, ray_t, &bvh->nodes[far].bbox)) {
+            stack[top++] = far;
+        }
+        if (hit_aabb(ray, ray_t, &bvh->nodes[near].bbox)) {
+            stack[top++] = near;
         }
     }
 
-    // If not a leaf node, recursively check children
-    bool hit_left = node->left ? ray_intersect_bvh(node->left, ray, ray_t, record, num_intersects, depth + 1) : false;
-    Interval new_int = {.min = ray_t.min, .max = hit_left ? record->t : ray_t.max};
-    bool hit_right = node->right ? ray_intersect_bvh(node->right, ray, new_int, record, num_intersects, depth + 1) : false;
+    return false;
+}
+
+// Hit children are pushed in slot order, there is no closest hit to sort for
+bool ray_occluded_wide_bvh(const Bvh *bvh, const Ray *ray, Interval ray_t, int *num_intersects) {
+    BvhStackEntry stack[WIDE_BVH_STACK_SIZE];
+    int top = 0;
+    stack[top++] = (BvhStackEntry) {.index = 0, .count = 0};
+
+    while (top > 0) {
+        BvhStackEntry entry = stack[--top];
+        if (entry.count > 0) {
+            if (ray_occluded_bvh_prims(bvh, entry.index, entry.count, ray, ray_t, num_intersects)) {
+                return true;
+            }
+            continue;
+        }
+
+        BvhStackEntry hits[WIDE_BVH_WIDTH];
+        int num_hits = hit_wide_node(bvh, entry.index, ray, ray_t, hits, num_intersects);
+        for (int i = 0; i < num_hits; i++) {
+            stack[top++] = hits[i];
+        }
+    }
+
+    return false;
+}
+
+bool ray_occluded_bvh(const Bvh *bvh, const Ray *ray, Interval ray_t, int *num_intersects) {
+    if (bvh->node_count == 0) {
+        return false;
+    }
 
-    return hit_left || hit_right;
+    return (bvh->wide_nodes != NULL || bvh->compressed_nodes != NULL)
+        ? ray_occluded_wide_bvh(bvh, ray, ray_t, num_intersects)
+        : ray_occluded_binary_bvh(bvh, ray, ray_t, num_intersects);
 }
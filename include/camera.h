@@ -2,7 +2,9 @@
 
 #include "bvh.h"
 #include "color.h"
+#include "packet.h"
 #include "quad.h"
+#include "scheduler.h"
 #include "triangle.h"
 #include "utils.h"
 
@@ -28,6 +30,8 @@ typedef struct {
     Point3 lookat;
     double defocus_angle;
     double focus_dist;
+    uint64_t seed; // per-frame seed, each pixel sample derives its own generator from it
+    bool ray_packets; // trace primary rays of neighbouring pixels together
 
     // Computed
     int image_height;
@@ -51,6 +55,8 @@ Camera create_camera(int image_width, double aspect_ratio, int samples_per_pixel
     camera.lookat = lookat;
     camera.defocus_angle = defocus_angle;
     camera.focus_dist = focus_dist;
+    camera.seed = 11;
+    camera.ray_packets = false;
 
     // Compute height
     int image_height = (int) ((double) image_width / aspect_ratio);
@@ -112,18 +118,18 @@ Color sky(Vec3 unit_dir) {
     return add_vec3(start, end);
 }
 
-Color ray_color(const Ray *r, int depth, int num_spheres, Sphere world[], int *num_intersects) {
+Color ray_color(const Ray *r, int depth, int num_spheres, const SphereBlock blocks[], Sphere world[], int *num_intersects, Rng *rng) {
     HitRecord rec = {0};
     if (depth <= 0) {
         Color no_light_gathered = {0, 0, 0};
         return no_light_gathered;
     }
     Interval world_int = {.min=0.001, .max=INFINITY};
-    if (ray_intersect_sphere_arr(r, num_spheres, world, &world_int, &rec, num_intersects)) {
+    if (ray_intersect_sphere_blocks(r, num_spheres, blocks, world, &world_int, &rec, num_intersects)) {
         Ray scattered;
         Color attenuation;
-        if (scatter(&rec.mat, r, &rec, &attenuation, &scattered)) {
-            Color color = ray_color(&scattered, depth-1, num_spheres, world, num_intersects);
+        if (scatter(get_material(rec.mat_id), r, &rec, &attenuation, &scattered, rng)) {
+            Color color = ray_color(&scattered, depth-1, num_spheres, blocks, world, num_intersects, rng);
             return mult_vec3(color, attenuation);
         }
         Color no_light_gathered = {0, 0, 0};
@@ -133,23 +139,23 @@ Color ray_color(const Ray *r, int depth, int num_spheres, Sphere world[], int *n
     return sky(unit_vec(r->direction));
 }
 
-Color ray_color_triangle(const Ray *r, int depth, int num_triangles, Triangle mesh[], int *num_intersects) {
+Color ray_color_triangle(const Ray *r, int depth, int num_triangles, const TriangleBlock blocks[], Triangle mesh[], int *num_intersects, Rng *rng) {
     HitRecord rec = {0};
     if (depth <= 0) {
         Color no_light_gathered = {0, 0, 0};
         return no_light_gathered;
     }
     Interval world_int = {.min=0.001, .max=INFINITY};
-    if (ray_intersect_triangle_arr(r, num_triangles, mesh, &world_int, &rec, num_intersects)) {
+    if (ray_intersect_triangle_blocks(r, num_triangles, blocks, mesh, &world_int, &rec, num_intersects)) {
         Ray scattered;
         Color attenuation;
-        if (scatter(&rec.mat, r, &rec, &attenuation, &scattered)) {
-            Color color = ray_color_triangle(&scattered, depth-1, num_triangles, mesh, num_intersects);
+        if (scatter(get_material(rec.mat_id), r, &rec, &attenuation, &scattered, rng)) {
+            Color color = ray_color_triangle(&scattered, depth-1, num_triangles, blocks, mesh, num_intersects, rng);
             return mult_vec3(color, attenuation);
         }
 
         // Should never happen, scattering always returns true
-        printf("Something bad happened, no scattering for mat %d\n", rec.mat.type);
+        printf("Something bad happened, no scattering for mat %d\n", get_material(rec.mat_id)->type);
         Color no_light_gathered = {0, 0, 0};
         return no_light_gathered;
     }
@@ -157,7 +163,7 @@ Color ray_color_triangle(const Ray *r, int depth, int num_triangles, Triangle me
     return sky(unit_vec(r->direction));
 }
 
-Color ray_color_quad(const Ray *r, int depth, int num_quads, Quad quads[], int *num_intersects) {
+Color ray_color_quad(const Ray *r, int depth, int num_quads, Quad quads[], int *num_intersects, Rng *rng) {
     HitRecord rec = {0};
     if (depth <= 0) {
         Color no_light_gathered = {0, 0, 0};
@@ -167,13 +173,13 @@ Color ray_color_quad(const Ray *r, int depth, int num_quads, Quad quads[], int *
     if (ray_intersect_quad_arr(r, num_quads, quads, &world_int, &rec, num_intersects)) {
         Ray scattered;
         Color attenuation;
-        if (scatter(&rec.mat, r, &rec, &attenuation, &scattered)) {
-            Color color = ray_color_quad(&scattered, depth-1, num_quads, quads, num_intersects);
+        if (scatter(get_material(rec.mat_id), r, &rec, &attenuation, &scattered, rng)) {
+            Color color = ray_color_quad(&scattered, depth-1, num_quads, quads, num_intersects, rng);
             return mult_vec3(color, attenuation);
         }
 
         // Should never happen, scattering always returns true
-        printf("Something bad happened, no scattering for mat %d\n", rec.mat.type);
+        printf("Something bad happened, no scattering for mat %d\n", get_material(rec.mat_id)->type);
         Color no_light_gathered = {0, 0, 0};
         return no_light_gathered;
     }
@@ -181,93 +187,106 @@ Color ray_color_quad(const Ray *r, int depth, int num_quads, Quad quads[], int *
     return sky(unit_vec(r->direction));
 }
 
-Color ray_color_bvh(Ray *r, int depth, BvhNode *bvh, int *num_intersects) {
+Color ray_color_bvh(Ray *r, int depth, Bvh *bvh, int *num_intersects, Rng *rng);
+
+// Scatter off a hit found in the bvh and trace the bounce
+Color shade_hit_bvh(const Ray *r, HitRecord *rec, int depth, Bvh *bvh, int *num_intersects, Rng *rng) {
+    Ray scattered;
+    Color attenuation;
+    if (scatter(get_material(rec->mat_id), r, rec, &attenuation, &scattered, rng)) {
+        Color color = ray_color_bvh(&scattered, depth-1, bvh, num_intersects, rng);
+        return mult_vec3(color, attenuation);
+    }
+
+    // Should never happen, scattering always returns true
+    printf("Something bad happened, no scattering for mat %d\n", get_material(rec->mat_id)->type);
+    Color no_light_gathered = {0, 0, 0};
+    return no_light_gathered;
+}
+
+Color ray_color_bvh(Ray *r, int depth, Bvh *bvh, int *num_intersects, Rng *rng) {
     HitRecord rec = {0};
     if (depth <= 0) {
         Color no_light_gathered = {0, 0, 0};
         return no_light_gathered;
     }
     Interval world_int = {.min=0.001, .max=INFINITY};
-    if (ray_intersect_bvh(bvh, r, world_int, &rec, num_intersects, 0)) {
-        Ray scattered;
-        Color attenuation;
-        if (scatter(&rec.mat, r, &rec, &attenuation, &scattered)) {
-            Color color = ray_color_bvh(&scattered, depth-1, bvh, num_intersects);
-            return mult_vec3(color, attenuation);
-        }
-
-        // Should never happen, scattering always returns true
-        printf("Something bad happened, no scattering for mat %d\n", rec.mat.type);
-        Color no_light_gathered = {0, 0, 0};
-        return no_light_gathered;
+    if (ray_intersect_bvh(bvh, r, world_int, &rec, num_intersects)) {
+        return shade_hit_bvh(r, &rec, depth, bvh, num_intersects, rng);
     }
 
     return sky(unit_vec(r->direction));
 }
 
-Vec3 pixel_sample_square(Camera *camera) {
-    double px = -0.5 + random_double();
-    double py = -0.5 + random_double();
+Vec3 pixel_sample_square(Camera *camera, Rng *rng) {
+    double px = -0.5 + random_double(rng);
+    double py = -0.5 + random_double(rng);
 
     Vec3 pixel_px = scale_vec3(camera->pixel_delta_u, px);
     Vec3 pixel_py = scale_vec3(camera->pixel_delta_v, py);
     return add_vec3(pixel_px, pixel_py);
 }
 
-Point3 defocus_disk_sample(Camera *camera) {
-    Point3 p = random_in_unit_disk();
+Point3 defocus_disk_sample(Camera *camera, Rng *rng) {
+    Point3 p = random_in_unit_disk(rng);
 
     Vec3 defocus_p_u = scale_vec3(camera->defocus_disk_u, p.x);
     Vec3 defocus_p_v = scale_vec3(camera->defocus_disk_v, p.y);
     return add3_vec3(camera->center, defocus_p_u, defocus_p_v);
 }
 
-Ray get_ray(int i, int j, Camera *camera) {
+Ray get_ray(int i, int j, Camera *camera, Rng *rng) {
     Vec3 pixel_delta_i = scale_vec3(camera->pixel_delta_u, i);
     Vec3 pixel_delta_j = scale_vec3(camera->pixel_delta_v, j);
 
     Point3 pixel_center = add3_vec3(camera->pixel00_loc, pixel_delta_i, pixel_delta_j);
     
-    Vec3 pixel_sample = pixel_sample_square(camera);
+    Vec3 pixel_sample = pixel_sample_square(camera, rng);
     Point3 pixel_sample_shifted = add_vec3(pixel_center, pixel_sample);
 
-    //Point3 ray_origin = (camera->defocus_angle <= 0) ? camera->center : defocus_disk_sample(camera);
+    //Point3 ray_origin = (camera->defocus_angle <= 0) ? camera->center : defocus_disk_sample(camera, rng);
     Point3 ray_origin = camera->center;
     Vec3 ray_dir = diff_vec3(pixel_sample_shifted, ray_origin);
 
-    Ray ret = {.origin = ray_origin, .direction = ray_dir};
+    Ray ret = create_ray(ray_origin, ray_dir);
     return ret;
 }
 
 int render_spheres(Camera *camera, int num_spheres, Sphere world[], SDL_Surface *surface, int *num_intersects) {
+    SphereBlock *blocks = make_sphere_blocks(world, num_spheres);
     for (int j = 0; j < camera->image_height; ++j) {
         for (int i = 0; i < camera->image_width; ++i) {
             Color pixel_color = {0, 0, 0};
             for (int sample = 0; sample < camera->samples_per_pixel; ++sample) {
-                Ray r = get_ray(i, j, camera);
-                Color ray_c = ray_color(&r, camera->max_depth, num_spheres, world, num_intersects);
+                Rng rng = create_sample_rng(camera->seed, i, j, sample);
+                Ray r = get_ray(i, j, camera, &rng);
+                Color ray_c = ray_color(&r, camera->max_depth, num_spheres, blocks, world, num_intersects, &rng);
                 pixel_color = add_vec3(pixel_color, ray_c);
             }
             set_pixel_buffer(pixel_color, camera->samples_per_pixel, i + j * surface->w, surface);
         }
     }
 
+    free(blocks);
     return EXIT_SUCCESS;
 }
 
 int render_triangles(Camera *camera, int num_triangles, Triangle mesh[], SDL_Surface *surface, int *num_intersects) {
+    TriangleBlock *blocks = make_triangle_blocks(mesh, num_triangles);
     for (int j = 0; j < camera->image_height; ++j) {
         for (int i = 0; i < camera->image_width; ++i) {
             Color pixel_color = {0, 0, 0};
             for (int sample = 0; sample < camera->samples_per_pixel; ++sample) {
-                Ray r = get_ray(i, j, camera);
-                Color ray_c = ray_color_triangle(&r, camera->max_depth, num_triangles, mesh, num_intersects);
+                Rng rng = create_sample_rng(camera->seed, i, j, sample);
+                Ray r = get_ray(i, j, camera, &rng);
+                Color ray_c = ray_color_triangle(&r, camera->max_depth, num_triangles, blocks, mesh, num_intersects, &rng);
                 pixel_color = add_vec3(pixel_color, ray_c);
             }
             set_pixel_buffer(pixel_color, camera->samples_per_pixel, i + j * surface->w, surface);
         }
     }
 
+    free(blocks);
     return EXIT_SUCCESS;
 }
 
@@ -276,8 +295,9 @@ int render_quads(Camera *camera, int num_quads, Quad quads[], SDL_Surface *surfa
         for (int i = 0; i < camera->image_width; ++i) {
             Color pixel_color = {0, 0, 0};
             for (int sample = 0; sample < camera->samples_per_pixel; ++sample) {
-                Ray r = get_ray(i, j, camera);
-                Color ray_c = ray_color_quad(&r, camera->max_depth, num_quads, quads, num_intersects);
+                Rng rng = create_sample_rng(camera->seed, i, j, sample);
+                Ray r = get_ray(i, j, camera, &rng);
+                Color ray_c = ray_color_quad(&r, camera->max_depth, num_quads, quads, num_intersects, &rng);
                 pixel_color = add_vec3(pixel_color, ray_c);
             }
             set_pixel_buffer(pixel_color, camera->samples_per_pixel, i + j * surface->w, surface);
@@ -286,17 +306,63 @@ int render_quads(Camera *camera, int num_quads, Quad quads[], SDL_Surface *surfa
     return EXIT_SUCCESS;
 }
 
-int render_bvh(Camera *camera, BvhNode *bvh, SDL_Surface *surface, int *num_intersects ) {
+Color render_pixel_bvh(Camera *camera, Bvh *bvh, int i, int j, int *num_intersects) {
+    Color pixel_color = {0, 0, 0};
+    for (int sample = 0; sample < camera->samples_per_pixel; ++sample) {
+        // Seed from the pixel and sample so the serial and tiled renderers produce identical images.
+        Rng rng = create_sample_rng(camera->seed, i, j, sample);
+        Ray r = get_ray(i, j, camera, &rng);
+        Color ray_c = ray_color_bvh(&r, camera->max_depth, bvh, num_intersects, &rng);
+        pixel_color = add_vec3(pixel_color, ray_c);
+    }
+
+    return pixel_color;
+}
+
+// Colors of the pixel block at (i, j) covered by one packet. Primary rays are traced
+// as a packet, every bounce after that is traced on its own.
+void render_packet_bvh(Camera *camera, Bvh *bvh, int i, int j, Color colors[RAY_PACKET_SIZE], int *num_intersects) {
+    for (int lane = 0; lane < RAY_PACKET_SIZE; lane++) {
+        colors[lane] = (Color) {0, 0, 0};
+    }
+    if (camera->max_depth <= 0) {
+        return;
+    }
+
+    const Interval world_int = {.min=0.001, .max=INFINITY};
+    RayPacket packet;
+    Rng rngs[RAY_PACKET_SIZE];
+    for (int sample = 0; sample < camera->samples_per_pixel; ++sample) {
+        init_ray_packet(&packet);
+        for (int lane = 0; lane < RAY_PACKET_SIZE; lane++) {
+            int x = i + lane % RAY_PACKET_WIDTH;
+            int y = j + lane / RAY_PACKET_WIDTH;
+            if (x >= camera->image_width || y >= camera->image_height) continue;
+
+            rngs[lane] = create_sample_rng(camera->seed, x, y, sample);
+            Ray r = get_ray(x, y, camera, &rngs[lane]);
+            set_packet_ray(&packet, lane, &r, world_int.max);
+        }
+
+        ray_intersect_bvh_packet(bvh, &packet, world_int.min, num_intersects);
+
+        for (int lane = 0; lane < RAY_PACKET_SIZE; lane++) {
+            if (!(packet.active & (1 << lane))) continue;
+
+            HitRecord rec = {0};
+            Color ray_c = sky(unit_vec(packet.rays[lane].direction));
+            if (finalize_packet_hit(bvh, &packet, lane, &rec)) {
+                ray_c = shade_hit_bvh(&packet.rays[lane], &rec, camera->max_depth, bvh, num_intersects, &rngs[lane]);
+            }
+            colors[lane] = add_vec3(colors[lane], ray_c);
+        }
+    }
+}
+
+int render_bvh(Camera *camera, Bvh *bvh, SDL_Surface *surface, int *num_intersects ) {
     for (int j = 0; j < camera->image_height; ++j) {
         for (int i = 0; i < camera->image_width; ++i) {
-            Color pixel_color = {0, 0, 0};
-            //int t = *num_intersects;
-            for (int sample = 0; sample < camera->samples_per_pixel; ++sample) {
-                Ray r = get_ray(i, j, camera);
-                Color ray_c = ray_color_bvh(&r, camera->max_depth, bvh, num_intersects);
-                pixel_color = add_vec3(pixel_color, ray_c);
-            }
-            //printf("tests on ray: %d\n", *num_intersects - t);
+            Color pixel_color = render_pixel_bvh(camera, bvh, i, j, num_intersects);
             set_pixel_buffer(pixel_color, camera->samples_per_pixel, i + j * surface->w, surface);
         }
     }
@@ -304,3 +370,80 @@ int render_bvh(Camera *camera, BvhNode *bvh, SDL_Surface *surface, int *num_inte
     return EXIT_SUCCESS;
 }
 
+#define TILE_SIZE 16
+
+// Intersection counter per worker, padded so workers don't share a cache line.
+typedef struct WorkerStats {
+    int num_intersects;
+} __attribute__((aligned(64))) WorkerStats;
+
+typedef struct TileRenderCtx {
+    Camera *camera;
+    Bvh *bvh;
+    SDL_Surface *surface;
+    int tiles_x;
+    WorkerStats *stats;
+} TileRenderCtx;
+
+void render_tile_bvh(int tile, int worker, void *arg) {
+    TileRenderCtx *ctx = arg;
+    Camera *camera = ctx->camera;
+
+    int x0 = (tile % ctx->tiles_x) * TILE_SIZE;
+    int y0 = (tile / ctx->tiles_x) * TILE_SIZE;
+    int x1 = (x0 + TILE_SIZE < camera->image_width) ? x0 + TILE_SIZE : camera->image_width;
+    int y1 = (y0 + TILE_SIZE < camera->image_height) ? y0 + TILE_SIZE : camera->image_height;
+
+    int num_intersects = 0;
+    if (camera->ray_packets) {
+        Color colors[RAY_PACKET_SIZE];
+        for (int j = y0; j < y1; j += RAY_PACKET_HEIGHT) {
+            for (int i = x0; i < x1; i += RAY_PACKET_WIDTH) {
+                render_packet_bvh(camera, ctx->bvh, i, j, colors, &num_intersects);
+                for (int lane = 0; lane < RAY_PACKET_SIZE; lane++) {
+                    int x = i + lane % RAY_PACKET_WIDTH;
+                    int y = j + lane / RAY_PACKET_WIDTH;
+                    if (x >= x1 || y >= y1) continue;
+                    set_pixel_buffer(colors[lane], camera->samples_per_pixel, x + y * ctx->surface->w, ctx->surface);
+                }
+            }
+        }
+    } else {
+        for (int j = y0; j < y1; ++j) {
+            for (int i = x0; i < x1; ++i) {
+                Color pixel_color = render_pixel_bvh(camera, ctx->bvh, i, j, &num_intersects);
+                set_pixel_buffer(pixel_color, camera->samples_per_pixel, i + j * ctx->surface->w, ctx->surface);
+            }
+        }
+    }
+    ctx->stats[worker].num_intersects += num_intersects;
+}
+
+// Tiled version of render_bvh, tiles are spread over num_threads workers that steal from each other.
+int render_bvh_parallel(Camera *camera, Bvh *bvh, SDL_Surface *surface, int *num_intersects, int num_threads) {
+    if (num_threads < 1) num_threads = default_num_threads();
+
+    int tiles_x = (camera->image_width + TILE_SIZE - 1) / TILE_SIZE;
+    int tiles_y = (camera->image_height + TILE_SIZE - 1) / TILE_SIZE;
+
+    WorkerStats *stats = aligned_alloc(64, sizeof(WorkerStats) * num_threads);
+    for (int w = 0; w < num_threads; w++) {
+        stats[w].num_intersects = 0;
+    }
+
+    TileRenderCtx ctx = {
+        .camera = camera,
+        .bvh = bvh,
+        .surface = surface,
+        .tiles_x = tiles_x,
+        .stats = stats
+    };
+    int ret = run_work_stealing(tiles_x * tiles_y, num_threads, render_tile_bvh, &ctx);
+
+    for (int w = 0; w < num_threads; w++) {
+        *num_intersects += stats[w].num_intersects;
+    }
+    free(stats);
+
+    return ret;
+}
@@ -32,11 +32,11 @@ SDL_Color process_color(Color pixel_color, int samples_per_pixel) {
     g = linear_to_gamma(g);
     b = linear_to_gamma(b);
 
-    Interval intensity = {.min=0.000, .max=0.999};
+    // Clamp to [0, 0.999] in double; Interval holds real and would round here
     return (SDL_Color) {
-        .r = (Uint8) (256.0 * clamp(&intensity, r)),
-        .g = (Uint8) (256.0 * clamp(&intensity, g)),
-        .b = (Uint8) (256.0 * clamp(&intensity, b)),
+        .r = (Uint8) (256.0 * fmin(fmax(r, 0.0), 0.999)),
+        .g = (Uint8) (256.0 * fmin(fmax(g, 0.0), 0.999)),
+        .b = (Uint8) (256.0 * fmin(fmax(b, 0.0), 0.999)),
     };
 }
 
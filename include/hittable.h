@@ -11,3 +11,13 @@ void set_face_normal(HitRecord *record, const Ray *r, Vec3 outward_normal) {
     record->front_face = dot(r->direction, outward_normal) < 0;
     record->normal = record->front_face ? outward_normal : invert_vec3(outward_normal);
 }
+
+// Closest candidate kept while searching primitives. Only the distance, the
+// primitive and where on it the ray landed are recorded, the hit record is
+// filled in once per ray when the search is over.
+typedef struct PrimHit {
+    real t;
+    int prim;     // index into the searched primitive array
+    int sub_prim; // primitive inside an instanced tree, see bvh.h
+    real u, v;    // barycentrics for triangles, plane coordinates for quads
+} PrimHit;
@@ -4,8 +4,10 @@
 #include<stdbool.h>
 #include<math.h>
 
+#include "precision.h"
+
 typedef struct Interval{
-    double min, max;
+    real min, max;
 } Interval;
 
 Interval EMPTY = {.min = INFINITY, .max=-INFINITY};
@@ -15,26 +17,26 @@ Interval create_from_interval(Interval a, Interval b) {
     return (Interval) {.min = fmin(a.min, b.min), .max = fmax(a.max, b.max)};
 }
 
-Interval expand_interval(double delta, Interval i) {
+Interval expand_interval(real delta, Interval i) {
     return (Interval) {.min = i.min - delta, .max = i.max + delta};
 }
 
-bool contains(const Interval *i, double x) {
+bool contains(const Interval *i, real x) {
     return i->min <= x && x <= i->max;
 }
 
-bool surrounds(const Interval *i, double x) {
+bool surrounds(const Interval *i, real x) {
     return i->min < x && x < i->max;
 }
 
-double clamp(const Interval *i, double x) {
+real clamp(const Interval *i, real x) {
     if (x < i->min) return i->min;
     if (x > i->max) return i->max;
 
     return x;
 }
 
-double size_interval(const Interval i) {
+real size_interval(const Interval i) {
     return (i.max - i.min);
 }
 
@@ -1,47 +1,87 @@
 #pragma once
 
+#include <assert.h>
 #include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
 
 #include "utils.h"
 #include "types.h"
 #include "ray.h"
 #include "color.h"
 
-bool scatter_lambertian(const Material *material, const HitRecord *rec, Color *attenuation, Ray *scattered) {
-    Vec3 random_unit_vec = random_unit_vector();
+// Scene-wide material table. Primitives and hit records store an index into it
+// instead of a copy of the material.
+typedef struct MaterialTable {
+    Material *materials;
+    int count;
+    int capacity;
+} MaterialTable;
+
+MaterialTable scene_materials = {0};
+
+// Returns the id of the new material
+// Exits if the table cannot grow, every primitive made with the id would shade wrong
+int add_material(Material mat) {
+    if (scene_materials.count == scene_materials.capacity) {
+        int capacity = (scene_materials.capacity == 0) ? 64 : 2 * scene_materials.capacity;
+        Material *materials = realloc(scene_materials.materials, sizeof(Material) * (size_t) capacity);
+        if (materials == NULL) {
+            fprintf(stderr, "Could not grow the material table to %d materials.\n", capacity);
+            exit(EXIT_FAILURE);
+        }
+        scene_materials.materials = materials;
+        scene_materials.capacity = capacity;
+    }
+    scene_materials.materials[scene_materials.count] = mat;
+    return scene_materials.count++;
+}
+
+const Material* get_material(int mat_id) {
+    assert(0 <= mat_id && mat_id < scene_materials.count);
+    return &scene_materials.materials[mat_id];
+}
+
+void clear_materials() {
+    free(scene_materials.materials);
+    scene_materials = (MaterialTable) {0};
+}
+
+bool scatter_lambertian(const Material *material, const HitRecord *rec, Color *attenuation, Ray *scattered, Rng *rng) {
+    Vec3 random_unit_vec = random_unit_vector(rng);
     Vec3 scatter_direction = add_vec3(rec->normal, random_unit_vec);
     if (near_zero(scatter_direction)) {
         scatter_direction = rec->normal;
     }
 
-    Ray scattered_ray = {rec->p, scatter_direction};
+    Ray scattered_ray = create_ray(rec->p, scatter_direction);
     *scattered = scattered_ray;
     *attenuation = material->albedo;
 
     return true;
 }
 
-bool scatter_lambertian_texture(const Material *material, const HitRecord *rec, Color *attenuation, Ray *scattered) {
-    Vec3 random_unit_vec = random_unit_vector();
+bool scatter_lambertian_texture(const Material *material, const HitRecord *rec, Color *attenuation, Ray *scattered, Rng *rng) {
+    Vec3 random_unit_vec = random_unit_vector(rng);
     Vec3 scatter_direction = add_vec3(rec->normal, random_unit_vec);
     if (near_zero(scatter_direction)) {
         scatter_direction = rec->normal;
     }
 
-    Ray scattered_ray = {rec->p, scatter_direction};
+    Ray scattered_ray = create_ray(rec->p, scatter_direction);
     *scattered = scattered_ray;
     *attenuation = value_checker(0, 0, &rec->p, &material->texture);
 
     return true;
 }
 
-bool scatter_metal(const Material *material, const Ray *ray_in, const HitRecord *rec, Color *attenuation, Ray *scattered) {
+bool scatter_metal(const Material *material, const Ray *ray_in, const HitRecord *rec, Color *attenuation, Ray *scattered, Rng *rng) {
     Vec3 unit = unit_vec(ray_in->direction);
     Vec3 reflected = reflect(unit, rec->normal);
-    Vec3 random_unit = random_unit_vector();
-    Vec3 fuzzed_unit = scale_vec3(random_unit, material->fuzz);
+    Vec3 random_unit = random_unit_vector(rng);
+    Vec3 fuzzed_unit = scale_vec3(random_unit, (real) material->fuzz);
     Vec3 fuzzed_reflected = add_vec3(reflected, fuzzed_unit);
-    Ray scattered_ray = {rec->p, fuzzed_reflected};
+    Ray scattered_ray = create_ray(rec->p, fuzzed_reflected);
 
     *scattered = scattered_ray;
     *attenuation = material->albedo;
@@ -57,7 +97,7 @@ double reflectance(double cosine, double ref_indx) {
     return r0 + (1-r0)*pow((1-cosine), 5);
 }
 
-bool scatter_dielectric(const Material *material, const Ray *ray_in, const HitRecord *rec, Color *attenuation, Ray *scattered) {
+bool scatter_dielectric(const Material *material, const Ray *ray_in, const HitRecord *rec, Color *attenuation, Ray *scattered, Rng *rng) {
     *attenuation = (Color) {1.0, 1.0, 1.0};
     double refraction_ratio = rec->front_face ? (1.0/material->ir): material->ir; 
 
@@ -68,30 +108,30 @@ bool scatter_dielectric(const Material *material, const Ray *ray_in, const HitRe
 
     bool cannot_refract = refraction_ratio * sin_theta > 1.0;
     Vec3 direction;
-    if (cannot_refract || reflectance(cos_theta, refraction_ratio) > random_double()) {
+    if (cannot_refract || reflectance(cos_theta, refraction_ratio) > random_double(rng)) {
         direction = reflect(unit_direction, rec->normal);
     } else {
-        direction = refract(unit_direction, rec->normal, refraction_ratio);
+        direction = refract(unit_direction, rec->normal, (real) refraction_ratio);
     }
 
-    *scattered = (Ray) {rec->p, direction};
+    *scattered = create_ray(rec->p, direction);
     return true;
 }
 
-bool scatter(const Material *material, const Ray *ray_in, const HitRecord *rec, Color *attenuation, Ray *scattered) {
+bool scatter(const Material *material, const Ray *ray_in, const HitRecord *rec, Color *attenuation, Ray *scattered, Rng *rng) {
     switch (material->type) {
         bool ret;
         case LAMBERTIAN:
-            ret = scatter_lambertian(material, rec, attenuation, scattered);
+            ret = scatter_lambertian(material, rec, attenuation, scattered, rng);
             return ret;
         case LAMBERTIAN_TEXTURE:
-            ret = scatter_lambertian_texture(material, rec, attenuation, scattered);
+            ret = scatter_lambertian_texture(material, rec, attenuation, scattered, rng);
             return ret;
         case METAL:
-            ret = scatter_metal(material, ray_in, rec, attenuation, scattered);
+            ret = scatter_metal(material, ray_in, rec, attenuation, scattered, rng);
             return ret;
         case DIELECTRIC:
-            ret = scatter_dielectric(material, ray_in, rec, attenuation, scattered);
+            ret = scatter_dielectric(material, ray_in, rec, attenuation, scattered, rng);
             return ret;
     }
 
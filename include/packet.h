@@ -0,0 +1,433 @@
+#pragma once
+
+#include <stdbool.h>
+#include <math.h>
+
+#include "bvh.h"
+#include "simd.h"
+
+// Packets of coherent primary rays traced through the BVH together, its wide
+// form when it has one.
+//
+// A packet covers a RAY_PACKET_WIDTH x RAY_PACKET_HEIGHT block of pixels. Rays
+// are stored as arrays per component so SIMD_LANES rays are tested against a
+// box, sphere or triangle at once. Each lane keeps its closest hit as a
+// distance, a primitive index and barycentrics, the hit record is only filled
+// in once traversal is done.
+// Quads and instances are still tested one ray at a time.
+
+#ifndef RAY_PACKET_WIDTH
+#define RAY_PACKET_WIDTH 4
+#endif
+#ifndef RAY_PACKET_HEIGHT
+#define RAY_PACKET_HEIGHT 2
+#endif
+#define RAY_PACKET_SIZE (RAY_PACKET_WIDTH * RAY_PACKET_HEIGHT)
+
+// Rays tested together by the kernels below, one simd register wide
+#ifdef RT_SIMD
+#define PACKET_GROUP SIMD_LANES
+#else
+#define PACKET_GROUP 4
+#endif
+#define PACKET_GROUP_MASK ((1 << PACKET_GROUP) - 1)
+
+_Static_assert(RAY_PACKET_SIZE % PACKET_GROUP == 0, "packets are tested a simd register at a time");
+_Static_assert(RAY_PACKET_SIZE <= 16, "lane masks are kept in an int");
+
+typedef struct RayPacket {
+    real ox[RAY_PACKET_SIZE], oy[RAY_PACKET_SIZE], oz[RAY_PACKET_SIZE];
+    real dx[RAY_PACKET_SIZE], dy[RAY_PACKET_SIZE], dz[RAY_PACKET_SIZE];
+    real inv_dx[RAY_PACKET_SIZE], inv_dy[RAY_PACKET_SIZE], inv_dz[RAY_PACKET_SIZE];
+    real t_max[RAY_PACKET_SIZE]; // closest hit so far
+    int prim[RAY_PACKET_SIZE];   // primitive of the closest hit, -1 for a miss
+    int sub_prim[RAY_PACKET_SIZE]; // primitive inside an instanced tree
+    real u[RAY_PACKET_SIZE], v[RAY_PACKET_SIZE]; // barycentrics or plane coordinates of the hit
+    Ray rays[RAY_PACKET_SIZE];
+    int active;                  // bit per lane holding a ray
+} __attribute__((aligned(32))) RayPacket;
+
+typedef struct PacketStackEntry {
+    int index;    // node, or first primitive when count > 0
+    int count;    // primitives of a wide leaf entry
+    int mask;     // lanes that reached the parent node
+    real t_entry; // where the first live ray enters a wide child, orders the children
+} PacketStackEntry;
+
+void init_ray_packet(RayPacket *packet) {
+    packet->active = 0;
+    for (int lane = 0; lane < RAY_PACKET_SIZE; lane++) {
+        // Parked lanes get a harmless ray so the SIMD kernels never read garbage
+        packet->ox[lane] = packet->oy[lane] = packet->oz[lane] = 0.0;
+        packet->dx[lane] = packet->dy[lane] = packet->dz[lane] = 1.0;
+        packet->inv_dx[lane] = packet->inv_dy[lane] = packet->inv_dz[lane] = 1.0;
+        packet->t_max[lane] = -INFINITY;
+        packet->prim[lane] = -1;
+        packet->u[lane] = packet->v[lane] = 0.0;
+    }
+}
+
+void set_packet_ray(RayPacket *packet, int lane, const Ray *ray, real t_max) {
+    packet->rays[lane] = *ray;
+    packet->ox[lane] = ray->origin.x;
+    packet->oy[lane] = ray->origin.y;
+    packet->oz[lane] = ray->origin.z;
+    packet->dx[lane] = ray->direction.x;
+    packet->dy[lane] = ray->direction.y;
+    packet->dz[lane] = ray->direction.z;
+    packet->inv_dx[lane] = ray->inv_direction.x;
+    packet->inv_dy[lane] = ray->inv_direction.y;
+    packet->inv_dz[lane] = ray->inv_direction.z;
+    packet->t_max[lane] = t_max;
+    packet->prim[lane] = -1;
+    packet->active |= 1 << lane;
+}
+
+// Lanes in mask whose ray enters bbox between t_min and its closest hit
+int hit_aabb_packet(const RayPacket *packet, const AABB *bbox, real t_min, int mask) {
+    int hits = 0;
+    for (int l = 0; l < RAY_PACKET_SIZE; l += PACKET_GROUP) {
+        int bits = (mask >> l) & PACKET_GROUP_MASK;
+        if (bits == 0) continue;
+#ifdef RT_SIMD
+        vreal tx0 = vmul(vsub(vset1(bbox->x.min), vload(&packet->ox[l])), vload(&packet->inv_dx[l]));
+        vreal tx1 = vmul(vsub(vset1(bbox->x.max), vload(&packet->ox[l])), vload(&packet->inv_dx[l]));
+        vreal ty0 = vmul(vsub(vset1(bbox->y.min), vload(&packet->oy[l])), vload(&packet->inv_dy[l]));
+        vreal ty1 = vmul(vsub(vset1(bbox->y.max), vload(&packet->oy[l])), vload(&packet->inv_dy[l]));
+        vreal tz0 = vmul(vsub(vset1(bbox->z.min), vload(&packet->oz[l])), vload(&packet->inv_dz[l]));
+        vreal tz1 = vmul(vsub(vset1(bbox->z.max), vload(&packet->oz[l])), vload(&packet->inv_dz[l]));
+
+        vreal t_enter = vmax(vmax(vset1(t_min), vmin(tx0, tx1)), vmax(vmin(ty0, ty1), vmin(tz0, tz1)));
+        vreal t_exit = vmin(vmin(vload(&packet->t_max[l]), vmax(tx0, tx1)), vmin(vmax(ty0, ty1), vmax(tz0, tz1)));
+        hits |= (vmovemask(vlt(t_enter, t_exit)) & bits) << l;
+#else
+        for (int k = 0; k < PACKET_GROUP; k++) {
+            if (!(bits & (1 << k))) continue;
+            int i = l + k;
+            real tx0 = (bbox->x.min - packet->ox[i]) * packet->inv_dx[i];
+            real tx1 = (bbox->x.max - packet->ox[i]) * packet->inv_dx[i];
+            real ty0 = (bbox->y.min - packet->oy[i]) * packet->inv_dy[i];
+            real ty1 = (bbox->y.max - packet->oy[i]) * packet->inv_dy[i];
+            real tz0 = (bbox->z.min - packet->oz[i]) * packet->inv_dz[i];
+            real tz1 = (bbox->z.max - packet->oz[i]) * packet->inv_dz[i];
+
+            real t_enter = fmax(fmax(t_min, fmin(tx0, tx1)), fmax(fmin(ty0, ty1), fmin(tz0, tz1)));
+            real t_exit = fmin(fmin(packet->t_max[i], fmax(tx0, tx1)), fmin(fmax(ty0, ty1), fmax(tz0, tz1)));
+            if (t_enter < t_exit) hits |= 1 << i;
+        }
+#endif
+    }
+    return hits;
+}
+
+// Same root selection as ray_intersect_sphere, for every lane in mask
+void intersect_packet_sphere(RayPacket *packet, const SphereGeom *sphere, int index, real t_min, int mask) {
+    for (int l = 0; l < RAY_PACKET_SIZE; l += PACKET_GROUP) {
+        int bits = (mask >> l) & PACKET_GROUP_MASK;
+        if (bits == 0) continue;
+#ifdef RT_SIMD
+        vreal dx = vload(&packet->dx[l]);
+        vreal dy = vload(&packet->dy[l]);
+        vreal dz = vload(&packet->dz[l]);
+        vreal ocx = vsub(vload(&packet->ox[l]), vset1(sphere->center.x));
+        vreal ocy = vsub(vload(&packet->oy[l]), vset1(sphere->center.y));
+        vreal ocz = vsub(vload(&packet->oz[l]), vset1(sphere->center.z));
+
+        vreal a = vadd(vadd(vmul(dx, dx), vmul(dy, dy)), vmul(dz, dz));
+        vreal half_b = vadd(vadd(vmul(ocx, dx), vmul(ocy, dy)), vmul(ocz, dz));
+        vreal r2 = vset1(sphere->radius * sphere->radius);
+        vreal c = vsub(vadd(vadd(vmul(ocx, ocx), vmul(ocy, ocy)), vmul(ocz, ocz)), r2);
+        vreal leaving = vand(vlt(vset1(0.0), half_b), vlt(vmul(vset1(-SPHERE_SURFACE_TOLERANCE), r2), c));
+        vreal s = vdiv(half_b, a);
+        vreal lx = vsub(ocx, vmul(dx, s));
+        vreal ly = vsub(ocy, vmul(dy, s));
+        vreal lz = vsub(ocz, vmul(dz, s));
+        vreal l2 = vadd(vadd(vmul(lx, lx), vmul(ly, ly)), vmul(lz, lz));
+        vreal discrim = vmul(a, vsub(r2, l2));
+        vreal valid = vge(discrim, vset1(0.0));
+        vreal sqrtd = vsqrt(vmax(discrim, vset1(0.0)));
+
+        vreal lo = vset1(t_min);
+        vreal hi = vload(&packet->t_max[l]);
+        vreal neg_b = vsub(vset1(0.0), half_b);
+        vreal root_near = vdiv(vsub(neg_b, sqrtd), a);
+        vreal root_far = vdiv(vadd(neg_b, sqrtd), a);
+        vreal in_near = vand(vlt(lo, root_near), vlt(root_near, hi));
+        vreal in_far = vand(vlt(lo, root_far), vlt(root_far, hi));
+
+        int hits = vmovemask(vand(valid, vor(in_near, in_far))) & ~vmovemask(leaving) & bits;
+        if (hits == 0) continue;
+
+        real root[PACKET_GROUP] __attribute__((aligned(32)));
+        vstore(root, vselect(in_near, root_near, root_far));
+        for (int k = 0; k < PACKET_GROUP; k++) {
+            if (hits & (1 << k)) {
+                packet->t_max[l + k] = root[k];
+                packet->prim[l + k] = index;
+            }
+        }
+#else
+        for (int k = 0; k < PACKET_GROUP; k++) {
+            if (!(bits & (1 << k))) continue;
+            int i = l + k;
+            Vec3 oc = {packet->ox[i] - sphere->center.x, packet->oy[i] - sphere->center.y, packet->oz[i] - sphere->center.z};
+            Vec3 dir = {packet->dx[i], packet->dy[i], packet->dz[i]};
+            real a = length_squared(dir);
+            real half_b = dot(oc, dir);
+            real r2 = sphere->radius * sphere->radius;
+            if (half_b > 0 && length_squared(oc) - r2 > -SPHERE_SURFACE_TOLERANCE * r2) continue;
+
+            Vec3 l = diff_vec3(oc, scale_vec3(dir, half_b / a));
+            real discrim = a * (r2 - length_squared(l));
+            if (discrim < 0) continue;
+            real sqrtd = sqrt(discrim);
+
+            Interval ray_t = {.min = t_min, .max = packet->t_max[i]};
+            real root = (-half_b - sqrtd) / a;
+            if (!surrounds(&ray_t, root)) {
+                root = (-half_b + sqrtd) / a;
+                if (!surrounds(&ray_t, root)) continue;
+            }
+            packet->t_max[i] = root;
+            packet->prim[i] = index;
+        }
+#endif
+    }
+}
+
+// Same test as intersect_triangle_geom, for every lane in mask
+void intersect_packet_triangle(RayPacket *packet, const TriangleGeom *triangle, int index, real t_min, int mask) {
+    for (int l = 0; l < RAY_PACKET_SIZE; l += PACKET_GROUP) {
+        int bits = (mask >> l) & PACKET_GROUP_MASK;
+        if (bits == 0) continue;
+#ifdef RT_SIMD
+        vreal dx = vload(&packet->dx[l]), dy = vload(&packet->dy[l]), dz = vload(&packet->dz[l]);
+        vreal e1x = vset1(triangle->edge1.x), e1y = vset1(triangle->edge1.y), e1z = vset1(triangle->edge1.z);
+        vreal e2x = vset1(triangle->edge2.x), e2y = vset1(triangle->edge2.y), e2z = vset1(triangle->edge2.z);
+
+        // Lanes seeing the back or the edge of the triangle drop out before the division
+        vreal px = vsub(vmul(dy, e2z), vmul(dz, e2y));
+        vreal py = vsub(vmul(dz, e2x), vmul(dx, e2z));
+        vreal pz = vsub(vmul(dx, e2y), vmul(dy, e2x));
+        vreal det = vadd(vadd(vmul(e1x, px), vmul(e1y, py)), vmul(e1z, pz));
+        bits &= vmask_lt(vset1((real) 0.0000001), det);
+        if (bits == 0) continue;
+
+        vreal inv_det = vdiv(vset1(1.0), det);
+        vreal sx = vsub(vload(&packet->ox[l]), vset1(triangle->v1.x));
+        vreal sy = vsub(vload(&packet->oy[l]), vset1(triangle->v1.y));
+        vreal sz = vsub(vload(&packet->oz[l]), vset1(triangle->v1.z));
+        vreal u = vmul(inv_det, vadd(vadd(vmul(sx, px), vmul(sy, py)), vmul(sz, pz)));
+
+        vreal qx = vsub(vmul(sy, e1z), vmul(sz, e1y));
+        vreal qy = vsub(vmul(sz, e1x), vmul(sx, e1z));
+        vreal qz = vsub(vmul(sx, e1y), vmul(sy, e1x));
+        vreal dist = vmul(inv_det, vadd(vadd(vmul(e2x, qx), vmul(e2y, qy)), vmul(e2z, qz)));
+        vreal v = vmul(inv_det, vadd(vadd(vmul(dx, qx), vmul(dy, qy)), vmul(dz, qz)));
+
+        vreal zero = vset1(0.0), one = vset1(1.0);
+        int inside = vmask_ge(u, zero) & vmask_ge(v, zero) & vmask_ge(one, vadd(u, v));
+        int in_range = vmask_lt(vset1(t_min), dist) & vmask_lt(dist, vload(&packet->t_max[l]));
+        int hits = inside & in_range & bits;
+        if (hits == 0) continue;
+
+        real dists[PACKET_GROUP] __attribute__((aligned(32)));
+        real us[PACKET_GROUP] __attribute__((aligned(32)));
+        real vs[PACKET_GROUP] __attribute__((aligned(32)));
+        vstore(dists, dist);
+        vstore(us, u);
+        vstore(vs, v);
+        for (int k = 0; k < PACKET_GROUP; k++) {
+            if (hits & (1 << k)) {
+                packet->t_max[l + k] = dists[k];
+                packet->prim[l + k] = index;
+                packet->u[l + k] = us[k];
+                packet->v[l + k] = vs[k];
+            }
+        }
+#else
+        for (int k = 0; k < PACKET_GROUP; k++) {
+            if (!(bits & (1 << k))) continue;
+            int i = l + k;
+            Interval ray_t = {.min = t_min, .max = packet->t_max[i]};
+            real t, u, v;
+            if (intersect_triangle_geom(&packet->rays[i], triangle, &ray_t, &t, &u, &v)) {
+                packet->t_max[i] = t;
+                packet->prim[i] = index;
+                packet->u[i] = u;
+                packet->v[i] = v;
+            }
+        }
+#endif
+    }
+}
+
+// Quads and instances, one lane at a time
+void intersect_packet_prims(RayPacket *packet, const Bvh *bvh, int first, int count, real t_min, int mask, int *num_intersects) {
+    for (int lane = 0; lane < RAY_PACKET_SIZE; lane++) {
+        if (!(mask & (1 << lane))) continue;
+        Interval ray_t = {.min = t_min, .max = packet->t_max[lane]};
+        PrimHit hit;
+        if (ray_intersect_bvh_prims(bvh, first, count, &packet->rays[lane], ray_t, &hit, num_intersects)) {
+            packet->t_max[lane] = hit.t;
+            packet->prim[lane] = hit.prim;
+            packet->sub_prim[lane] = hit.sub_prim;
+            packet->u[lane] = hit.u;
+            packet->v[lane] = hit.v;
+        }
+    }
+}
+
+// Primitives [first, first + count) against the lanes in mask
+void intersect_packet_leaf(RayPacket *packet, const Bvh *bvh, int first, int count, real t_min, int mask, int *num_intersects) {
+    for (int i = first; i < first + count; i++) {
+        PrimRef ref = bvh->prim_refs[i];
+        if (prim_ref_type(ref) == PRIM_SPHERE) {
+            (*num_intersects)++;
+            SphereGeom sphere = get_block_sphere(bvh->sphere_blocks, prim_ref_index(ref));
+            intersect_packet_sphere(packet, &sphere, i, t_min, mask);
+        } else if (prim_ref_type(ref) == PRIM_TRIANGLE) {
+            (*num_intersects)++;
+            TriangleGeom triangle = get_block_triangle(bvh->triangle_blocks, prim_ref_index(ref));
+            intersect_packet_triangle(packet, &triangle, i, t_min, mask);
+        } else {
+            intersect_packet_prims(packet, bvh, i, 1, t_min, mask, num_intersects);
+        }
+    }
+}
+
+// Closest hit for every active lane through the binary nodes. Nodes are visited in the
+// order the first live ray would visit them, and skipped once no ray in the packet
+// enters them. Counts one box or primitive test per packet.
+void ray_intersect_binary_bvh_packet(const Bvh *bvh, RayPacket *packet, real t_min, int *num_intersects) {
+    PacketStackEntry stack[BVH_STACK_SIZE];
+    int top = 0;
+    stack[top++] = (PacketStackEntry) {.index = 0, .mask = packet->active};
+
+    while (top > 0) {
+        PacketStackEntry entry = stack[--top];
+        const BvhNode *node = &bvh->nodes[entry.index];
+
+        (*num_intersects)++;
+        int mask = hit_aabb_packet(packet, &node->bbox, t_min, entry.mask);
+        if (mask == 0) {
+            continue;
+        }
+
+        if (is_leaf(node)) {
+            intersect_packet_leaf(packet, bvh, node->offset, node->count, t_min, mask, num_intersects);
+            continue;
+        }
+
+        int near = entry.index + 1;
+        int far = node->offset;
+        if (packet->rays[__builtin_ctz(mask)].sign[node->axis]) {
+            near = node->offset;
+            far = entry.index + 1;
+        }
+        stack[top++] = (PacketStackEntry) {.index = far, .mask = mask};
+        stack[top++] = (PacketStackEntry) {.index = near, .mask = mask};
+    }
+}
+
+// Box of child i of wide node index, from the compressed nodes when the tree has them
+AABB wide_child_bbox(const Bvh *bvh, int index, int i) {
+    if (bvh->compressed_nodes != NULL) {
+        const CompressedBvhNode *node = &bvh->compressed_nodes[index];
+        return (AABB) {
+            .x = {.min = node->origin[0] + node->min_x[i] * node->scale[0], .max = node->origin[0] + node->max_x[i] * node->scale[0]},
+            .y = {.min = node->origin[1] + node->min_y[i] * node->scale[1], .max = node->origin[1] + node->max_y[i] * node->scale[1]},
+            .z = {.min = node->origin[2] + node->min_z[i] * node->scale[2], .max = node->origin[2] + node->max_z[i] * node->scale[2]},
+        };
+    }
+    const WideBvhNode *node = &bvh->wide_nodes[index];
+    return (AABB) {
+        .x = {.min = node->min_x[i], .max = node->max_x[i]},
+        .y = {.min = node->min_y[i], .max = node->max_y[i]},
+        .z = {.min = node->min_z[i], .max = node->max_z[i]},
+    };
+}
+
+// Closest hit for every active lane through the wide nodes. Each child box is tested
+// against the whole packet, the children some lane enters are pushed far to near along
+// the first live ray. Counts one test per child box and packet.
+void ray_intersect_wide_bvh_packet(const Bvh *bvh, RayPacket *packet, real t_min, int *num_intersects) {
+    PacketStackEntry stack[WIDE_BVH_STACK_SIZE];
+    int top = 0;
+    stack[top++] = (PacketStackEntry) {.index = 0, .mask = packet->active};
+
+    while (top > 0) {
+        PacketStackEntry entry = stack[--top];
+        if (entry.count > 0) {
+            intersect_packet_leaf(packet, bvh, entry.index, entry.count, t_min, entry.mask, num_intersects);
+            continue;
+        }
+
+        const CompressedBvhNode *compressed = bvh->compressed_nodes != NULL ? &bvh->compressed_nodes[entry.index] : NULL;
+        const WideBvhNode *wide = compressed == NULL ? &bvh->wide_nodes[entry.index] : NULL;
+        int child_count = compressed != NULL ? compressed->child_count : wide->child_count;
+
+        // The first live ray only orders the children, the ones it misses are tested too
+        const Ray *lead = &packet->rays[__builtin_ctz(entry.mask)];
+        Interval lead_t = {.min = t_min, .max = INFINITY};
+        real t_entry[WIDE_BVH_WIDTH] __attribute__((aligned(32)));
+        if (compressed != NULL) {
+            hit_compressed_children(compressed, lead, lead_t, t_entry);
+        } else {
+            hit_wide_children(wide, lead, lead_t, t_entry);
+        }
+
+        *num_intersects += child_count;
+        int pushed = 0;
+        for (int i = 0; i < child_count; i++) {
+            AABB bbox = wide_child_bbox(bvh, entry.index, i);
+            int mask = hit_aabb_packet(packet, &bbox, t_min, entry.mask);
+            if (mask == 0) {
+                continue;
+            }
+
+            PacketStackEntry child = {
+                .index = compressed != NULL ? compressed->child[i] : wide->child[i],
+                .count = compressed != NULL ? compressed->count[i] : wide->count[i],
+                .mask = mask,
+                .t_entry = t_entry[i]
+            };
+            // Insertion sort onto the stack by decreasing entry distance
+            int k = top++;
+            while (k > top - 1 - pushed && stack[k - 1].t_entry < child.t_entry) {
+                stack[k] = stack[k - 1];
+                k--;
+            }
+            stack[k] = child;
+            pushed++;
+        }
+    }
+}
+
+// Closest hit for every active lane, through the wide nodes when the tree has them
+void ray_intersect_bvh_packet(const Bvh *bvh, RayPacket *packet, real t_min, int *num_intersects) {
+    if (bvh->node_count == 0) {
+        return;
+    }
+
+    if (bvh->wide_nodes != NULL || bvh->compressed_nodes != NULL) {
+        ray_intersect_wide_bvh_packet(bvh, packet, t_min, num_intersects);
+    } else {
+        ray_intersect_binary_bvh_packet(bvh, packet, t_min, num_intersects);
+    }
+}
+
+// Fill in the hit record of a lane once traversal is done
+bool finalize_packet_hit(const Bvh *bvh, const RayPacket *packet, int lane, HitRecord *rec) {
+    int prim = packet->prim[lane];
+    if (prim < 0) {
+        return false;
+    }
+
+    PrimHit hit = {
+        .t = packet->t_max[lane], .prim = prim, .sub_prim = packet->sub_prim[lane],
+        .u = packet->u[lane], .v = packet->v[lane]
+    };
+    finalize_bvh_hit(bvh, &packet->rays[lane], &hit, rec);
+    return true;
+}
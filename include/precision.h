@@ -0,0 +1,15 @@
+#pragma once
+
+#include <float.h>
+#include <tgmath.h>
+
+// Scalar type of geometry, bounds and traversal. Build with -DRT_FLOAT to store
+// and trace in single precision, which halves the size of meshes and bvh nodes
+// and doubles the number of simd lanes. Shading and sampling stay in double.
+#ifdef RT_FLOAT
+typedef float real;
+#define REAL_EPSILON FLT_EPSILON
+#else
+typedef double real;
+#define REAL_EPSILON DBL_EPSILON
+#endif
@@ -11,28 +11,28 @@ typedef struct Quad {
     Point3 corner;
     Vec3 dir1;
     Vec3 dir2;
-    Material mat;
+    int mat_id;
 
     // Computed
     Vec3 normal;
-    double plane_d;
-    Vec3 scaled_normal;
+    real plane_d;
+    Vec3 scaled_normal; // cross(dir1, dir2) / |cross(dir1, dir2)|^2
 
 } Quad;
 
-Quad create_quad(Point3 corner, Vec3 dir1, Vec3 dir2, Material mat) {
-    Vec3 normal = cross(dir1, dir2);
-    normal = unit_vec(normal);
+Quad create_quad(Point3 corner, Vec3 dir1, Vec3 dir2, int mat_id) {
+    Vec3 n = cross(dir1, dir2);
+    Vec3 normal = unit_vec(n);
 
-    double plane_d = dot(normal, corner);
+    real plane_d = dot(normal, corner);
     return (Quad) {
         .corner = corner,
         .dir1 = dir1,
         .dir2 = dir2,
-        .mat = mat,
+        .mat_id = mat_id,
         .normal = normal,
         .plane_d = plane_d,
-        .scaled_normal = scale_vec3(normal, dot(normal, normal))
+        .scaled_normal = scale_vec3(n, 1 / dot(n, n))
     };
 }
 
@@ -41,60 +41,112 @@ Point3 get_opposite_corner(Quad q) {
 }
 
 AABB create_aabb_for_quad(Quad q) {
-    return create_aabb_for_point(q.corner, get_opposite_corner(q));
+    // Both diagonals, so slanted quads are covered too. Axis-aligned quads are flat,
+    // pad gives them some thickness for the slab test.
+    AABB diagonal1 = create_aabb_for_point(q.corner, get_opposite_corner(q));
+    AABB diagonal2 = create_aabb_for_point(add_vec3(q.corner, q.dir1), add_vec3(q.corner, q.dir2));
+    return pad(create_aabb_for_aabb(&diagonal1, &diagonal2));
 }
 
-bool is_interior(double alpha, double beta, HitRecord* rec) {
-    // Given the hit point in plane coordinates, return false if it is outside the
-    // primitive, otherwise set the hit record UV coordinates and return true.
+Point3 center_quad(const Quad q) {
+    return add_vec3(q.corner, scale_vec3(add_vec3(q.dir1, q.dir2), 0.5));
+}
 
-    if ((alpha < 0) || (1 < alpha) || (beta < 0) || (1 < beta))
-        return false;
+// What intersection tests read, kept apart from the material id in the bvh.
+// The plane coordinates of a point p are dot(p - corner, alpha_axis) and dot(p - corner, beta_axis).
+typedef struct QuadGeom {
+    Point3 corner;
+    Vec3 normal;
+    Vec3 alpha_axis, beta_axis;
+} QuadGeom;
+
+QuadGeom make_quad_geom(const Quad *quad) {
+    return (QuadGeom) {
+        .corner = quad->corner,
+        .normal = quad->normal,
+        .alpha_axis = cross(quad->dir2, quad->scaled_normal),
+        .beta_axis = cross(quad->scaled_normal, quad->dir1)
+    };
+}
 
-    rec->u = alpha;
-    rec->v = beta;
-    return true;
+bool is_interior(real alpha, real beta) {
+    // Given the hit point in plane coordinates, return false if it is outside the primitive
+    return (0 <= alpha) && (alpha <= 1) && (0 <= beta) && (beta <= 1);
 }
 
-bool ray_intersect_quad(const Ray *r, const Quad *quad, const Interval *ray_t, HitRecord *rec, int *num_intersects) {
-    double denom = dot(quad->normal, r->direction);
+// Hit inside ray_t and its plane coordinates, without filling in a hit record
+bool intersect_quad_geom(const Ray *r, const QuadGeom *quad, const Interval *ray_t, real *t, real *alpha, real *beta) {
+    real denom = dot(quad->normal, r->direction);
     
-    if (fabs(denom) < 1e-8) return false;
+    if (fabs(denom) < (real) 1e-8) return false;
 
-    double t = (quad->plane_d - dot(quad->normal, r->origin)) / denom;
+    real dist = dot(quad->normal, diff_vec3(quad->corner, r->origin)) / denom;
+    if (!surrounds(ray_t, dist)) return false;
 
-    Point3 intersection = at(r, t);
-    Vec3 planar_hitpt_vector = diff_vec3(intersection, quad->corner);
-    double alpha = dot(quad->scaled_normal, cross(planar_hitpt_vector, quad->dir1));
-    double beta = dot(quad->scaled_normal, cross(quad->dir2, planar_hitpt_vector));
+    Vec3 planar_hitpt_vector = diff_vec3(at(r, dist), quad->corner);
+    *alpha = dot(planar_hitpt_vector, quad->alpha_axis);
+    *beta = dot(planar_hitpt_vector, quad->beta_axis);
+    *t = dist;
 
-    if (!is_interior(alpha, beta, rec))
-        return false;
+    return is_interior(*alpha, *beta);
+}
 
-    // Ray hits the 2D shape; set the rest of the hit record and return true.
-    rec->t = t;
-    rec->p = intersection;
-    rec->mat = quad->mat;
+// Fill in the hit record once the closest quad is known
+void finalize_quad_hit(const Ray *r, const QuadGeom *quad, int mat_id, const PrimHit *hit, HitRecord *rec) {
+    rec->t = hit->t;
+    rec->p = at(r, hit->t);
+    rec->u = hit->u;
+    rec->v = hit->v;
+    rec->mat_id = mat_id;
     set_face_normal(rec, r, quad->normal);
+}
+
+bool ray_intersect_quad(const Ray *r, const Quad *quad, const Interval *ray_t, HitRecord *rec, int *num_intersects) {
+    (*num_intersects)++;
+
+    QuadGeom geom = make_quad_geom(quad);
+    PrimHit hit = {0};
+    if (!intersect_quad_geom(r, &geom, ray_t, &hit.t, &hit.u, &hit.v)) {
+        return false;
+    }
 
+    finalize_quad_hit(r, &geom, quad->mat_id, &hit, rec);
     return true;
 }
 
 bool ray_intersect_quad_arr(const Ray *r, int num_quads, const Quad quads[], const Interval *ray_t, HitRecord *record, int *num_intersections) {
-    HitRecord temp_rec;
-    bool hit_anything = false;
-    double closest_so_far = ray_t->max;
+    PrimHit hit = {.prim = -1};
+    Interval cur_interval = *ray_t;
+    real t, alpha, beta;
 
+    *num_intersections += num_quads;
     for (int i = 0; i < num_quads; i++) {
-        Interval cur_interval = {.min=ray_t->min, .max=closest_so_far};
-        if (ray_intersect_quad(r, &quads[i], &cur_interval, &temp_rec, num_intersections)) {
-            hit_anything = true;
-            closest_so_far = temp_rec.t;
-            *record = temp_rec;
+        QuadGeom geom = make_quad_geom(&quads[i]);
+        if (intersect_quad_geom(r, &geom, &cur_interval, &t, &alpha, &beta)) {
+            cur_interval.max = t;
+            hit = (PrimHit) {.t = t, .prim = i, .u = alpha, .v = beta};
         }
     }
 
-    return hit_anything;
+    if (hit.prim < 0) {
+        return false;
+    }
+    QuadGeom geom = make_quad_geom(&quads[hit.prim]);
+    finalize_quad_hit(r, &geom, quads[hit.prim].mat_id, &hit, record);
+    return true;
+}
+
+// Whether any quad lies inside ray_t, stops at the first one found
+bool ray_occluded_quad_arr(const Ray *r, int num_quads, const Quad quads[], const Interval *ray_t, int *num_intersections) {
+    real t, alpha, beta;
+    for (int i = 0; i < num_quads; i++) {
+        (*num_intersections)++;
+        QuadGeom geom = make_quad_geom(&quads[i]);
+        if (intersect_quad_geom(r, &geom, ray_t, &t, &alpha, &beta)) {
+            return true;
+        }
+    }
+    return false;
 }
 
 #endif // QUAD_H
@@ -5,14 +5,40 @@
 typedef struct Ray {
     Point3 origin;
     Vec3 direction;
+
+    // Computed, used by the slab test so it never divides
+    Vec3 inv_direction;
+    int sign[3]; // 1 where the direction component is negative
 } Ray;
 
-Point3 at(const Ray *r, double t) {
+real safe_inverse(real d) {
+    // Keep the reciprocal finite for axis-parallel rays, so the slab test never sees inf or nan
+    const real tiny = (real) 1e-30;
+    if (fabs(d) < tiny) {
+        d = (d < 0) ? -tiny : tiny;
+    }
+    return 1 / d;
+}
+
+Ray create_ray(Point3 origin, Vec3 direction) {
+    Ray r = {
+        .origin = origin,
+        .direction = direction,
+        .inv_direction = {safe_inverse(direction.x), safe_inverse(direction.y), safe_inverse(direction.z)}
+    };
+    r.sign[0] = r.inv_direction.x < 0;
+    r.sign[1] = r.inv_direction.y < 0;
+    r.sign[2] = r.inv_direction.z < 0;
+
+    return r;
+}
+
+Point3 at(const Ray *r, real t) {
     Vec3 scaled_dir = scale_vec3(r->direction, t);
     return add_vec3(r->origin, scaled_dir);
 }
 
-double origin_dim(const Ray *r, int axis) {
+real origin_dim(const Ray *r, int axis) {
     switch (axis) {
         case 0:
             return r->origin.x;
@@ -28,7 +54,7 @@ double origin_dim(const Ray *r, int axis) {
     return 0;
 }
 
-double dir_dim(const Ray *r, int axis) {
+real dir_dim(const Ray *r, int axis) {
     switch (axis) {
         case 0:
             return r->direction.x;
@@ -1,5 +1,7 @@
 #include <stdlib.h>
 
+#include "material.h"
+#include "sphere.h"
 #include "triangle.h"
 
 #define TINYOBJ_LOADER_C_IMPLEMENTATION
@@ -47,7 +49,7 @@ int get_obj_data_from_file(const char* filename, TinyObjData* data) {
     return EXIT_SUCCESS;
 }
 
-void convert_obj_data_to_mesh(TinyObjData* data, TriangleMesh* mesh, Material* mat) {
+void convert_obj_data_to_mesh(TinyObjData* data, TriangleMesh* mesh, int mat_id) {
     for (size_t face_id = 0; face_id < data->attrib.num_face_num_verts; face_id++) {
         tinyobj_vertex_index_t idx0 = data->attrib.faces[3 * face_id + 0];
         tinyobj_vertex_index_t idx1 = data->attrib.faces[3 * face_id + 1];
@@ -85,9 +87,69 @@ void convert_obj_data_to_mesh(TinyObjData* data, TriangleMesh* mesh, Material* m
             float n02 = data->attrib.normals[3 * n0 + 2];
             normal = (Point3) {(double) n00, (double) n01, (double) n02};
         } 
-        Triangle tri = {.v1=v0, .v2=v1, .v3=v2, .normal=normal, .mat=*mat};
+        Triangle tri = {.v1=v0, .v2=v1, .v3=v2, .normal=normal, .mat_id=mat_id};
         //printf("Tri indx: %d, %d, %d\n", f0, f1, f2);
         //printf("Create tri: "); print_tri(tri);
         mesh->triangles[face_id] = tri;
     }
 }
+
+// Final scene of "Ray Tracing in One Weekend" on a checkered ground, returns the number of spheres created.
+// sphere_list needs room for 4 + 22 * 22 spheres.
+int create_random_spheres_arr(Sphere *sphere_list) {
+    Rng rng = create_rng(11, 0);
+    int num_spheres = 0;
+    Material ground_material = {
+        .type=LAMBERTIAN_TEXTURE, 
+        .texture=(CheckerTexture) {
+            .inv_scale = 0.32,
+            .even = {0.2, 0.3, 0.1},
+            .odd = {0.9, 0.9, 0.9}
+        }
+    };
+    sphere_list[0] = make_sphere((Point3) {0, -1000, 0}, 1000, add_material(ground_material));
+    num_spheres++;
+
+    Material mat1 = {.type=DIELECTRIC, .ir=1.5};
+    sphere_list[num_spheres] = make_sphere((Point3) {0, 1, 0}, 1.0, add_material(mat1));
+    num_spheres++;
+
+    Material mat2 = {.type=LAMBERTIAN, .albedo=(Color) {0.4, 0.2, 0.1}};
+    sphere_list[num_spheres] = make_sphere((Point3) {-4, 1, 0}, 1.0, add_material(mat2));
+    num_spheres++;
+
+    Material mat3 = {.type=METAL, .albedo=(Color) {0.7, 0.6, 0.5}, .fuzz=0.0};
+    sphere_list[num_spheres] = make_sphere((Point3) {4, 1, 0}, 1.0, add_material(mat3));
+    num_spheres++;
+
+    for (int a = -11; a < 11; a++) {
+        for (int b = -11; b < 11; b++) {
+            double choose_mat = random_double(&rng);
+            Point3 center = {a+ 0.9*random_double(&rng), 0.2, b + 0.9*random_double(&rng)};
+
+            Vec3 vec = diff_vec3(center, (Point3) {4, 0.2, 0});
+            if (length(vec) > 0.9) {
+                if (choose_mat < 0.8) {
+                    // Diffuse
+                    Color albedo = random_vec(&rng);
+                    Material diffuse_mat = {.type=LAMBERTIAN, .albedo=albedo};
+                    sphere_list[num_spheres] = make_sphere(center, 0.2, add_material(diffuse_mat));
+                    num_spheres++;
+                } else if (choose_mat < 0.90) {
+                    // Metal
+                    Color albedo = random_vec_interval(&rng, 0.5, 1);
+                    double fuzz = random_double_interval(&rng, 0, 0.5);
+                    Material metal_mat = {.type=METAL, .albedo=albedo, .fuzz=fuzz};
+                    sphere_list[num_spheres] = make_sphere(center, 0.2, add_material(metal_mat));
+                    num_spheres++;
+                } else {
+                    // Glass
+                    Material glass_mat = {.type=DIELECTRIC, .ir=1.5};
+                    sphere_list[num_spheres] = make_sphere(center, 0.2, add_material(glass_mat));
+                    num_spheres++;
+                }
+            }
+        }
+    }
+    return num_spheres;
+}
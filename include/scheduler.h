@@ -0,0 +1,173 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+// Work-stealing scheduler for independent tasks (render tiles).
+//
+// Every worker starts out owning a contiguous range of task ids. Owners pop
+// from the front of their range, and a worker that runs dry steals the back
+// half of the fullest range it can find. Tasks never spawn new tasks, so once
+// every range is empty the work is done.
+
+typedef void (*TaskFn)(int task, int worker, void *ctx);
+
+// head and tail only change under lock. They are atomic so thieves can peek at the
+// remaining work without taking every lock, relaxed is enough since the peek is rechecked.
+typedef struct WorkQueue {
+    pthread_mutex_t lock;
+    _Atomic int head; // next task the owner runs
+    _Atomic int tail; // one past the last task, thieves take from here
+} __attribute__((aligned(64))) WorkQueue;
+
+typedef struct WorkStealingPool {
+    WorkQueue *queues;
+    int num_workers;
+    TaskFn fn;
+    void *ctx;
+} WorkStealingPool;
+
+typedef struct WorkerArgs {
+    WorkStealingPool *pool;
+    int id;
+} WorkerArgs;
+
+int default_num_threads() {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return (n < 1) ? 1 : (int) n;
+}
+
+int load_index(_Atomic int *index) {
+    return atomic_load_explicit(index, memory_order_relaxed);
+}
+
+void store_index(_Atomic int *index, int value) {
+    atomic_store_explicit(index, value, memory_order_relaxed);
+}
+
+bool pop_task(WorkQueue *queue, int *task) {
+    bool found = false;
+    pthread_mutex_lock(&queue->lock);
+    int head = load_index(&queue->head);
+    if (head < load_index(&queue->tail)) {
+        *task = head;
+        store_index(&queue->head, head + 1);
+        found = true;
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return found;
+}
+
+bool steal_tasks(WorkStealingPool *pool, int thief) {
+    // Pick the victim with the most remaining work, then take the back half of it.
+    int victim = -1;
+    int most = 0;
+    for (int k = 1; k < pool->num_workers; k++) {
+        int w = (thief + k) % pool->num_workers;
+        int remaining = load_index(&pool->queues[w].tail) - load_index(&pool->queues[w].head); // rechecked under the lock
+        if (remaining > most) {
+            most = remaining;
+            victim = w;
+        }
+    }
+    if (victim < 0) {
+        return false;
+    }
+
+    WorkQueue *vq = &pool->queues[victim];
+    pthread_mutex_lock(&vq->lock);
+    int end = load_index(&vq->tail);
+    int remaining = end - load_index(&vq->head);
+    int take = remaining - remaining / 2;
+    int start = end - take;
+    store_index(&vq->tail, start);
+    pthread_mutex_unlock(&vq->lock);
+
+    if (take <= 0) {
+        // Lost the race for this victim, let the caller rescan.
+        return true;
+    }
+
+    WorkQueue *own = &pool->queues[thief];
+    pthread_mutex_lock(&own->lock);
+    store_index(&own->head, start);
+    store_index(&own->tail, end);
+    pthread_mutex_unlock(&own->lock);
+    return true;
+}
+
+void* worker_loop(void *arg) {
+    WorkerArgs *args = arg;
+    WorkStealingPool *pool = args->pool;
+
+    int task;
+    while (true) {
+        while (pop_task(&pool->queues[args->id], &task)) {
+            pool->fn(task, args->id, pool->ctx);
+        }
+        if (!steal_tasks(pool, args->id)) {
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+// Run fn(task, worker, ctx) for every task in [0, num_tasks) on num_workers threads.
+// The calling thread acts as worker 0. Returns EXIT_FAILURE if threads could not be created.
+int run_work_stealing(int num_tasks, int num_workers, TaskFn fn, void *ctx) {
+    if (num_workers < 1) num_workers = 1;
+    if (num_workers > num_tasks) num_workers = (num_tasks < 1) ? 1 : num_tasks;
+
+    WorkStealingPool pool = {
+        .queues = aligned_alloc(64, sizeof(WorkQueue) * num_workers),
+        .num_workers = num_workers,
+        .fn = fn,
+        .ctx = ctx
+    };
+    pthread_t *threads = malloc(sizeof(pthread_t) * num_workers);
+    WorkerArgs *args = malloc(sizeof(WorkerArgs) * num_workers);
+
+    for (int w = 0; w < num_workers; w++) {
+        pthread_mutex_init(&pool.queues[w].lock, NULL);
+        atomic_init(&pool.queues[w].head, (int) ((long) num_tasks * w / num_workers));
+        atomic_init(&pool.queues[w].tail, (int) ((long) num_tasks * (w + 1) / num_workers));
+        args[w] = (WorkerArgs) {.pool = &pool, .id = w};
+    }
+
+    int ret = EXIT_SUCCESS;
+    int started = 1;
+    for (int w = 1; w < num_workers; w++, started++) {
+        if (pthread_create(&threads[w], NULL, worker_loop, &args[w]) != 0) {
+            // Whatever this worker owned gets stolen by the others.
+            ret = EXIT_FAILURE;
+            break;
+        }
+    }
+    worker_loop(&args[0]);
+    for (int w = 1; w < started; w++) {
+        pthread_join(threads[w], NULL);
+    }
+
+    // A worker that failed to start can leave tasks behind if nobody stole them in time.
+    for (int w = started; w < num_workers; w++) {
+        int task;
+        while (pop_task(&pool.queues[w], &task)) {
+            fn(task, 0, ctx);
+        }
+    }
+
+    for (int w = 0; w < num_workers; w++) {
+        pthread_mutex_destroy(&pool.queues[w].lock);
+    }
+    free(args);
+    free(threads);
+    free(pool.queues);
+    return ret;
+}
+
+#endif // SCHEDULER_H
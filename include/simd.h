@@ -0,0 +1,85 @@
+#ifndef SIMD_H
+#define SIMD_H
+
+#include "precision.h"
+
+// Thin wrappers over the AVX2 intrinsics used by the wide traversal kernels.
+// Everything here is only available when the compiler targets AVX2
+// (the release build uses -march=native), callers keep a scalar fallback.
+// A register holds four doubles, or eight floats in the RT_FLOAT build.
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#include <stdint.h>
+#include <string.h>
+
+#define RT_SIMD 1
+
+#ifdef RT_FLOAT
+#define SIMD_LANES 8
+
+typedef __m256 vreal;
+
+static inline vreal vset1(real x) { return _mm256_set1_ps(x); }
+static inline vreal vload(const real *p) { return _mm256_load_ps(p); }
+static inline void vstore(real *p, vreal a) { _mm256_store_ps(p, a); }
+static inline vreal vadd(vreal a, vreal b) { return _mm256_add_ps(a, b); }
+static inline vreal vsub(vreal a, vreal b) { return _mm256_sub_ps(a, b); }
+static inline vreal vmul(vreal a, vreal b) { return _mm256_mul_ps(a, b); }
+static inline vreal vmin(vreal a, vreal b) { return _mm256_min_ps(a, b); }
+static inline vreal vmax(vreal a, vreal b) { return _mm256_max_ps(a, b); }
+static inline vreal vdiv(vreal a, vreal b) { return _mm256_div_ps(a, b); }
+static inline vreal vsqrt(vreal a) { return _mm256_sqrt_ps(a); }
+
+// Comparisons return all-ones lanes where they hold
+static inline vreal vlt(vreal a, vreal b) { return _mm256_cmp_ps(a, b, _CMP_LT_OQ); }
+static inline vreal vge(vreal a, vreal b) { return _mm256_cmp_ps(a, b, _CMP_GE_OQ); }
+static inline vreal vand(vreal a, vreal b) { return _mm256_and_ps(a, b); }
+static inline vreal vor(vreal a, vreal b) { return _mm256_or_ps(a, b); }
+static inline vreal vselect(vreal mask, vreal a, vreal b) { return _mm256_blendv_ps(b, a, mask); }
+static inline int vmovemask(vreal mask) { return _mm256_movemask_ps(mask); }
+
+// Eight bytes widened to one lane each
+static inline vreal vload_u8(const uint8_t *p) { return _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *) p))); }
+
+#else
+#define SIMD_LANES 4
+
+typedef __m256d vreal;
+
+static inline vreal vset1(real x) { return _mm256_set1_pd(x); }
+static inline vreal vload(const real *p) { return _mm256_load_pd(p); }
+static inline void vstore(real *p, vreal a) { _mm256_store_pd(p, a); }
+static inline vreal vadd(vreal a, vreal b) { return _mm256_add_pd(a, b); }
+static inline vreal vsub(vreal a, vreal b) { return _mm256_sub_pd(a, b); }
+static inline vreal vmul(vreal a, vreal b) { return _mm256_mul_pd(a, b); }
+static inline vreal vmin(vreal a, vreal b) { return _mm256_min_pd(a, b); }
+static inline vreal vmax(vreal a, vreal b) { return _mm256_max_pd(a, b); }
+static inline vreal vdiv(vreal a, vreal b) { return _mm256_div_pd(a, b); }
+static inline vreal vsqrt(vreal a) { return _mm256_sqrt_pd(a); }
+
+// Comparisons return all-ones lanes where they hold
+static inline vreal vlt(vreal a, vreal b) { return _mm256_cmp_pd(a, b, _CMP_LT_OQ); }
+static inline vreal vge(vreal a, vreal b) { return _mm256_cmp_pd(a, b, _CMP_GE_OQ); }
+static inline vreal vand(vreal a, vreal b) { return _mm256_and_pd(a, b); }
+static inline vreal vor(vreal a, vreal b) { return _mm256_or_pd(a, b); }
+static inline vreal vselect(vreal mask, vreal a, vreal b) { return _mm256_blendv_pd(b, a, mask); }
+static inline int vmovemask(vreal mask) { return _mm256_movemask_pd(mask); }
+
+// Four bytes widened to one lane each
+static inline vreal vload_u8(const uint8_t *p) {
+    int32_t bytes;
+    memcpy(&bytes, p, sizeof(bytes));
+    return _mm256_cvtepi32_pd(_mm_cvtepu8_epi32(_mm_cvtsi32_si128(bytes)));
+}
+
+#endif // RT_FLOAT
+
+// Bit i is set where a[i] < b[i]
+static inline int vmask_lt(vreal a, vreal b) { return vmovemask(vlt(a, b)); }
+// Bit i is set where a[i] >= b[i]
+static inline int vmask_ge(vreal a, vreal b) { return vmovemask(vge(a, b)); }
+
+#endif // __AVX2__
+
+#endif // SIMD_H
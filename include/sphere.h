@@ -1,28 +1,41 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
 #include <math.h>
 
 #include "types.h"
 #include "interval.h"
 #include "aabb.h"
 #include "hittable.h"
+#include "simd.h"
+
+// Origins within this fraction of radius^2 of the surface count as on it
+#define SPHERE_SURFACE_TOLERANCE (16 * REAL_EPSILON)
 
 typedef struct Sphere {
     Point3 center;
-    double radius;
-    Material mat;
+    real radius;
+    int mat_id;
 } Sphere;
 
 void print_Sphere(const Sphere *sphere) {
-    printf("sphere: (center[%f, %f, %f], r[%f], material[%d])\n", sphere->center.x, sphere->center.y, sphere->center.z, sphere->radius, sphere->mat.type);
+    printf("sphere: (center[%f, %f, %f], r[%f], material[%d])\n", (double) sphere->center.x, (double) sphere->center.y, (double) sphere->center.z,
+           (double) sphere->radius, sphere->mat_id);
 }
 
-Sphere make_sphere(Point3 p, double r, Material mat) {
+// What intersection tests read, kept apart from shading data in the bvh
+typedef struct SphereGeom {
+    Point3 center;
+    real radius;
+} SphereGeom;
+
+Sphere make_sphere(Point3 p, real r, int mat_id) {
     Sphere s = {
         .center = p,
         .radius = r,
-        .mat = mat
+        .mat_id = mat_id
     };
     return s;
 }
@@ -45,22 +58,28 @@ AABB create_aabb_for_array_sphere(const Sphere spheres[], int num_spheres) {
 }
 
 
-bool ray_intersect_sphere(const Ray *r, const Sphere *sphere, const Interval *ray_t, HitRecord *rec, int *num_intersects) {
-    // New intersection check
-    (*num_intersects)++;
-
+// Nearest root inside ray_t, without filling in a hit record
+bool intersect_sphere_geom(const Ray *r, const SphereGeom *sphere, const Interval *ray_t, real *t) {
     Vec3 oc = diff_vec3(r->origin, sphere->center);
 
-    double a = length_squared(r->direction);
-    double half_b = dot(oc, r->direction);
-    double c = length_squared(oc) - sphere->radius*sphere->radius;
+    real a = length_squared(r->direction);
+    real half_b = dot(oc, r->direction);
+
+    // A ray on or outside the sphere heading away from its center can't hit it. Testing
+    // this up front keeps bounces off large spheres from hitting the surface they start
+    // on when rounding puts their origin just inside.
+    real r2 = sphere->radius*sphere->radius;
+    if (half_b > 0 && length_squared(oc) - r2 > -SPHERE_SURFACE_TOLERANCE * r2) return false;
 
-    double discrim = half_b*half_b - a*c;
+    // half_b^2 - a*c written with the offset of the closest approach to the center, which
+    // doesn't cancel for large spheres like the ground (Haines et al., Ray Tracing Gems ch. 7)
+    Vec3 l = diff_vec3(oc, scale_vec3(r->direction, half_b / a));
+    real discrim = a * (r2 - length_squared(l));
     if (discrim < 0) return false; 
-    double sqrtd = sqrt(discrim);
+    real sqrtd = sqrt(discrim);
 
     // Find nearest root that lies within interval
-    double root = (-half_b - sqrtd) / a;
+    real root = (-half_b - sqrtd) / a;
     if (!surrounds(ray_t, root)) {
         root = (-half_b + sqrtd) / a;
         if (!surrounds(ray_t, root)) {
@@ -68,30 +87,234 @@ bool ray_intersect_sphere(const Ray *r, const Sphere *sphere, const Interval *ra
         }
     }
 
-    rec->t = root;
-    rec->p = at(r, rec->t);
+    *t = root;
+    return true;
+}
+
+// Spheres batched for the block kernel, one per simd lane: 4 in the double build, 8 in
+// the float build. A block holds consecutive spheres of an array, structure-of-arrays.
+#ifdef RT_SIMD
+#define SPHERE_BLOCK_SIZE SIMD_LANES
+#else
+#define SPHERE_BLOCK_SIZE 4
+#endif
+#define SPHERE_MIN_BLOCK_RUN 3
+
+typedef struct SphereBlock {
+    real center_x[SPHERE_BLOCK_SIZE], center_y[SPHERE_BLOCK_SIZE], center_z[SPHERE_BLOCK_SIZE];
+    real radius[SPHERE_BLOCK_SIZE];
+} __attribute__((aligned(32))) SphereBlock;
+
+int sphere_block_count(int num_spheres) {
+    return (num_spheres + SPHERE_BLOCK_SIZE - 1) / SPHERE_BLOCK_SIZE;
+}
+
+SphereGeom get_block_sphere(const SphereBlock blocks[], int index) {
+    const SphereBlock *block = &blocks[index / SPHERE_BLOCK_SIZE];
+    int lane = index % SPHERE_BLOCK_SIZE;
+    return (SphereGeom) {
+        .center = {block->center_x[lane], block->center_y[lane], block->center_z[lane]},
+        .radius = block->radius[lane]
+    };
+}
+
+void set_block_sphere(SphereBlock blocks[], int index, Point3 center, real radius) {
+    SphereBlock *block = &blocks[index / SPHERE_BLOCK_SIZE];
+    int lane = index % SPHERE_BLOCK_SIZE;
+    block->center_x[lane] = center.x;
+    block->center_y[lane] = center.y;
+    block->center_z[lane] = center.z;
+    block->radius[lane] = radius;
+}
+
+// Nearest root of the spheres in the lanes of block set in lanes, with the same root
+// selection as intersect_sphere_geom. Returns the lane of the closest hit or -1.
+int intersect_sphere_block(const Ray *r, const SphereBlock *block, int lanes, const Interval *ray_t, real *t) {
+#ifdef RT_SIMD
+    vreal dx = vset1(r->direction.x), dy = vset1(r->direction.y), dz = vset1(r->direction.z);
+    vreal ocx = vsub(vset1(r->origin.x), vload(block->center_x));
+    vreal ocy = vsub(vset1(r->origin.y), vload(block->center_y));
+    vreal ocz = vsub(vset1(r->origin.z), vload(block->center_z));
+    vreal radius = vload(block->radius);
+
+    // Most spheres are missed, the sqrt and divisions wait until some lane can still hit
+    vreal half_b = vadd(vadd(vmul(ocx, dx), vmul(ocy, dy)), vmul(ocz, dz));
+    vreal r2 = vmul(radius, radius);
+    vreal c = vsub(vadd(vadd(vmul(ocx, ocx), vmul(ocy, ocy)), vmul(ocz, ocz)), r2);
+    vreal leaving = vand(vlt(vset1(0.0), half_b), vlt(vmul(vset1(-SPHERE_SURFACE_TOLERANCE), r2), c));
+    lanes &= ~vmovemask(leaving);
+    if (lanes == 0) return -1;
+
+    // One division per ray instead of three per block
+    real ray_a = length_squared(r->direction);
+    vreal a = vset1(ray_a);
+    vreal inv_a = vset1(1 / ray_a);
+    vreal s = vmul(half_b, inv_a);
+    vreal lx = vsub(ocx, vmul(dx, s));
+    vreal ly = vsub(ocy, vmul(dy, s));
+    vreal lz = vsub(ocz, vmul(dz, s));
+    vreal l2 = vadd(vadd(vmul(lx, lx), vmul(ly, ly)), vmul(lz, lz));
+    vreal discrim = vmul(a, vsub(r2, l2));
+    lanes &= vmovemask(vge(discrim, vset1(0.0)));
+    if (lanes == 0) return -1;
+    vreal sqrtd = vsqrt(vmax(discrim, vset1(0.0)));
+
+    vreal lo = vset1(ray_t->min);
+    vreal hi = vset1(ray_t->max);
+    vreal neg_b = vsub(vset1(0.0), half_b);
+    vreal root_near = vmul(vsub(neg_b, sqrtd), inv_a);
+    vreal root_far = vmul(vadd(neg_b, sqrtd), inv_a);
+    vreal in_near = vand(vlt(lo, root_near), vlt(root_near, hi));
+    vreal in_far = vand(vlt(lo, root_far), vlt(root_far, hi));
+
+    int hits = vmovemask(vor(in_near, in_far)) & lanes;
+    if (hits == 0) return -1;
+
+    real root[SPHERE_BLOCK_SIZE] __attribute__((aligned(32)));
+    vstore(root, vselect(in_near, root_near, root_far));
+    int nearest = -1;
+    for (int k = 0; k < SPHERE_BLOCK_SIZE; k++) {
+        if ((hits & (1 << k)) && (nearest < 0 || root[k] < *t)) {
+            nearest = k;
+            *t = root[k];
+        }
+    }
+    return nearest;
+#else
+    Interval cur_interval = *ray_t;
+    int nearest = -1;
+    for (int k = 0; k < SPHERE_BLOCK_SIZE; k++) {
+        if (!(lanes & (1 << k))) continue;
+        SphereGeom geom = get_block_sphere(block, k);
+        if (intersect_sphere_geom(r, &geom, &cur_interval, t)) {
+            cur_interval.max = *t;
+            nearest = k;
+        }
+    }
+    return nearest;
+#endif
+}
+
+// Nearest of the spheres [first, first + count) stored in blocks, returns its index or -1.
+// Runs shorter than SPHERE_MIN_BLOCK_RUN, like most bvh leaves, are cheaper one at a time.
+int intersect_sphere_blocks(const Ray *r, const SphereBlock blocks[], int first, int count, const Interval *ray_t, real *t) {
+    Interval cur_interval = *ray_t;
+    int nearest = -1;
+    if (count < SPHERE_MIN_BLOCK_RUN) {
+        for (int i = first; i < first + count; i++) {
+            SphereGeom geom = get_block_sphere(blocks, i);
+            if (intersect_sphere_geom(r, &geom, &cur_interval, t)) {
+                cur_interval.max = *t;
+                nearest = i;
+            }
+        }
+        return nearest;
+    }
+    int last = first + count - 1;
+    for (int b = first / SPHERE_BLOCK_SIZE; b <= last / SPHERE_BLOCK_SIZE; b++) {
+        int lo = (b == first / SPHERE_BLOCK_SIZE) ? first % SPHERE_BLOCK_SIZE : 0;
+        int hi = (b == last / SPHERE_BLOCK_SIZE) ? last % SPHERE_BLOCK_SIZE : SPHERE_BLOCK_SIZE - 1;
+        int lanes = ((1 << (hi + 1)) - 1) & ~((1 << lo) - 1);
+        int lane = intersect_sphere_block(r, &blocks[b], lanes, &cur_interval, t);
+        if (lane >= 0) {
+            cur_interval.max = *t;
+            nearest = b * SPHERE_BLOCK_SIZE + lane;
+        }
+    }
+    return nearest;
+}
+
+// Blocks holding the geometry of spheres, free them with free(). Lanes past the last
+// sphere are zeroed and never tested. NULL if there are no spheres.
+SphereBlock* make_sphere_blocks(const Sphere spheres[], int num_spheres) {
+    if (num_spheres == 0) {
+        return NULL;
+    }
+
+    size_t bytes = sizeof(SphereBlock) * (size_t) sphere_block_count(num_spheres);
+    SphereBlock *blocks = aligned_alloc(32, bytes);
+    memset(blocks, 0, bytes);
+    for (int i = 0; i < num_spheres; i++) {
+        set_block_sphere(blocks, i, spheres[i].center, spheres[i].radius);
+    }
+    return blocks;
+}
+
+// Fill in the hit record once the closest sphere is known
+void finalize_sphere_hit(const Ray *r, const SphereGeom *sphere, int mat_id, const PrimHit *hit, HitRecord *rec) {
+    rec->t = hit->t;
+    rec->p = at(r, hit->t);
 
     Vec3 outward_normal = diff_vec3(rec->p, sphere->center);
-    outward_normal = scale_vec3(outward_normal, 1.0 / sphere->radius);
+    outward_normal = scale_vec3(outward_normal, 1 / sphere->radius);
     set_face_normal(rec, r, outward_normal);
-    rec->mat = sphere->mat;
-    
+    rec->mat_id = mat_id;
+}
+
+bool ray_intersect_sphere(const Ray *r, const Sphere *sphere, const Interval *ray_t, HitRecord *rec, int *num_intersects) {
+    // New intersection check
+    (*num_intersects)++;
+
+    SphereGeom geom = {.center = sphere->center, .radius = sphere->radius};
+    PrimHit hit = {0};
+    if (!intersect_sphere_geom(r, &geom, ray_t, &hit.t)) {
+        return false;
+    }
+
+    finalize_sphere_hit(r, &geom, sphere->mat_id, &hit, rec);
     return true;
 }
 
 bool ray_intersect_sphere_arr(const Ray *r, int num_spheres, const Sphere spheres[], const Interval *ray_t, HitRecord *record, int *num_intersects) {
-    HitRecord temp_rec = {0};
-    bool hit_anything = false;
-    double closest_so_far = ray_t->max;
+    PrimHit hit = {.prim = -1};
+    Interval cur_interval = *ray_t;
+    real t;
+
+    *num_intersects += num_spheres;
+    for (int i = 0; i < num_spheres; i++) {
+        SphereGeom geom = {.center = spheres[i].center, .radius = spheres[i].radius};
+        if (intersect_sphere_geom(r, &geom, &cur_interval, &t)) {
+            cur_interval.max = t;
+            hit = (PrimHit) {.t = t, .prim = i};
+        }
+    }
+
+    if (hit.prim < 0) {
+        return false;
+    }
+    const Sphere *sphere = &spheres[hit.prim];
+    SphereGeom geom = {.center = sphere->center, .radius = sphere->radius};
+    finalize_sphere_hit(r, &geom, sphere->mat_id, &hit, record);
+    return true;
+}
 
+// Whether any sphere lies inside ray_t, stops at the first one found
+bool ray_occluded_sphere_arr(const Ray *r, int num_spheres, const Sphere spheres[], const Interval *ray_t, int *num_intersects) {
+    real t;
     for (int i = 0; i < num_spheres; i++) {
-        Interval cur_interval = {.min=ray_t->min, .max=closest_so_far};
-        if (ray_intersect_sphere(r, &spheres[i], &cur_interval, &temp_rec, num_intersects)) {
-            hit_anything = true;
-            closest_so_far = temp_rec.t;
-            *record = temp_rec;
+        (*num_intersects)++;
+        SphereGeom geom = {.center = spheres[i].center, .radius = spheres[i].radius};
+        if (intersect_sphere_geom(r, &geom, ray_t, &t)) {
+            return true;
         }
     }
+    return false;
+}
+
+// Same search as ray_intersect_sphere_arr through the block kernel, blocks is
+// make_sphere_blocks(spheres, num_spheres). The shading data still comes from spheres.
+bool ray_intersect_sphere_blocks(const Ray *r, int num_spheres, const SphereBlock blocks[], const Sphere spheres[], const Interval *ray_t, HitRecord *record, int *num_intersects) {
+    *num_intersects += num_spheres;
+    if (num_spheres == 0) {
+        return false;
+    }
 
-    return hit_anything;
+    PrimHit hit = {0};
+    hit.prim = intersect_sphere_blocks(r, blocks, 0, num_spheres, ray_t, &hit.t);
+    if (hit.prim < 0) {
+        return false;
+    }
+    SphereGeom geom = get_block_sphere(blocks, hit.prim);
+    finalize_sphere_hit(r, &geom, spheres[hit.prim].mat_id, &hit, record);
+    return true;
 }
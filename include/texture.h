@@ -17,9 +17,9 @@ typedef struct CheckerTexture {
 } CheckerTexture;
 
 Color value_checker(double u, double v, const Point3 *pt, const CheckerTexture *checker) {
-    int x = (int) floor(checker->inv_scale * pt->x);
-    int y = (int) floor(checker->inv_scale * pt->y);
-    int z = (int) floor(checker->inv_scale * pt->z);
+    int x = (int) floor(checker->inv_scale * (double) pt->x);
+    int y = (int) floor(checker->inv_scale * (double) pt->y);
+    int z = (int) floor(checker->inv_scale * (double) pt->z);
 
     bool isEven = (x + y + z) % 2 == 0;
 
@@ -0,0 +1,123 @@
+#pragma once
+
+#include <math.h>
+
+#include "aabb.h"
+#include "utils.h"
+#include "vec3.h"
+
+// Affine transform: a 3x3 linear part in the first three columns, translation in the last.
+typedef struct Transform {
+    real m[3][4];
+} Transform;
+
+Transform identity_transform() {
+    return (Transform) {.m = {
+        {1, 0, 0, 0},
+        {0, 1, 0, 0},
+        {0, 0, 1, 0}
+    }};
+}
+
+Transform translate_transform(Vec3 offset) {
+    Transform t = identity_transform();
+    t.m[0][3] = offset.x;
+    t.m[1][3] = offset.y;
+    t.m[2][3] = offset.z;
+    return t;
+}
+
+Transform scale_transform(real s) {
+    Transform t = identity_transform();
+    t.m[0][0] = t.m[1][1] = t.m[2][2] = s;
+    return t;
+}
+
+Transform rotate_y_transform(double degrees) {
+    real c = (real) cos(degrees_to_radians(degrees));
+    real s = (real) sin(degrees_to_radians(degrees));
+    Transform t = identity_transform();
+    t.m[0][0] = c;
+    t.m[0][2] = s;
+    t.m[2][0] = -s;
+    t.m[2][2] = c;
+    return t;
+}
+
+// a after b, so compose_transform(a, b) applied to p is a(b(p))
+Transform compose_transform(const Transform *a, const Transform *b) {
+    Transform t;
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 4; j++) {
+            real sum = (j == 3) ? a->m[i][3] : 0;
+            for (int k = 0; k < 3; k++) {
+                sum += a->m[i][k] * b->m[k][j];
+            }
+            t.m[i][j] = sum;
+        }
+    }
+    return t;
+}
+
+// Inverse through the adjugate of the linear part, the transform must not be singular
+Transform invert_transform(const Transform *t) {
+    const real (*m)[4] = t->m;
+    real c00 = m[1][1] * m[2][2] - m[1][2] * m[2][1];
+    real c01 = m[1][2] * m[2][0] - m[1][0] * m[2][2];
+    real c02 = m[1][0] * m[2][1] - m[1][1] * m[2][0];
+    real inv_det = 1 / (m[0][0] * c00 + m[0][1] * c01 + m[0][2] * c02);
+
+    Transform inv;
+    inv.m[0][0] = c00 * inv_det;
+    inv.m[0][1] = (m[0][2] * m[2][1] - m[0][1] * m[2][2]) * inv_det;
+    inv.m[0][2] = (m[0][1] * m[1][2] - m[0][2] * m[1][1]) * inv_det;
+    inv.m[1][0] = c01 * inv_det;
+    inv.m[1][1] = (m[0][0] * m[2][2] - m[0][2] * m[2][0]) * inv_det;
+    inv.m[1][2] = (m[0][2] * m[1][0] - m[0][0] * m[1][2]) * inv_det;
+    inv.m[2][0] = c02 * inv_det;
+    inv.m[2][1] = (m[0][1] * m[2][0] - m[0][0] * m[2][1]) * inv_det;
+    inv.m[2][2] = (m[0][0] * m[1][1] - m[0][1] * m[1][0]) * inv_det;
+    for (int i = 0; i < 3; i++) {
+        inv.m[i][3] = -(inv.m[i][0] * m[0][3] + inv.m[i][1] * m[1][3] + inv.m[i][2] * m[2][3]);
+    }
+    return inv;
+}
+
+Vec3 transform_vector(const Transform *t, Vec3 v) {
+    return (Vec3) {
+        t->m[0][0] * v.x + t->m[0][1] * v.y + t->m[0][2] * v.z,
+        t->m[1][0] * v.x + t->m[1][1] * v.y + t->m[1][2] * v.z,
+        t->m[2][0] * v.x + t->m[2][1] * v.y + t->m[2][2] * v.z
+    };
+}
+
+Point3 transform_point(const Transform *t, Point3 p) {
+    Vec3 v = transform_vector(t, p);
+    return (Point3) {v.x + t->m[0][3], v.y + t->m[1][3], v.z + t->m[2][3]};
+}
+
+// Normals go through the inverse transpose, so this takes the inverse of the
+// transform that moves the surface. The result is not normalized.
+Vec3 transform_normal(const Transform *inverse, Vec3 n) {
+    return (Vec3) {
+        inverse->m[0][0] * n.x + inverse->m[1][0] * n.y + inverse->m[2][0] * n.z,
+        inverse->m[0][1] * n.x + inverse->m[1][1] * n.y + inverse->m[2][1] * n.z,
+        inverse->m[0][2] * n.x + inverse->m[1][2] * n.y + inverse->m[2][2] * n.z
+    };
+}
+
+// Box around the eight transformed corners
+AABB transform_aabb(const Transform *t, const AABB *bbox) {
+    AABB result = create_empty_aabb();
+    for (int i = 0; i < 8; i++) {
+        Point3 corner = {
+            (i & 1) ? bbox->x.max : bbox->x.min,
+            (i & 2) ? bbox->y.max : bbox->y.min,
+            (i & 4) ? bbox->z.max : bbox->z.min
+        };
+        Point3 p = transform_point(t, corner);
+        AABB point_box = create_aabb_for_point(p, p);
+        result = create_aabb_for_aabb(&result, &point_box);
+    }
+    return result;
+}
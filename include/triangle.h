@@ -1,20 +1,39 @@
 #pragma once
 
+#include <stdlib.h>
+#include <string.h>
+
 #include "aabb.h"
 #include "hittable.h"
+#include "simd.h"
 #include "types.h"
 #include "vec3.h"
 
 typedef struct Triangle {
     Point3 v1, v2, v3;
     Vec3 normal;
-    Material mat;
+    int mat_id;
 } Triangle;
 
 void print_tri(Triangle triangle) {
-    printf("triangle: \n\t(v0[%f, %f, %f], v1[%f, %f, %f], v2[%f, %f, %f]), \n\tn[%f, %f, %f], \n\tmat: %d\n", triangle.v1.x, triangle.v1.y, triangle.v1.z, triangle.v2.x, triangle.v2.y, triangle.v2.z, triangle.v3.x, triangle.v3.y, triangle.v3.z, triangle.normal.x, triangle.normal.y, triangle.normal.z, triangle.mat.type);
+    printf("triangle: \n\t(v0[%f, %f, %f], v1[%f, %f, %f], v2[%f, %f, %f]), \n\tn[%f, %f, %f], \n\tmat: %d\n", (double) triangle.v1.x, (double) triangle.v1.y, (double) triangle.v1.z,
+           (double) triangle.v2.x, (double) triangle.v2.y, (double) triangle.v2.z,
+           (double) triangle.v3.x, (double) triangle.v3.y, (double) triangle.v3.z,
+           (double) triangle.normal.x, (double) triangle.normal.y, (double) triangle.normal.z, triangle.mat_id);
 }
 
+// Intersection and shading halves of a triangle, stored apart in the bvh.
+// The intersection half keeps the edges from v1, computed once when the tree is built.
+typedef struct TriangleGeom {
+    Point3 v1;
+    Vec3 edge1, edge2;
+} TriangleGeom;
+
+typedef struct TriangleShading {
+    Vec3 normal;
+    int mat_id;
+} TriangleShading;
+
 typedef struct TriangleMesh {
     Triangle *triangles;
     size_t size;
@@ -32,16 +51,21 @@ Point3 center_triangle(const Triangle t) {
     };
 }
 
-bool ray_intersect_triangle(const Ray *r, const Triangle *triangle, const Interval *ray_t, HitRecord *rec, int *num_intersects) {
-    (*num_intersects)++;
-    const double EPSILON = 0.0000001;
+TriangleGeom make_triangle_geom(const Triangle *triangle) {
+    return (TriangleGeom) {
+        .v1 = triangle->v1,
+        .edge1 = diff_vec3(triangle->v2, triangle->v1),
+        .edge2 = diff_vec3(triangle->v3, triangle->v1)
+    };
+}
 
-    Vec3 dir = unit_vec(r->direction);
-    Vec3 edge1 = diff_vec3 (triangle->v2, triangle->v1);
-    Vec3 edge2 = diff_vec3(triangle->v3, triangle->v1);
+// Front-facing hit inside ray_t and its barycentrics, without filling in a hit record.
+// t is measured along the ray's own direction, like every other primitive.
+bool intersect_triangle_geom(const Ray *r, const TriangleGeom *triangle, const Interval *ray_t, real *t, real *bary_u, real *bary_v) {
+    const real EPSILON = (real) 0.0000001;
 
-    Vec3 rayVecXe2 = cross(dir, edge2);
-    double det = dot(edge1, rayVecXe2);
+    Vec3 rayVecXe2 = cross(r->direction, triangle->edge2);
+    real det = dot(triangle->edge1, rayVecXe2);
 
     // Full compare
     // This ray is parallel to this triangle.
@@ -49,45 +73,248 @@ bool ray_intersect_triangle(const Ray *r, const Triangle *triangle, const Interv
     // "Back facing compare
     if (det <= EPSILON) return false;
 
-    double invDet = 1.0 / det;
+    real invDet = 1 / det;
     Vec3 s = diff_vec3(r->origin, triangle->v1);
-    double u = invDet * dot(s, rayVecXe2);
+    real u = invDet * dot(s, rayVecXe2);
 
-    if (u < 0.0 || u > 1.0) 
+    if (u < 0 || u > 1) 
         return false;
 
-    Vec3 sXe1 = cross(s, edge1);
-    double v = invDet * dot(dir, sXe1);
+    // Distance is known before the last edge test, reject hits behind the closest one early
+    Vec3 sXe1 = cross(s, triangle->edge1);
+    real dist = invDet * dot(triangle->edge2, sXe1);
+    if (!surrounds(ray_t, dist))
+        return false;
 
-    if (v < 0.0 || u + v > 1.0) 
+    real v = invDet * dot(r->direction, sXe1);
+
+    if (v < 0 || u + v > 1) 
         return false;
 
-    // At this stage we can compute t to find out where the intersection point is on the line.
-    double t = invDet * dot(edge2, sXe1);
-    if (t > EPSILON) {
-        Point3 p = at(r, t);
-        rec->t = t;
-        rec->p = p; 
-        rec->mat = triangle->mat;
-        set_face_normal(rec, r, triangle->normal);
-        return true;
+    *t = dist;
+    *bary_u = u;
+    *bary_v = v;
+    return true;
+}
+
+// Triangles batched for the block kernel, one per simd lane like SphereBlock.
+// A block holds the intersection halves of consecutive triangles, structure-of-arrays.
+#ifdef RT_SIMD
+#define TRIANGLE_BLOCK_SIZE SIMD_LANES
+#else
+#define TRIANGLE_BLOCK_SIZE 4
+#endif
+
+typedef struct TriangleBlock {
+    real v1_x[TRIANGLE_BLOCK_SIZE], v1_y[TRIANGLE_BLOCK_SIZE], v1_z[TRIANGLE_BLOCK_SIZE];
+    real edge1_x[TRIANGLE_BLOCK_SIZE], edge1_y[TRIANGLE_BLOCK_SIZE], edge1_z[TRIANGLE_BLOCK_SIZE];
+    real edge2_x[TRIANGLE_BLOCK_SIZE], edge2_y[TRIANGLE_BLOCK_SIZE], edge2_z[TRIANGLE_BLOCK_SIZE];
+} __attribute__((aligned(32))) TriangleBlock;
+
+int triangle_block_count(int num_triangles) {
+    return (num_triangles + TRIANGLE_BLOCK_SIZE - 1) / TRIANGLE_BLOCK_SIZE;
+}
+
+TriangleGeom get_block_triangle(const TriangleBlock blocks[], int index) {
+    const TriangleBlock *block = &blocks[index / TRIANGLE_BLOCK_SIZE];
+    int lane = index % TRIANGLE_BLOCK_SIZE;
+    return (TriangleGeom) {
+        .v1 = {block->v1_x[lane], block->v1_y[lane], block->v1_z[lane]},
+        .edge1 = {block->edge1_x[lane], block->edge1_y[lane], block->edge1_z[lane]},
+        .edge2 = {block->edge2_x[lane], block->edge2_y[lane], block->edge2_z[lane]}
+    };
+}
+
+void set_block_triangle(TriangleBlock blocks[], int index, const TriangleGeom *geom) {
+    TriangleBlock *block = &blocks[index / TRIANGLE_BLOCK_SIZE];
+    int lane = index % TRIANGLE_BLOCK_SIZE;
+    block->v1_x[lane] = geom->v1.x;
+    block->v1_y[lane] = geom->v1.y;
+    block->v1_z[lane] = geom->v1.z;
+    block->edge1_x[lane] = geom->edge1.x;
+    block->edge1_y[lane] = geom->edge1.y;
+    block->edge1_z[lane] = geom->edge1.z;
+    block->edge2_x[lane] = geom->edge2.x;
+    block->edge2_y[lane] = geom->edge2.y;
+    block->edge2_z[lane] = geom->edge2.z;
+}
+
+// Nearest front-facing hit of the triangles in the lanes of block set in lanes, the
+// same test as intersect_triangle_geom. Returns the lane of the closest hit or -1.
+int intersect_triangle_block(const Ray *r, const TriangleBlock *block, int lanes, const Interval *ray_t, real *t, real *bary_u, real *bary_v) {
+#ifdef RT_SIMD
+    vreal dx = vset1(r->direction.x), dy = vset1(r->direction.y), dz = vset1(r->direction.z);
+    vreal e1x = vload(block->edge1_x), e1y = vload(block->edge1_y), e1z = vload(block->edge1_z);
+    vreal e2x = vload(block->edge2_x), e2y = vload(block->edge2_y), e2z = vload(block->edge2_z);
+
+    // Back facing and parallel triangles drop out before the division
+    vreal px = vsub(vmul(dy, e2z), vmul(dz, e2y));
+    vreal py = vsub(vmul(dz, e2x), vmul(dx, e2z));
+    vreal pz = vsub(vmul(dx, e2y), vmul(dy, e2x));
+    vreal det = vadd(vadd(vmul(e1x, px), vmul(e1y, py)), vmul(e1z, pz));
+    lanes &= vmask_lt(vset1((real) 0.0000001), det);
+    if (lanes == 0) return -1;
+
+    vreal inv_det = vdiv(vset1(1.0), det);
+    vreal sx = vsub(vset1(r->origin.x), vload(block->v1_x));
+    vreal sy = vsub(vset1(r->origin.y), vload(block->v1_y));
+    vreal sz = vsub(vset1(r->origin.z), vload(block->v1_z));
+    vreal u = vmul(inv_det, vadd(vadd(vmul(sx, px), vmul(sy, py)), vmul(sz, pz)));
+
+    vreal qx = vsub(vmul(sy, e1z), vmul(sz, e1y));
+    vreal qy = vsub(vmul(sz, e1x), vmul(sx, e1z));
+    vreal qz = vsub(vmul(sx, e1y), vmul(sy, e1x));
+    vreal dist = vmul(inv_det, vadd(vadd(vmul(e2x, qx), vmul(e2y, qy)), vmul(e2z, qz)));
+    vreal v = vmul(inv_det, vadd(vadd(vmul(dx, qx), vmul(dy, qy)), vmul(dz, qz)));
+
+    vreal zero = vset1(0.0), one = vset1(1.0);
+    int inside = vmask_ge(u, zero) & vmask_ge(v, zero) & vmask_ge(one, vadd(u, v));
+    int in_range = vmask_lt(vset1(ray_t->min), dist) & vmask_lt(dist, vset1(ray_t->max));
+    int hits = inside & in_range & lanes;
+    if (hits == 0) return -1;
+
+    real dists[TRIANGLE_BLOCK_SIZE] __attribute__((aligned(32)));
+    vstore(dists, dist);
+    int nearest = -1;
+    for (int k = 0; k < TRIANGLE_BLOCK_SIZE; k++) {
+        if ((hits & (1 << k)) && (nearest < 0 || dists[k] < *t)) {
+            nearest = k;
+            *t = dists[k];
+        }
     }
-    return false;
+    real us[TRIANGLE_BLOCK_SIZE] __attribute__((aligned(32)));
+    real vs[TRIANGLE_BLOCK_SIZE] __attribute__((aligned(32)));
+    vstore(us, u);
+    vstore(vs, v);
+    *bary_u = us[nearest];
+    *bary_v = vs[nearest];
+    return nearest;
+#else
+    Interval cur_interval = *ray_t;
+    int nearest = -1;
+    for (int k = 0; k < TRIANGLE_BLOCK_SIZE; k++) {
+        if (!(lanes & (1 << k))) continue;
+        TriangleGeom geom = get_block_triangle(block, k);
+        if (intersect_triangle_geom(r, &geom, &cur_interval, t, bary_u, bary_v)) {
+            cur_interval.max = *t;
+            nearest = k;
+        }
+    }
+    return nearest;
+#endif
+}
+
+// Nearest of the triangles [first, first + count) stored in blocks, returns its index or -1.
+// Unlike spheres even single triangles go through the block kernel, it pays off at one lane.
+int intersect_triangle_blocks(const Ray *r, const TriangleBlock blocks[], int first, int count, const Interval *ray_t, real *t, real *bary_u, real *bary_v) {
+    Interval cur_interval = *ray_t;
+    int nearest = -1;
+    int last = first + count - 1;
+    for (int b = first / TRIANGLE_BLOCK_SIZE; b <= last / TRIANGLE_BLOCK_SIZE; b++) {
+        int lo = (b == first / TRIANGLE_BLOCK_SIZE) ? first % TRIANGLE_BLOCK_SIZE : 0;
+        int hi = (b == last / TRIANGLE_BLOCK_SIZE) ? last % TRIANGLE_BLOCK_SIZE : TRIANGLE_BLOCK_SIZE - 1;
+        int lanes = ((1 << (hi + 1)) - 1) & ~((1 << lo) - 1);
+        int lane = intersect_triangle_block(r, &blocks[b], lanes, &cur_interval, t, bary_u, bary_v);
+        if (lane >= 0) {
+            cur_interval.max = *t;
+            nearest = b * TRIANGLE_BLOCK_SIZE + lane;
+        }
+    }
+    return nearest;
+}
+
+// Blocks holding the geometry of triangles, free them with free(). Lanes past the last
+// triangle are zeroed, which no ray hits. NULL if there are no triangles.
+TriangleBlock* make_triangle_blocks(const Triangle triangles[], int num_triangles) {
+    if (num_triangles == 0) {
+        return NULL;
+    }
+
+    size_t bytes = sizeof(TriangleBlock) * (size_t) triangle_block_count(num_triangles);
+    TriangleBlock *blocks = aligned_alloc(32, bytes);
+    memset(blocks, 0, bytes);
+    for (int i = 0; i < num_triangles; i++) {
+        TriangleGeom geom = make_triangle_geom(&triangles[i]);
+        set_block_triangle(blocks, i, &geom);
+    }
+    return blocks;
+}
+
+// Fill in the hit record once the closest triangle is known
+void finalize_triangle_hit(const Ray *r, const TriangleShading *shading, const PrimHit *hit, HitRecord *rec) {
+    rec->t = hit->t;
+    rec->p = at(r, hit->t);
+    rec->u = hit->u;
+    rec->v = hit->v;
+    rec->mat_id = shading->mat_id;
+    set_face_normal(rec, r, shading->normal);
+}
+
+bool ray_intersect_triangle(const Ray *r, const Triangle *triangle, const Interval *ray_t, HitRecord *rec, int *num_intersects) {
+    (*num_intersects)++;
+
+    TriangleGeom geom = make_triangle_geom(triangle);
+    PrimHit hit = {0};
+    if (!intersect_triangle_geom(r, &geom, ray_t, &hit.t, &hit.u, &hit.v)) {
+        return false;
+    }
+
+    TriangleShading shading = {.normal = triangle->normal, .mat_id = triangle->mat_id};
+    finalize_triangle_hit(r, &shading, &hit, rec);
+    return true;
 }
 
 bool ray_intersect_triangle_arr(const Ray *r, int num_triangles, const Triangle triangles[], const Interval *ray_t, HitRecord *record, int *num_intersections) {
-    HitRecord temp_rec;
-    bool hit_anything = false;
-    double closest_so_far = ray_t->max;
+    PrimHit hit = {.prim = -1};
+    Interval cur_interval = *ray_t;
+    real t, u, v;
+
+    *num_intersections += num_triangles;
+    for (int i = 0; i < num_triangles; i++) {
+        TriangleGeom geom = make_triangle_geom(&triangles[i]);
+        if (intersect_triangle_geom(r, &geom, &cur_interval, &t, &u, &v)) {
+            cur_interval.max = t;
+            hit = (PrimHit) {.t = t, .prim = i, .u = u, .v = v};
+        }
+    }
+
+    if (hit.prim < 0) {
+        return false;
+    }
+    const Triangle *triangle = &triangles[hit.prim];
+    TriangleShading shading = {.normal = triangle->normal, .mat_id = triangle->mat_id};
+    finalize_triangle_hit(r, &shading, &hit, record);
+    return true;
+}
 
+// Whether any triangle lies inside ray_t, stops at the first one found
+bool ray_occluded_triangle_arr(const Ray *r, int num_triangles, const Triangle triangles[], const Interval *ray_t, int *num_intersections) {
+    real t, u, v;
     for (int i = 0; i < num_triangles; i++) {
-        Interval cur_interval = {.min=ray_t->min, .max=closest_so_far};
-        if (ray_intersect_triangle(r, &triangles[i], &cur_interval, &temp_rec, num_intersections)) {
-            hit_anything = true;
-            closest_so_far = temp_rec.t;
-            *record = temp_rec;
+        (*num_intersections)++;
+        TriangleGeom geom = make_triangle_geom(&triangles[i]);
+        if (intersect_triangle_geom(r, &geom, ray_t, &t, &u, &v)) {
+            return true;
         }
     }
+    return false;
+}
+
+// Same search as ray_intersect_triangle_arr through the block kernel, blocks is
+// make_triangle_blocks(triangles, num_triangles)
+bool ray_intersect_triangle_blocks(const Ray *r, int num_triangles, const TriangleBlock blocks[], const Triangle triangles[], const Interval *ray_t, HitRecord *record, int *num_intersections) {
+    *num_intersections += num_triangles;
+    if (num_triangles == 0) {
+        return false;
+    }
 
-    return hit_anything;
+    PrimHit hit = {0};
+    hit.prim = intersect_triangle_blocks(r, blocks, 0, num_triangles, ray_t, &hit.t, &hit.u, &hit.v);
+    if (hit.prim < 0) {
+        return false;
+    }
+    const Triangle *triangle = &triangles[hit.prim];
+    TriangleShading shading = {.normal = triangle->normal, .mat_id = triangle->mat_id};
+    finalize_triangle_hit(r, &shading, &hit, record);
+    return true;
 }
@@ -23,9 +23,9 @@ typedef struct Material {
 typedef struct HitRecord{
     Point3 p;
     Vec3 normal;
-    double t;
-    double u;
-    double v;
+    real t;
+    real u;
+    real v;
     bool front_face;
-    Material mat;
+    int mat_id; // index into the scene's material table
 } HitRecord;
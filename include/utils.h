@@ -1,30 +1,63 @@
 #pragma once
 
+#include <stdint.h>
+
 const double pi = 3.1415926535897932385;
 
 double degrees_to_radians(double degrees) {
     return degrees * pi / 180.0;
 }
 
-static unsigned int g_seed = 11;
-
-// Used to seed the generator.           
-//inline void fast_srand(int seed) {
-//    g_seed = seed;
-//}
+// PCG32 generator (pcg-random.org). The state is passed explicitly so render
+// threads never share it, and every pixel sample can get its own stream.
+typedef struct Rng {
+    uint64_t state;
+    uint64_t inc;
+} Rng;
 
 // Compute a pseudorandom integer.
-// Output value in range [0, 32767]
-static inline int fast_rand(void) {
-    g_seed = (214013*g_seed+2531011);
-    return (g_seed>>16)&0x7FFF;
+// Output value in range [0, 2^32)
+static inline uint32_t rng_next(Rng *rng) {
+    uint64_t old = rng->state;
+    rng->state = old * 6364136223846793005ULL + rng->inc;
+    uint32_t xorshifted = (uint32_t) (((old >> 18u) ^ old) >> 27u);
+    uint32_t rot = (uint32_t) (old >> 59u);
+    return (xorshifted >> rot) | (xorshifted << ((-rot) & 31));
+}
+
+// Used to seed the generator, different streams give independent sequences for the same seed.
+Rng create_rng(uint64_t seed, uint64_t stream) {
+    Rng rng = {.state = 0, .inc = (stream << 1u) | 1u};
+    rng_next(&rng);
+    rng.state += seed;
+    rng_next(&rng);
+    return rng;
+}
+
+// Mix the pixel coordinates and sample index into a stream id.
+static inline uint64_t hash_sample_stream(int i, int j, int sample) {
+    uint64_t h = ((uint64_t) (uint32_t) i << 32) | (uint32_t) j;
+    h ^= (uint64_t) (uint32_t) sample * 0x9E3779B97F4A7C15ULL;
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCDULL;
+    h ^= h >> 33;
+    h *= 0xC4CEB9FE1A85EC53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+// Generator for one sample of one pixel, so renders are reproducible regardless of
+// which thread (or how many threads) trace the pixel.
+Rng create_sample_rng(uint64_t seed, int i, int j, int sample) {
+    return create_rng(seed, hash_sample_stream(i, j, sample));
 }
 
-double random_double() {
-    return (double) fast_rand() / (32767.0);
+// Output value in range [0, 1)
+double random_double(Rng *rng) {
+    return (double) rng_next(rng) * (1.0 / 4294967296.0);
 }
 
-double random_double_interval(double min, double max) {
-    return min + (max - min) * random_double();
+double random_double_interval(Rng *rng, double min, double max) {
+    return min + (max - min) * random_double(rng);
 }
 
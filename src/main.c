@@ -23,9 +23,13 @@
 #define IMAGE_WIDTH 720
 #define NUM_TRIANGLES 6500
 #define NUM_SPHERES 500
+#define MAX_LEAF_SIZE 4
+#define NUM_FOREST_TREES 400
 
-BvhNode* create_random_spheres(int max_spheres);
-void create_random_spheres_arr(Sphere *spheres);
+Bvh* create_random_spheres(int max_spheres);
+Bvh* create_mixed_world(Triangle triangles[], int num_triangles);
+Bvh* create_forest_world(const Bvh *tree);
+void bounce_spheres(const Sphere rest[], Sphere moved[], int num_spheres, int frame);
 void update_camera(Vec3 delta, Camera *camera);
 
 int main(int argc, char *argv[]) {
@@ -35,14 +39,52 @@ int main(int argc, char *argv[]) {
         return EXIT_FAILURE;
     }
 
-    BvhNode *world;
-    Quad quad_list[5] = {0};
+    Bvh *world = NULL;
+    Bvh *instanced = NULL; // tree shared by the instances of world, if any
     Point3 world_center = {0.0, 0.0, 0.0};
+
+    // Animated testcases move these every frame and update the tree to match. The moving
+    // spheres get a tree of their own, instanced, with the static ones around it in world:
+    // next to the ground sphere their decay would barely change the cost of a shared tree.
+    bool animated = false;
+    Sphere rest_spheres[NUM_SPHERES] = {0};
+    Sphere moved_spheres[NUM_SPHERES] = {0};
+    int num_moved_spheres = 0;
+    Sphere static_spheres[NUM_SPHERES] = {0};
+    Instance moving_instance = {0};
+    BvhPrimitives animated_scene = {0};
     if (strcmp("spheres", argv[1]) == 0) {
         printf("Running spheres testcase.\n");
         Sphere sphere_list[NUM_SPHERES] = {0};
-        create_random_spheres_arr(sphere_list);
-        world = build_bvh(sphere_list, 4);
+        int num_spheres = create_random_spheres_arr(sphere_list);
+        world = build_bvh(sphere_list, num_spheres, MAX_LEAF_SIZE);
+        collapse_bvh_wide(world);
+    } else if (strcmp("bouncing", argv[1]) == 0) {
+        printf("Running bouncing spheres testcase.\n");
+        Sphere sphere_list[NUM_SPHERES] = {0};
+        int num_spheres = create_random_spheres_arr(sphere_list);
+        int num_static_spheres = 0;
+        for (int i = 0; i < num_spheres; i++) {
+            if (sphere_list[i].radius < 0.5) {
+                rest_spheres[num_moved_spheres++] = sphere_list[i];
+            } else {
+                static_spheres[num_static_spheres++] = sphere_list[i];
+            }
+        }
+        bounce_spheres(rest_spheres, moved_spheres, num_moved_spheres, 0);
+        instanced = build_bvh(moved_spheres, num_moved_spheres, MAX_LEAF_SIZE);
+        collapse_bvh_wide(instanced);
+
+        moving_instance = (Instance) {.bvh = instanced, .object_to_world = identity_transform()};
+        animated_scene = (BvhPrimitives) {
+            .spheres = static_spheres, .sphere_count = num_static_spheres,
+            .instances = &moving_instance, .instance_count = 1
+        };
+        BvhBuildConfig config = default_bvh_build_config();
+        config.max_leaf_size = MAX_LEAF_SIZE;
+        world = build_bvh_primitives(animated_scene, config);
+        collapse_bvh_wide(world);
+        animated = true;
     } else if (strcmp("mesh", argv[1]) == 0) {
 
         TinyObjData data = {0};
@@ -65,24 +107,77 @@ int main(int argc, char *argv[]) {
 
         Triangle triangles[NUM_TRIANGLES] = {0};
         TriangleMesh mesh = {.triangles=triangles, .size=NUM_TRIANGLES};
-        Material mat = {.type=LAMBERTIAN, .albedo=(Color) {0.5, 0.5, 0.5}};
-        convert_obj_data_to_mesh(&data, &mesh, &mat);
-        world = build_bvh_tri(triangles, n_tris);
-        world_center = center_aabb(&world->bbox);
+        int mat_id = add_material((Material) {.type=LAMBERTIAN, .albedo=(Color) {0.5, 0.5, 0.5}});
+        convert_obj_data_to_mesh(&data, &mesh, mat_id);
+        world = build_bvh_tri(triangles, n_tris, MAX_LEAF_SIZE);
+        collapse_bvh_wide(world);
+        world_center = center_aabb(&world->nodes[0].bbox);
+    } else if (strcmp("mixed", argv[1]) == 0) {
+        printf("Running mixed testcase.\n");
+        TinyObjData data = {0};
+        int ret = get_obj_data_from_file("assets/cube.obj", &data);
+        if (ret == EXIT_FAILURE) {
+            return EXIT_FAILURE;
+        }
+
+        int n_tris = data.attrib.num_faces / 3;
+        Triangle triangles[NUM_TRIANGLES] = {0};
+        TriangleMesh mesh = {.triangles=triangles, .size=NUM_TRIANGLES};
+        int mat_id = add_material((Material) {.type=METAL, .albedo=(Color) {0.8, 0.6, 0.2}, .fuzz=0.1});
+        convert_obj_data_to_mesh(&data, &mesh, mat_id);
+        world = create_mixed_world(triangles, n_tris);
+        world_center = (Point3) {0, 1, 0};
+    } else if (strcmp("forest", argv[1]) == 0) {
+        printf("Running forest testcase.\n");
+        TinyObjData data = {0};
+        int ret = get_obj_data_from_file("assets/low_poly_tree/Lowpoly_tree_sample.obj", &data);
+        if (ret == EXIT_FAILURE) {
+            return EXIT_FAILURE;
+        }
+
+        int n_tris = data.attrib.num_faces / 3;
+        Triangle triangles[NUM_TRIANGLES] = {0};
+        TriangleMesh mesh = {.triangles=triangles, .size=NUM_TRIANGLES};
+        int mat_id = add_material((Material) {.type=LAMBERTIAN, .albedo=(Color) {0.2, 0.5, 0.1}});
+        convert_obj_data_to_mesh(&data, &mesh, mat_id);
+
+        // One tree for the mesh, stood on its base, shared by every copy in the scene
+        AABB bbox = create_empty_aabb();
+        for (int i = 0; i < n_tris; i++) {
+            AABB tri_box = create_aabb_for_triangle(&triangles[i]);
+            bbox = create_aabb_for_aabb(&bbox, &tri_box);
+        }
+        Vec3 to_base = {-(bbox.x.min + bbox.x.max) / 2, -bbox.y.min, -(bbox.z.min + bbox.z.max) / 2};
+        Transform to_base_transform = translate_transform(to_base);
+        Transform unit_height = scale_transform(1.0 / size_interval(bbox.y));
+        Transform normalize = compose_transform(&unit_height, &to_base_transform);
+        for (int i = 0; i < n_tris; i++) {
+            triangles[i].v1 = transform_point(&normalize, triangles[i].v1);
+            triangles[i].v2 = transform_point(&normalize, triangles[i].v2);
+            triangles[i].v3 = transform_point(&normalize, triangles[i].v3);
+        }
+        instanced = build_bvh_tri(triangles, n_tris, MAX_LEAF_SIZE);
+        collapse_bvh_wide(instanced);
+
+        world = create_forest_world(instanced);
+        printf("%d trees of %d triangles, %zu bytes of bvh\n", NUM_FOREST_TREES, n_tris,
+                bvh_memory_usage(world) + bvh_memory_usage(instanced));
     } else if (strcmp("quads", argv[1]) == 0) {
         printf("Running quads testcase.\n");
+        Quad quad_list[5] = {0};
         Material left_red     = {.type=LAMBERTIAN, .albedo= (Color) {1.0, 0.2, 0.2}};
         Material back_green   = {.type=LAMBERTIAN, .albedo= (Color) {0.2, 1.0, 0.2}};
         Material right_blue   = {.type=LAMBERTIAN, .albedo= (Color) {0.2, 0.2, 1.0}};
         Material upper_orange = {.type=LAMBERTIAN, .albedo= (Color) {1.0, 0.5, 0.0}};
         Material lower_teal   = {.type=LAMBERTIAN, .albedo= (Color) {0.2, 0.8, 0.8}};
 
-        quad_list[0] = create_quad((Point3) {-3,-2, 5}, (Vec3) {0, 0,-4}, (Vec3) {0, 4, 0}, left_red);
-        quad_list[1] = create_quad((Point3) {-2,-2, 0}, (Vec3) {4, 0, 0}, (Vec3) {0, 4, 0}, back_green);
-        quad_list[2] = create_quad((Point3) { 3,-2, 1}, (Vec3) {0, 0, 4}, (Vec3) {0, 4, 0}, right_blue);
-        quad_list[3] = create_quad((Point3) {-2, 3, 1}, (Vec3) {4, 0, 0}, (Vec3) {0, 0, 4}, upper_orange);
-        quad_list[4] = create_quad((Point3) {-2,-3, 5}, (Vec3) {4, 0, 0}, (Vec3) {0, 0,-4}, lower_teal);
-
+        quad_list[0] = create_quad((Point3) {-3,-2, 5}, (Vec3) {0, 0,-4}, (Vec3) {0, 4, 0}, add_material(left_red));
+        quad_list[1] = create_quad((Point3) {-2,-2, 0}, (Vec3) {4, 0, 0}, (Vec3) {0, 4, 0}, add_material(back_green));
+        quad_list[2] = create_quad((Point3) { 3,-2, 1}, (Vec3) {0, 0, 4}, (Vec3) {0, 4, 0}, add_material(right_blue));
+        quad_list[3] = create_quad((Point3) {-2, 3, 1}, (Vec3) {4, 0, 0}, (Vec3) {0, 0, 4}, add_material(upper_orange));
+        quad_list[4] = create_quad((Point3) {-2,-3, 5}, (Vec3) {4, 0, 0}, (Vec3) {0, 0,-4}, add_material(lower_teal));
+        world = build_bvh_quad(quad_list, 5, MAX_LEAF_SIZE);
+        collapse_bvh_wide(world);
     } else {
         printf("Improper testcase provided, exiting.\n");
         return EXIT_FAILURE;
@@ -95,15 +190,10 @@ int main(int argc, char *argv[]) {
 
     if (strcmp("quads", argv[1]) == 0) {
         printf("Modifying camera position for quads. \n");
-        camera.aspect_ratio = 1.0;
-        camera.image_width = 400;
-        camera.samples_per_pixel = 100;
-        camera.max_depth = 50;
-        camera.vfov = 80;
-        camera.lookfrom = (Point3) {0, 0, 9};
-        camera.lookat = (Point3) {0, 0, 0};
-        camera.vup = (Vec3) {0, 1, 0};
-        camera.defocus_angle = 0;
+        // Same sampling as the other previews, the viewpoint has to be rebuilt to take effect
+        camera = create_camera(400, 1.0, camera.samples_per_pixel, camera.max_depth, 80,
+                (Point3) {0, 0, 9}, (Point3) {0, 0, 0}, (Vec3) {0, 1, 0}, 0, 10.0);
+        camera.ray_packets = true;
     }
 
     // Setup SDL objects
@@ -111,13 +201,17 @@ int main(int argc, char *argv[]) {
     SDL_Window * window = SDL_CreateWindow("Raytracer", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED, camera.image_width, camera.image_height, 0);
     SDL_Surface * surface = SDL_GetWindowSurface(window);
 
-    //double overlap = calculate_total_overlap(world);
-    //printf("num nodes in bvh: %d, overlap: %f\n", count_bvh(world), overlap);
+    double overlap = calculate_total_overlap(world);
+    printf("num nodes in bvh: %d, overlap: %f, sah cost: %f\n", count_bvh(world), overlap, calculate_sah_cost(world));
+
+    int num_threads = default_num_threads();
+    printf("Rendering with %d threads.\n", num_threads);
 
     // Run until user quits
     int quit = 0;
     int num_intersects = 0;
     SDL_Event event;
+    int frame = 0;
     while (!quit) {
         while (SDL_PollEvent(&event)) {
             num_intersects = 0;
@@ -152,19 +246,25 @@ int main(int argc, char *argv[]) {
                     break;
             }
         }
-        clock_t tik = clock();
-        if (strcmp("quads", argv[1]) == 0) {
-            render_quads(&camera, 5, quad_list, surface, &num_intersects);
-        } else{
-            render_bvh(&camera, world, surface, &num_intersects);
+        // Wall clock, clock() would sum the cpu time of every render thread
+        struct timespec tik, tok;
+        clock_gettime(CLOCK_MONOTONIC, &tik);
+        if (animated) {
+            bounce_spheres(rest_spheres, moved_spheres, num_moved_spheres, ++frame);
+            BvhPrimitives moving = {.spheres = moved_spheres, .sphere_count = num_moved_spheres};
+            instanced = update_bvh(instanced, moving, BVH_DEFAULT_SAH_GROWTH);
+            moving_instance.bvh = instanced;
+            refit_bvh(world, animated_scene);
         }
+        render_bvh_parallel(&camera, world, surface, &num_intersects, num_threads);
         SDL_UpdateWindowSurface(window);
-        clock_t tok = clock();
+        clock_gettime(CLOCK_MONOTONIC, &tok);
+        camera.seed++;
 
         int num_rays = camera.image_height * camera.image_width * camera.samples_per_pixel;
         double int_per_ray = (double) num_intersects / num_rays;
-        double ms = 1000.0 * ((double) (tok - tik) / CLOCKS_PER_SEC);
-        double fps = CLOCKS_PER_SEC / (double) (tok - tik); 
+        double ms = 1000.0 * (double) (tok.tv_sec - tik.tv_sec) + (double) (tok.tv_nsec - tik.tv_nsec) / 1e6;
+        double fps = 1000.0 / ms;
         char c[256];
         sprintf(c, "Frame: [%d rays, %.2f tests/ray, %.2f ms, %.2f fps]", num_rays, int_per_ray, ms, fps);
         SDL_SetWindowTitle(window, c);
@@ -173,119 +273,148 @@ int main(int argc, char *argv[]) {
 
     // Cleanup 
     free_bvh(world);
+    free_bvh(instanced);
     SDL_FreeSurface(surface);
     SDL_DestroyWindow(window);
     SDL_Quit();
     return EXIT_SUCCESS;
 }
 
-void create_random_spheres_arr(Sphere *sphere_list) {
-    int num_spheres = 0;
-    Material ground_material = {
-        .type=LAMBERTIAN_TEXTURE, 
-        .texture=(CheckerTexture) {
-            .inv_scale = 0.32,
-            .even = {0.2, 0.3, 0.1},
-            .odd = {0.9, 0.9, 0.9}
-        }
-    };
-    sphere_list[0] = make_sphere((Point3) {0, -1000, 0}, 1000, ground_material);
-    num_spheres++;
-
-    Material mat1 = {.type=DIELECTRIC, .ir=1.5};
-    sphere_list[num_spheres] = make_sphere((Point3) {0, 1, 0}, 1.0, mat1);
-    num_spheres++;
-
-    Material mat2 = {.type=LAMBERTIAN, .albedo=(Color) {0.4, 0.2, 0.1}};
-    sphere_list[num_spheres] = make_sphere((Point3) {-4, 1, 0}, 1.0, mat2);
-    num_spheres++;
-
-    Material mat3 = {.type=METAL, .albedo=(Color) {0.7, 0.6, 0.5}, .fuzz=0.0};
-    sphere_list[num_spheres] = make_sphere((Point3) {4, 1, 0}, 1.0, mat3);
-    num_spheres++;
-
-    for (int a = -11; a < 11; a++) {
-        for (int b = -11; b < 11; b++) {
-            double choose_mat = random_double();
-            Point3 center = {a+ 0.9*random_double(), 0.2, b + 0.9*random_double()};
-
-            Vec3 vec = diff_vec3(center, (Point3) {4, 0.2, 0});
-            if (length(vec) > 0.9) {
-                if (choose_mat < 0.8) {
-                    // Diffuse
-                    Color albedo = random_vec();
-                    Material diffuse_mat = {.type=LAMBERTIAN, .albedo=albedo};
-                    sphere_list[num_spheres] = make_sphere(center, 0.2, diffuse_mat);
-                    num_spheres++;
-                } else if (choose_mat < 0.90) {
-                    // Metal
-                    Color albedo = random_vec_interval(0.5, 1);
-                    double fuzz = random_double_interval(0, 0.5);
-                    Material metal_mat = {.type=METAL, .albedo=albedo, .fuzz=fuzz};
-                    sphere_list[num_spheres] = make_sphere(center, 0.2, metal_mat);
-                    num_spheres++;
-                } else {
-                    // Glass
-                    Material glass_mat = {.type=DIELECTRIC, .ir=1.5};
-                    sphere_list[num_spheres] = make_sphere(center, 0.2, glass_mat);
-                    num_spheres++;
-                }
-            }
-        }
-    }
-}
-
-BvhNode* create_random_spheres(int max_spheres) {
+Bvh* create_random_spheres(int max_spheres) {
     // World
+    Rng rng = create_rng(11, 0);
     Sphere sphere_list[500];
 
     int num_spheres = 0;
     const Material ground_material = {.type=LAMBERTIAN, .albedo=(Color) {0.5, 0.5, 0.5}};
-    sphere_list[0] = make_sphere((Point3) {0, -1000, 0}, 1000, ground_material);
+    sphere_list[0] = make_sphere((Point3) {0, -1000, 0}, 1000, add_material(ground_material));
     num_spheres++;
 
     const Material mat1 = {.type=DIELECTRIC, .ir=1.5};
-    sphere_list[num_spheres] = make_sphere((Point3) {0, 1, 0}, 1.0, mat1);
+    sphere_list[num_spheres] = make_sphere((Point3) {0, 1, 0}, 1.0, add_material(mat1));
     num_spheres++;
 
     const Material mat2 = {.type=LAMBERTIAN, .albedo=(Color) {0.4, 0.2, 0.1}};
-    sphere_list[num_spheres] = make_sphere((Point3) {-4, 1, 0}, 1.0, mat2);
+    sphere_list[num_spheres] = make_sphere((Point3) {-4, 1, 0}, 1.0, add_material(mat2));
     num_spheres++;
 
     const Material mat3 = {.type=METAL, .albedo=(Color) {0.7, 0.6, 0.5}, .fuzz=0.0};
-    sphere_list[num_spheres] = make_sphere((Point3) {4, 1, 0}, 1.0, mat3);
+    sphere_list[num_spheres] = make_sphere((Point3) {4, 1, 0}, 1.0, add_material(mat3));
     num_spheres++;
 
     for (int a = -11; a < 11; a++) {
         for (int b = -11; b < 11; b++) {
-            double choose_mat = random_double();
-            Point3 center = {a+ 0.9*random_double(), 0.2, b + 0.9*random_double()};
+            double choose_mat = random_double(&rng);
+            Point3 center = {a+ 0.9*random_double(&rng), 0.2, b + 0.9*random_double(&rng)};
 
             Vec3 vec = diff_vec3(center, (Point3) {4, 0.2, 0});
             if (length(vec) > 0.9) {
                 if (choose_mat < 0.8) {
                     // Diffuse
-                    Color albedo = random_vec();
+                    Color albedo = random_vec(&rng);
                     Material diffuse_mat = {.type=LAMBERTIAN, .albedo=albedo};
-                    sphere_list[num_spheres] = make_sphere(center, 0.2, diffuse_mat);
+                    sphere_list[num_spheres] = make_sphere(center, 0.2, add_material(diffuse_mat));
                     num_spheres++;
                 } else if (choose_mat < 0.90) {
                     // Metal
-                    Color albedo = random_vec_interval(0.5, 1);
-                    double fuzz = random_double_interval(0, 0.5);
+                    Color albedo = random_vec_interval(&rng, 0.5, 1);
+                    double fuzz = random_double_interval(&rng, 0, 0.5);
                     Material metal_mat = {.type=METAL, .albedo=albedo, .fuzz=fuzz};
-                    sphere_list[num_spheres] = make_sphere(center, 0.2, metal_mat);
+                    sphere_list[num_spheres] = make_sphere(center, 0.2, add_material(metal_mat));
                     num_spheres++;
                 } else {
                     // Glass
                     Material glass_mat = {.type=DIELECTRIC, .ir=1.5};
-                    sphere_list[num_spheres] = make_sphere(center, 0.2, glass_mat);
+                    sphere_list[num_spheres] = make_sphere(center, 0.2, add_material(glass_mat));
                     num_spheres++;
                 }
             }
         }
     }
-    return build_bvh(sphere_list, max_spheres);
+    return build_bvh(sphere_list, num_spheres, max_spheres);
+}
+
+// The mesh, scaled to stand 2 units tall, on the checkered ground sphere between two
+// spheres, in front of a back wall. Everything goes into one tree.
+Bvh* create_mixed_world(Triangle triangles[], int num_triangles) {
+    AABB bbox = create_empty_aabb();
+    for (int i = 0; i < num_triangles; i++) {
+        AABB tri_box = create_aabb_for_triangle(&triangles[i]);
+        bbox = create_aabb_for_aabb(&bbox, &tri_box);
+    }
+    double scale = 2.0 / size_interval(bbox.y);
+    Point3 base = {(bbox.x.min + bbox.x.max) / 2, bbox.y.min, (bbox.z.min + bbox.z.max) / 2};
+    for (int i = 0; i < num_triangles; i++) {
+        triangles[i].v1 = scale_vec3(diff_vec3(triangles[i].v1, base), scale);
+        triangles[i].v2 = scale_vec3(diff_vec3(triangles[i].v2, base), scale);
+        triangles[i].v3 = scale_vec3(diff_vec3(triangles[i].v3, base), scale);
+    }
+
+    Material ground_material = {
+        .type=LAMBERTIAN_TEXTURE,
+        .texture=(CheckerTexture) {.inv_scale = 0.32, .even = {0.2, 0.3, 0.1}, .odd = {0.9, 0.9, 0.9}}
+    };
+    Sphere sphere_list[3];
+    sphere_list[0] = make_sphere((Point3) {0, -1000, 0}, 1000, add_material(ground_material));
+    sphere_list[1] = make_sphere((Point3) {0, 1, -2.5}, 1.0, add_material((Material) {.type=DIELECTRIC, .ir=1.5}));
+    sphere_list[2] = make_sphere((Point3) {0, 1, 2.5}, 1.0, add_material((Material) {.type=LAMBERTIAN, .albedo=(Color) {0.4, 0.2, 0.1}}));
+
+    Quad wall = create_quad((Point3) {-4, 0, 6}, (Vec3) {0, 0, -12}, (Vec3) {0, 5, 0},
+            add_material((Material) {.type=LAMBERTIAN, .albedo=(Color) {0.2, 0.4, 0.8}}));
+
+    BvhPrimitives scene = {
+        .spheres = sphere_list, .sphere_count = 3,
+        .triangles = triangles, .triangle_count = num_triangles,
+        .quads = &wall, .quad_count = 1
+    };
+    BvhBuildConfig config = default_bvh_build_config();
+    config.max_leaf_size = MAX_LEAF_SIZE;
+    Bvh *world = build_bvh_primitives(scene, config);
+    collapse_bvh_wide(world);
+    return world;
+}
+
+// The spheres hop up and down while circling their rest position, each with its own
+// phase and one of three speeds, so neighbours drift apart and the tree needs rebuilds
+void bounce_spheres(const Sphere rest[], Sphere moved[], int num_spheres, int frame) {
+    for (int i = 0; i < num_spheres; i++) {
+        double angle = 0.02 * frame * (1 + i % 3);
+        moved[i] = rest[i];
+        moved[i].center.x += 2 * (cos(angle + i) - cos(i));
+        moved[i].center.z += 2 * (sin(angle + i) - sin(i));
+        moved[i].center.y += 1.5 * fabs(sin(0.15 * frame + i));
+    }
+}
+
+// Copies of tree, randomly turned and sized, scattered over the checkered ground sphere.
+// The top-level tree holds the ground and one instance per copy.
+Bvh* create_forest_world(const Bvh *tree) {
+    Rng rng = create_rng(19, 0);
+    Instance instances[NUM_FOREST_TREES];
+    for (int i = 0; i < NUM_FOREST_TREES; i++) {
+        Point3 position = {random_double_interval(&rng, -20, 20), 0, random_double_interval(&rng, -20, 20)};
+        Transform place = translate_transform(position);
+        Transform turn = rotate_y_transform(random_double_interval(&rng, 0, 360));
+        Transform size = scale_transform(random_double_interval(&rng, 0.6, 1.4));
+        Transform turn_and_size = compose_transform(&turn, &size);
+        instances[i] = (Instance) {.bvh = tree, .object_to_world = compose_transform(&place, &turn_and_size)};
+    }
+
+    Material ground_material = {
+        .type=LAMBERTIAN_TEXTURE,
+        .texture=(CheckerTexture) {.inv_scale = 0.32, .even = {0.2, 0.3, 0.1}, .odd = {0.9, 0.9, 0.9}}
+    };
+    Sphere ground = make_sphere((Point3) {0, -1000, 0}, 1000, add_material(ground_material));
+
+    BvhPrimitives scene = {
+        .spheres = &ground, .sphere_count = 1,
+        .instances = instances, .instance_count = NUM_FOREST_TREES
+    };
+    BvhBuildConfig config = default_bvh_build_config();
+    config.max_leaf_size = MAX_LEAF_SIZE;
+    Bvh *world = build_bvh_primitives(scene, config);
+    collapse_bvh_wide(world);
+    return world;
 }
 
 void update_camera(Vec3 lookat_delta, Camera *camera) {
@@ -312,14 +441,17 @@ void update_camera(Vec3 lookat_delta, Camera *camera) {
             defocus_angle,
             focus_dist
     );
+
+    // The preview is dominated by primary rays at this depth
+    camera->ray_packets = true;
 }
 
 Sphere* create_three_spheres_world_arr(Sphere sphere_list[]) {
     // World
-    Material ground = {.type=LAMBERTIAN, .albedo=(Color) {0.8, 0.8, 0.0}};
-    Material mat_center = {.type=LAMBERTIAN, .albedo=(Color) {0.1, 0.2, 0.5}};
-    Material mat_left = {.type=DIELECTRIC, .ir=1.5};
-    Material mat_right = {.type=METAL, .albedo=(Color) {0.8, 0.6, 0.2}, .fuzz=0.0};
+    int ground = add_material((Material) {.type=LAMBERTIAN, .albedo=(Color) {0.8, 0.8, 0.0}});
+    int mat_center = add_material((Material) {.type=LAMBERTIAN, .albedo=(Color) {0.1, 0.2, 0.5}});
+    int mat_left = add_material((Material) {.type=DIELECTRIC, .ir=1.5});
+    int mat_right = add_material((Material) {.type=METAL, .albedo=(Color) {0.8, 0.6, 0.2}, .fuzz=0.0});
 
     sphere_list[0] = make_sphere((Point3) { 0.0, -100.5, -1.0}, 100.0, ground);
     sphere_list[1] = make_sphere((Point3) { 0.0,    0.0, -1.0},   0.5, mat_center);
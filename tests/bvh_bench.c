@@ -0,0 +1,526 @@
+#include <stdio.h>
+#include <time.h>
+
+#include "bvh.h"
+#include "camera.h"
+#include "packet.h"
+#include "scene.h"
+
+/*
+ * BVH benchmarks. Traces the primary rays of a small frame through trees built
+ * by each builder and reports the average number of tests (node visits plus
+ * primitive tests, same number main shows in the window title) per ray.
+ * The rows marked "s" and "o" trace shadow rays from every primary hit to a
+ * point light instead, with the closest-hit and occlusion queries.
+ * The forest scenes compare copies of the mesh baked into one tree against
+ * instances of a single shared tree. The animated scene moves the spheres every
+ * frame and compares rebuilding the tree with refitting it. The rafters scene has
+ * long, thin, slanted triangles over small ones, the case the "sbvh" rows with
+ * spatial splits are for.
+ * The rows marked "w" trace wide nodes and "c" the quantized ones. The second KB
+ * column is the part of the tree traversal reads, the nodes of that form. The rows
+ * marked "p" trace the primary rays in packets, as the preview in main does.
+ * `make bench-float` builds the same benchmark in single precision.
+ */
+
+#define BENCH_WIDTH 320
+#define BENCH_MESH_RINGS 40
+#define BENCH_MESH_SEGMENTS 80
+#define BENCH_WALL_SIZE 48
+#define BENCH_FOREST_SIZE 8
+#define BENCH_CRATES 16
+#define BENCH_RAFTERS 16
+#define BENCH_FRAMES 30
+
+double elapsed_ms(struct timespec start, struct timespec end) {
+    return 1000.0 * (double) (end.tv_sec - start.tv_sec) + (double) (end.tv_nsec - start.tv_nsec) / 1e6;
+}
+
+// Bumpy tessellated sphere, shuffled like the face order of a real OBJ file
+int create_bench_mesh(Triangle *triangles, Rng *rng) {
+    int mat_id = add_material((Material) {.type=LAMBERTIAN, .albedo=(Color) {0.5, 0.5, 0.5}});
+    int n = 0;
+    for (int r = 0; r < BENCH_MESH_RINGS; r++) {
+        for (int s = 0; s < BENCH_MESH_SEGMENTS; s++) {
+            Point3 p[4];
+            for (int k = 0; k < 4; k++) {
+                double theta = pi * (r + (k >> 1)) / BENCH_MESH_RINGS;
+                double phi = 2 * pi * (s + (k & 1)) / BENCH_MESH_SEGMENTS;
+                double radius = 1.0 + 0.15 * sin(5 * theta) * cos(7 * phi);
+                p[k] = (Point3) {radius * sin(theta) * cos(phi), radius * cos(theta), radius * sin(theta) * sin(phi)};
+            }
+            triangles[n++] = (Triangle) {.v1 = p[0], .v2 = p[2], .v3 = p[1], .mat_id = mat_id};
+            triangles[n++] = (Triangle) {.v1 = p[1], .v2 = p[2], .v3 = p[3], .mat_id = mat_id};
+        }
+    }
+
+    for (int i = n - 1; i > 0; i--) {
+        int j = (int) (rng_next(rng) % (uint32_t) (i + 1));
+        Triangle tmp = triangles[i];
+        triangles[i] = triangles[j];
+        triangles[j] = tmp;
+    }
+
+    return n;
+}
+
+// Wall of tiles, each tilted a little so the boxes are not all flat in z
+int create_bench_wall(Quad *quads, Rng *rng) {
+    int mat_id = add_material((Material) {.type=LAMBERTIAN, .albedo=(Color) {0.7, 0.7, 0.7}});
+    int n = 0;
+    for (int y = 0; y < BENCH_WALL_SIZE; y++) {
+        for (int x = 0; x < BENCH_WALL_SIZE; x++) {
+            Point3 corner = {x - BENCH_WALL_SIZE / 2.0, y - BENCH_WALL_SIZE / 2.0, 0.2 * random_double(rng)};
+            Vec3 dir1 = {0.9, 0, 0.2 * random_double(rng) - 0.1};
+            Vec3 dir2 = {0, 0.9, 0.2 * random_double(rng) - 0.1};
+            quads[n++] = create_quad(corner, dir1, dir2, mat_id);
+        }
+    }
+    return n;
+}
+
+// Closed box from 12 triangles
+int create_bench_box(Triangle *triangles, Point3 lo, Point3 hi, int mat_id) {
+    Point3 c[8];
+    for (int k = 0; k < 8; k++) {
+        c[k] = (Point3) {(k & 1) ? hi.x : lo.x, (k & 2) ? hi.y : lo.y, (k & 4) ? hi.z : lo.z};
+    }
+    const int faces[6][4] = {{0, 1, 3, 2}, {4, 5, 7, 6}, {0, 1, 5, 4}, {2, 3, 7, 6}, {0, 2, 6, 4}, {1, 3, 7, 5}};
+    int n = 0;
+    for (int f = 0; f < 6; f++) {
+        triangles[n++] = (Triangle) {.v1 = c[faces[f][0]], .v2 = c[faces[f][1]], .v3 = c[faces[f][2]], .mat_id = mat_id};
+        triangles[n++] = (Triangle) {.v1 = c[faces[f][0]], .v2 = c[faces[f][2]], .v3 = c[faces[f][3]], .mat_id = mat_id};
+    }
+    return n;
+}
+
+// Grid of crates under rafters: long, thin beams slanting across the whole scene, two
+// triangles each. Object splits leave every beam's box spanning half the crates.
+int create_bench_rafters(Triangle *triangles, Rng *rng) {
+    int mat_id = add_material((Material) {.type=LAMBERTIAN, .albedo=(Color) {0.6, 0.5, 0.4}});
+    int n = 0;
+    for (int z = 0; z < BENCH_CRATES; z++) {
+        for (int x = 0; x < BENCH_CRATES; x++) {
+            Point3 lo = {2.0 * x - BENCH_CRATES, 0, 2.0 * z - BENCH_CRATES};
+            Point3 hi = {lo.x + 0.8, 0.5 + 2 * random_double(rng), lo.z + 0.8};
+            n += create_bench_box(triangles + n, lo, hi, mat_id);
+        }
+    }
+
+    Vec3 width = {0, 0.05, 0.6};
+    for (int i = 0; i < BENCH_RAFTERS; i++) {
+        Point3 a = {-BENCH_CRATES, 3 * random_double(rng), 2 * BENCH_CRATES * random_double(rng) - BENCH_CRATES};
+        Point3 b = {BENCH_CRATES, 3 * random_double(rng), 2 * BENCH_CRATES * random_double(rng) - BENCH_CRATES};
+        triangles[n++] = (Triangle) {.v1 = a, .v2 = b, .v3 = add_vec3(b, width), .mat_id = mat_id};
+        triangles[n++] = (Triangle) {.v1 = a, .v2 = add_vec3(b, width), .v3 = add_vec3(a, width), .mat_id = mat_id};
+    }
+    return n;
+}
+
+// One primary ray per pixel
+int trace_bench_primary(Bvh *bvh, Camera *camera, int *num_intersects) {
+    int num_rays = 0;
+    for (int j = 0; j < camera->image_height; j++) {
+        for (int i = 0; i < camera->image_width; i++) {
+            Rng rng = create_sample_rng(camera->seed, i, j, 0);
+            Ray r = get_ray(i, j, camera, &rng);
+            HitRecord rec = {0};
+            ray_intersect_bvh(bvh, &r, (Interval) {0.001, INFINITY}, &rec, num_intersects);
+            num_rays++;
+        }
+    }
+    return num_rays;
+}
+
+// Primary rays in 4x2 (RAY_PACKET_WIDTH x RAY_PACKET_HEIGHT) packets
+int trace_bench_packets(Bvh *bvh, Camera *camera, int *num_intersects) {
+    int num_rays = 0;
+    for (int j = 0; j < camera->image_height; j += RAY_PACKET_HEIGHT) {
+        for (int i = 0; i < camera->image_width; i += RAY_PACKET_WIDTH) {
+            RayPacket packet;
+            init_ray_packet(&packet);
+            for (int lane = 0; lane < RAY_PACKET_SIZE; lane++) {
+                int x = i + lane % RAY_PACKET_WIDTH;
+                int y = j + lane / RAY_PACKET_WIDTH;
+                if (x >= camera->image_width || y >= camera->image_height) continue;
+
+                Rng rng = create_sample_rng(camera->seed, x, y, 0);
+                Ray r = get_ray(x, y, camera, &rng);
+                set_packet_ray(&packet, lane, &r, INFINITY);
+                num_rays++;
+            }
+            ray_intersect_bvh_packet(bvh, &packet, 0.001, num_intersects);
+        }
+    }
+    return num_rays;
+}
+
+typedef enum BenchQuery {
+    BENCH_CLOSEST,
+    BENCH_PACKETS,          // closest hit, tests/ray then counts one test per packet
+    BENCH_SHADOW_CLOSEST,
+    BENCH_SHADOW_OCCLUSION
+} BenchQuery;
+
+// Rays from every primary hit to the light, which sits at t = 1
+int make_bench_shadow_rays(Bvh *bvh, Camera *camera, Point3 light, Ray *rays) {
+    int num_rays = 0;
+    int num_intersects = 0;
+    for (int j = 0; j < camera->image_height; j++) {
+        for (int i = 0; i < camera->image_width; i++) {
+            Rng rng = create_sample_rng(camera->seed, i, j, 0);
+            Ray r = get_ray(i, j, camera, &rng);
+            HitRecord rec = {0};
+            if (ray_intersect_bvh(bvh, &r, (Interval) {0.001, INFINITY}, &rec, &num_intersects)) {
+                rays[num_rays++] = create_ray(rec.p, diff_vec3(light, rec.p));
+            }
+        }
+    }
+    return num_rays;
+}
+
+// shared_bytes counts trees the bvh instances, which bvh_memory_usage leaves out
+void run_bvh_bench(const char *name, Bvh *bvh, size_t shared_bytes, Camera *camera, Point3 light, double build_ms, BenchQuery query) {
+    int num_intersects = 0;
+    int num_rays = 0;
+
+    Ray *shadow_rays = NULL;
+    int num_shadow_rays = 0;
+    if (query == BENCH_SHADOW_CLOSEST || query == BENCH_SHADOW_OCCLUSION) {
+        shadow_rays = malloc(sizeof(Ray) * camera->image_width * camera->image_height);
+        num_shadow_rays = make_bench_shadow_rays(bvh, camera, light, shadow_rays);
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (query == BENCH_PACKETS) {
+        num_rays = trace_bench_packets(bvh, camera, &num_intersects);
+    } else if (query == BENCH_SHADOW_CLOSEST) {
+        for (num_rays = 0; num_rays < num_shadow_rays; num_rays++) {
+            HitRecord rec = {0};
+            ray_intersect_bvh(bvh, &shadow_rays[num_rays], (Interval) {0.001, 1.0}, &rec, &num_intersects);
+        }
+    } else if (query == BENCH_SHADOW_OCCLUSION) {
+        for (num_rays = 0; num_rays < num_shadow_rays; num_rays++) {
+            ray_occluded_bvh(bvh, &shadow_rays[num_rays], (Interval) {0.001, 1.0}, &num_intersects);
+        }
+    } else {
+        num_rays = trace_bench_primary(bvh, camera, &num_intersects);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double ms = elapsed_ms(start, end);
+    printf("  %-8s build %8.2f ms | %6d nodes | %7.1f KB | %7.1f KB | sah cost %7.2f | overlap %10.3f | %7.2f tests/ray | %6.2f Mrays/s\n",
+            name, build_ms, count_bvh(bvh), (double) (bvh_memory_usage(bvh) + shared_bytes) / 1024.0, (double) bvh_traversal_node_bytes(bvh) / 1024.0,
+            calculate_sah_cost(bvh), calculate_total_overlap(bvh),
+            (double) num_intersects / num_rays, num_rays / (ms * 1000.0));
+    free(shadow_rays);
+}
+
+// Build with every split method and leaf size in the table below
+typedef struct BenchBuild {
+    const char *name;
+    BvhSplitMethod split_method;
+    int max_leaf_size;
+    bool wide;
+    BenchQuery query;
+    bool compressed;
+} BenchBuild;
+
+const BenchBuild bench_builds[] = {
+    {"median", BVH_SPLIT_MEDIAN, 1},
+    {"median4", BVH_SPLIT_MEDIAN, 4},
+    {"sah", BVH_SPLIT_SAH, 1},
+    {"sah2", BVH_SPLIT_SAH, 2},
+    {"sah4", BVH_SPLIT_SAH, 4},
+    {"sah8", BVH_SPLIT_SAH, 8},
+    {"sah4w", BVH_SPLIT_SAH, 4, true},
+    {"sah4c", BVH_SPLIT_SAH, 4, true, BENCH_CLOSEST, true},
+    {"sah4p", BVH_SPLIT_SAH, 4, false, BENCH_PACKETS},
+    {"sah4wp", BVH_SPLIT_SAH, 4, true, BENCH_PACKETS},
+    {"sah4cp", BVH_SPLIT_SAH, 4, true, BENCH_PACKETS, true},
+    {"sah4s", BVH_SPLIT_SAH, 4, false, BENCH_SHADOW_CLOSEST},
+    {"sah4o", BVH_SPLIT_SAH, 4, false, BENCH_SHADOW_OCCLUSION},
+    {"sah4ws", BVH_SPLIT_SAH, 4, true, BENCH_SHADOW_CLOSEST},
+    {"sah4wo", BVH_SPLIT_SAH, 4, true, BENCH_SHADOW_OCCLUSION},
+    {"sah4co", BVH_SPLIT_SAH, 4, true, BENCH_SHADOW_OCCLUSION, true},
+    {"sbvh4", BVH_SPLIT_SPATIAL, 4},
+    {"sbvh4w", BVH_SPLIT_SPATIAL, 4, true},
+};
+const int num_bench_builds = sizeof(bench_builds) / sizeof(bench_builds[0]);
+
+// Wide or quantized wide nodes, if the build asks for them
+void bench_collapse(const BenchBuild *build, Bvh *bvh) {
+    if (build->compressed) {
+        compress_bvh_wide(bvh);
+    } else if (build->wide) {
+        collapse_bvh_wide(bvh);
+    }
+}
+
+BvhBuildConfig bench_config(const BenchBuild *build) {
+    BvhBuildConfig config = default_bvh_build_config();
+    config.split_method = build->split_method;
+    config.max_leaf_size = build->max_leaf_size;
+    return config;
+}
+
+void bench_spheres(const BenchBuild *build, Sphere spheres[], int length, Camera *camera, Point3 light) {
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    Bvh *bvh = build_bvh_spheres(spheres, length, bench_config(build));
+    bench_collapse(build, bvh);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    run_bvh_bench(build->name, bvh, 0, camera, light, elapsed_ms(start, end), build->query);
+    free_bvh(bvh);
+}
+
+void bench_triangles(const BenchBuild *build, Triangle triangles[], int length, Camera *camera, Point3 light) {
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    Bvh *bvh = build_bvh_triangles(triangles, length, bench_config(build));
+    bench_collapse(build, bvh);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    run_bvh_bench(build->name, bvh, 0, camera, light, elapsed_ms(start, end), build->query);
+    free_bvh(bvh);
+}
+
+void bench_quads(const BenchBuild *build, Quad quads[], int length, Camera *camera, Point3 light) {
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    Bvh *bvh = build_bvh_quads(quads, length, bench_config(build));
+    bench_collapse(build, bvh);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    run_bvh_bench(build->name, bvh, 0, camera, light, elapsed_ms(start, end), build->query);
+    free_bvh(bvh);
+}
+
+// Every sphere for every ray, no tree. With blocks the search goes through the block kernel.
+void bench_sphere_array(const char *name, const Sphere spheres[], const SphereBlock *blocks, int length, Camera *camera) {
+    int num_intersects = 0;
+    int num_rays = 0;
+    int num_hits = 0; // printed, so the compiler can't drop the search
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int j = 0; j < camera->image_height; j++) {
+        for (int i = 0; i < camera->image_width; i++) {
+            Rng rng = create_sample_rng(camera->seed, i, j, 0);
+            Ray r = get_ray(i, j, camera, &rng);
+            HitRecord rec = {0};
+            Interval ray_t = {0.001, INFINITY};
+            if (blocks) {
+                num_hits += ray_intersect_sphere_blocks(&r, length, blocks, spheres, &ray_t, &rec, &num_intersects);
+            } else {
+                num_hits += ray_intersect_sphere_arr(&r, length, spheres, &ray_t, &rec, &num_intersects);
+            }
+            num_rays++;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double ms = elapsed_ms(start, end);
+    printf("  %-8s %7.2f tests/ray | %6.2f Mrays/s | %d hits\n", name, (double) num_intersects / num_rays, num_rays / (ms * 1000.0), num_hits);
+}
+
+// Grid of turned and resized copies of the mesh
+void create_bench_forest(Transform transforms[], Rng *rng) {
+    for (int z = 0; z < BENCH_FOREST_SIZE; z++) {
+        for (int x = 0; x < BENCH_FOREST_SIZE; x++) {
+            Transform place = translate_transform((Vec3) {3.0 * (x - BENCH_FOREST_SIZE / 2), 0, 3.0 * (z - BENCH_FOREST_SIZE / 2)});
+            Transform turn = rotate_y_transform(360 * random_double(rng));
+            Transform size = scale_transform(random_double_interval(rng, 0.7, 1.3));
+            Transform turn_and_size = compose_transform(&turn, &size);
+            transforms[z * BENCH_FOREST_SIZE + x] = compose_transform(&place, &turn_and_size);
+        }
+    }
+}
+
+// Every copy's triangles in one tree
+void bench_forest_flat(const BenchBuild *build, const Triangle triangles[], int length, const Transform transforms[], int copies, Camera *camera, Point3 light) {
+    Triangle *flat = malloc(sizeof(Triangle) * length * copies);
+    for (int c = 0; c < copies; c++) {
+        for (int i = 0; i < length; i++) {
+            Triangle t = triangles[i];
+            t.v1 = transform_point(&transforms[c], t.v1);
+            t.v2 = transform_point(&transforms[c], t.v2);
+            t.v3 = transform_point(&transforms[c], t.v3);
+            flat[c * length + i] = t;
+        }
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    Bvh *bvh = build_bvh_triangles(flat, length * copies, bench_config(build));
+    bench_collapse(build, bvh);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    run_bvh_bench(build->name, bvh, 0, camera, light, elapsed_ms(start, end), build->query);
+    free_bvh(bvh);
+    free(flat);
+}
+
+// One tree for the mesh, and a top-level tree over instances of it
+void bench_forest_instanced(const BenchBuild *build, Triangle triangles[], int length, const Transform transforms[], int copies, Camera *camera, Point3 light) {
+    Instance *instances = malloc(sizeof(Instance) * copies);
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    Bvh *mesh = build_bvh_triangles(triangles, length, bench_config(build));
+    bench_collapse(build, mesh);
+    for (int c = 0; c < copies; c++) {
+        instances[c] = (Instance) {.bvh = mesh, .object_to_world = transforms[c]};
+    }
+    Bvh *bvh = build_bvh_instances(instances, copies, bench_config(build));
+    bench_collapse(build, bvh);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    run_bvh_bench(build->name, bvh, bvh_memory_usage(mesh), camera, light, elapsed_ms(start, end), build->query);
+    free_bvh(bvh);
+    free_bvh(mesh);
+    free(instances);
+}
+
+const BenchBuild forest_builds[] = {
+    {"sah4", BVH_SPLIT_SAH, 4},
+    {"sah4w", BVH_SPLIT_SAH, 4, true},
+    {"sah4c", BVH_SPLIT_SAH, 4, true, BENCH_CLOSEST, true},
+    {"sah4wo", BVH_SPLIT_SAH, 4, true, BENCH_SHADOW_OCCLUSION},
+    {"sah4co", BVH_SPLIT_SAH, 4, true, BENCH_SHADOW_OCCLUSION, true},
+    {"sbvh4", BVH_SPLIT_SPATIAL, 4},
+    {"sbvh4w", BVH_SPLIT_SPATIAL, 4, true},
+};
+const int num_forest_builds = sizeof(forest_builds) / sizeof(forest_builds[0]);
+
+typedef enum BenchUpdate {
+    BENCH_REBUILD,      // new tree every frame
+    BENCH_REFIT,        // refit the first tree every frame
+    BENCH_REFIT_REBUILD // refit, rebuild once the SAH cost grew past BVH_DEFAULT_SAH_GROWTH
+} BenchUpdate;
+
+// Spheres drift along velocity, one step per frame. Times the tree update and the
+// primary rays of every frame.
+void bench_animation(const char *name, BenchUpdate update, const Sphere rest[], const Vec3 velocity[], int length, Camera *camera) {
+    Sphere *moved = malloc(sizeof(Sphere) * length);
+    memcpy(moved, rest, sizeof(Sphere) * length);
+    BvhPrimitives scene = {.spheres = moved, .sphere_count = length};
+    Bvh *bvh = build_bvh_primitives(scene, default_bvh_build_config());
+    collapse_bvh_wide(bvh);
+
+    double update_ms = 0, trace_ms = 0;
+    int num_intersects = 0, num_rays = 0, rebuilds = 0;
+    for (int frame = 1; frame <= BENCH_FRAMES; frame++) {
+        for (int i = 0; i < length; i++) {
+            moved[i].center = add_vec3(rest[i].center, scale_vec3(velocity[i], frame));
+        }
+
+        struct timespec start, mid, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        bool rebuild = update == BENCH_REBUILD;
+        if (update != BENCH_REBUILD) {
+            refit_bvh(bvh, scene);
+            rebuild = update == BENCH_REFIT_REBUILD && bvh_needs_rebuild(bvh, BVH_DEFAULT_SAH_GROWTH);
+        }
+        if (rebuild) {
+            free_bvh(bvh);
+            bvh = build_bvh_primitives(scene, default_bvh_build_config());
+            collapse_bvh_wide(bvh);
+            rebuilds++;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &mid);
+        num_rays += trace_bench_primary(bvh, camera, &num_intersects);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        update_ms += elapsed_ms(start, mid);
+        trace_ms += elapsed_ms(mid, end);
+    }
+
+    printf("  %-8s update %7.3f ms/frame | trace %7.2f ms/frame | %7.2f tests/ray | final sah cost %7.2f | %2d rebuilds\n",
+            name, update_ms / BENCH_FRAMES, trace_ms / BENCH_FRAMES, (double) num_intersects / num_rays, calculate_sah_cost(bvh), rebuilds);
+    free_bvh(bvh);
+    free(moved);
+}
+
+int main() {
+#ifdef RT_FLOAT
+    printf("Precision: float, wide nodes have %d children\n", WIDE_BVH_WIDTH);
+#else
+    printf("Precision: double, wide nodes have %d children\n", WIDE_BVH_WIDTH);
+#endif
+
+    Sphere spheres[4 + 22 * 22];
+    int num_spheres = create_random_spheres_arr(spheres);
+    Camera sphere_camera = create_camera(BENCH_WIDTH, 16.0 / 9.0, 1, 1, 20, (Point3) {13, 2, 3}, (Point3) {0, 0, 0}, (Vec3) {0, 1, 0}, 0.6, 10.0);
+
+    printf("Spheres scene (%d spheres, %dx%d primary rays):\n", num_spheres, sphere_camera.image_width, sphere_camera.image_height);
+    for (int b = 0; b < num_bench_builds; b++) {
+        bench_spheres(&bench_builds[b], spheres, num_spheres, &sphere_camera, (Point3) {-4, 12, 6});
+    }
+    SphereBlock *sphere_blocks = make_sphere_blocks(spheres, num_spheres);
+    bench_sphere_array("linear", spheres, NULL, num_spheres, &sphere_camera);
+    bench_sphere_array("blocks", spheres, sphere_blocks, num_spheres, &sphere_camera);
+    free(sphere_blocks);
+
+    // The small spheres scatter away from the middle of the scene. The ground sphere is
+    // left out, its box would dwarf every other node and hide the change in SAH cost.
+    Rng rng = create_rng(3, 0);
+    Vec3 velocity[4 + 22 * 22] = {0};
+    for (int i = 0; i < num_spheres; i++) {
+        if (spheres[i].radius < 0.5) {
+            velocity[i] = (Vec3) {0.2 * random_double(&rng) - 0.1, 0.1 * random_double(&rng), 0.2 * random_double(&rng) - 0.1};
+        }
+    }
+
+    printf("Animated spheres scene (%d spheres, %d frames of %dx%d primary rays):\n", num_spheres - 1, BENCH_FRAMES, sphere_camera.image_width, sphere_camera.image_height);
+    bench_animation("rebuild", BENCH_REBUILD, spheres + 1, velocity + 1, num_spheres - 1, &sphere_camera);
+    bench_animation("refit", BENCH_REFIT, spheres + 1, velocity + 1, num_spheres - 1, &sphere_camera);
+    bench_animation("refit+", BENCH_REFIT_REBUILD, spheres + 1, velocity + 1, num_spheres - 1, &sphere_camera);
+
+    Triangle *triangles = malloc(sizeof(Triangle) * 2 * BENCH_MESH_RINGS * BENCH_MESH_SEGMENTS);
+    int num_triangles = create_bench_mesh(triangles, &rng);
+    Camera mesh_camera = create_camera(BENCH_WIDTH, 16.0 / 9.0, 1, 1, 40, (Point3) {0.5, 1.0, 3.5}, (Point3) {0, 0, 0}, (Vec3) {0, 1, 0}, 0.0, 3.0);
+
+    printf("Mesh scene (%d triangles, %dx%d primary rays):\n", num_triangles, mesh_camera.image_width, mesh_camera.image_height);
+    for (int b = 0; b < num_bench_builds; b++) {
+        bench_triangles(&bench_builds[b], triangles, num_triangles, &mesh_camera, (Point3) {-3, 4, 1});
+    }
+
+    Transform forest[BENCH_FOREST_SIZE * BENCH_FOREST_SIZE];
+    int num_copies = BENCH_FOREST_SIZE * BENCH_FOREST_SIZE;
+    create_bench_forest(forest, &rng);
+    Camera forest_camera = create_camera(BENCH_WIDTH, 16.0 / 9.0, 1, 1, 40, (Point3) {14, 10, 20}, (Point3) {0, 0, 0}, (Vec3) {0, 1, 0}, 0.0, 20.0);
+
+    printf("Flattened forest scene (%d copies of the mesh in one tree, %dx%d primary rays):\n", num_copies, forest_camera.image_width, forest_camera.image_height);
+    for (int b = 0; b < num_forest_builds; b++) {
+        bench_forest_flat(&forest_builds[b], triangles, num_triangles, forest, num_copies, &forest_camera, (Point3) {-10, 20, 10});
+    }
+    printf("Instanced forest scene (%d instances of one mesh tree, %dx%d primary rays):\n", num_copies, forest_camera.image_width, forest_camera.image_height);
+    for (int b = 0; b < num_forest_builds; b++) {
+        bench_forest_instanced(&forest_builds[b], triangles, num_triangles, forest, num_copies, &forest_camera, (Point3) {-10, 20, 10});
+    }
+
+    // Reuses the mesh's triangles, which has room for far more
+    int num_rafter_triangles = create_bench_rafters(triangles, &rng);
+    Camera rafter_camera = create_camera(BENCH_WIDTH, 16.0 / 9.0, 1, 1, 40, (Point3) {0, 20, 30}, (Point3) {0, 0, 0}, (Vec3) {0, 1, 0}, 0.0, 25.0);
+
+    printf("Rafters scene (%d triangles, %dx%d primary rays):\n", num_rafter_triangles, rafter_camera.image_width, rafter_camera.image_height);
+    for (int b = 0; b < num_bench_builds; b++) {
+        bench_triangles(&bench_builds[b], triangles, num_rafter_triangles, &rafter_camera, (Point3) {-10, 20, 10});
+    }
+
+    free(triangles);
+
+    Quad *quads = malloc(sizeof(Quad) * BENCH_WALL_SIZE * BENCH_WALL_SIZE);
+    int num_quads = create_bench_wall(quads, &rng);
+    Camera wall_camera = create_camera(BENCH_WIDTH, 16.0 / 9.0, 1, 1, 40, (Point3) {10, 5, 40}, (Point3) {0, 0, 0}, (Vec3) {0, 1, 0}, 0.0, 40.0);
+
+    printf("Quad wall scene (%d quads, %dx%d primary rays):\n", num_quads, wall_camera.image_width, wall_camera.image_height);
+    for (int b = 0; b < num_bench_builds; b++) {
+        bench_quads(&bench_builds[b], quads, num_quads, &wall_camera, (Point3) {0, 30, 30});
+    }
+
+    free(quads);
+    return EXIT_SUCCESS;
+}
@@ -2,15 +2,46 @@
 #include <stdio.h>
 
 #include "aabb.h"
+#include "bvh.h"
 #include "interval.h"
+#include "material.h"
+#include "packet.h"
 #include "ray.h"
+#include "scheduler.h"
 #include "sphere.h"
 #include "triangle.h"
+#include "utils.h"
+
+// Tolerances for values computed exactly and for the same hit found two ways.
+// The float build rounds to 24 bits, so both are looser there.
+#ifdef RT_FLOAT
+#define EXACT_TOL ((real) 1e-4)
+#define MATCH_TOL ((real) 2e-3)
+#else
+#define EXACT_TOL ((real) 1e-12)
+#define MATCH_TOL ((real) 1e-9)
+#endif
 
 void test_ray_aabb_collisions();
 void test_ray_sphere_collisions();
 void test_ray_triangle_collisions();
 void testCubeIntersection();
+void test_work_stealing_runs_every_task();
+void test_sample_rng_reproducible();
+void test_bvh_builders_match_brute_force();
+void test_flat_bvh_layout();
+void test_ray_packets_match_single_rays();
+void test_large_sphere_bounce();
+void test_material_table();
+void test_occlusion_queries();
+void test_quad_bvh();
+void test_mixed_bvh();
+void test_instanced_bvh();
+void test_bvh_refit();
+void test_sphere_blocks();
+void test_triangle_blocks();
+void test_compressed_bvh();
+void test_spatial_split_bvh();
 
 int main() {
     printf("Testing ray/aabb collisions...");
@@ -26,6 +57,54 @@ int main() {
 
     printf("Testing ray/cube collisions...");
     testCubeIntersection();
+
+    printf("Testing work stealing scheduler...");
+    test_work_stealing_runs_every_task();
+
+    printf("Testing per-sample rng...");
+    test_sample_rng_reproducible();
+
+    printf("Testing bvh builders against brute force...");
+    test_bvh_builders_match_brute_force();
+
+    printf("Testing flat bvh layout...");
+    test_flat_bvh_layout();
+
+    printf("Testing ray packets...");
+    test_ray_packets_match_single_rays();
+
+    printf("Testing bounces off a large sphere...");
+    test_large_sphere_bounce();
+
+    printf("Testing material table...");
+    test_material_table();
+
+    printf("Testing occlusion queries...");
+    test_occlusion_queries();
+
+    printf("Testing quads in the bvh...");
+    test_quad_bvh();
+
+    printf("Testing mixed primitive bvh...");
+    test_mixed_bvh();
+
+    printf("Testing instanced bvh...");
+    test_instanced_bvh();
+
+    printf("Testing bvh refit...");
+    test_bvh_refit();
+
+    printf("Testing sphere blocks...");
+    test_sphere_blocks();
+
+    printf("Testing triangle blocks...");
+    test_triangle_blocks();
+
+    printf("Testing compressed bvh...");
+    test_compressed_bvh();
+
+    printf("Testing spatial split bvh...");
+    test_spatial_split_bvh();
 }
 
 /*
@@ -36,19 +115,31 @@ int main() {
  */
 
 void test_ray_aabb_collisions() {
-    Ray r = {.origin = {0, 0, 0}, .direction = {0, 0, 1}};
+    Ray r = create_ray((Point3) {0, 0, 0}, (Vec3) {0, 0, 1});
     Interval ray_t = {0.0, 5};
 
-    AABB box = create_aabb_for_point((Vec3) {-0.5, -0.5, 0.95}, (Vec3) {0.5, 0.5, 1.05});
+    AABB box = create_aabb_for_point((Vec3) {(real) -0.5, (real) -0.5, (real) 0.95}, (Vec3) {(real) 0.5, (real) 0.5, (real) 1.05});
+    assert(hit_aabb(&r, ray_t, &box));
+
+    real t_entry;
+    assert(hit_aabb_entry(&r, ray_t, &box, &t_entry));
+    assert(fabs(t_entry - (real) 0.95) < EXACT_TOL);
+
+    // Axis-parallel rays outside the slab, and rays pointing away, miss
+    r = create_ray((Point3) {(real) 0.6, 0, 0}, (Vec3) {0, 0, 1});
+    assert(!hit_aabb(&r, ray_t, &box));
+    r = create_ray((Point3) {0, 0, 0}, (Vec3) {0, 0, -1});
+    assert(!hit_aabb(&r, ray_t, &box));
+    r = create_ray((Point3) {0, 0, 2}, (Vec3) {0, 0, -1});
     assert(hit_aabb(&r, ray_t, &box));
     printf("PASSED.\n");
 }
 
 void test_ray_sphere_collisions() {
-    Ray r = {.origin = {0, 0, 0}, .direction = {0, 0, 1}};
+    Ray r = create_ray((Point3) {0, 0, 0}, (Vec3) {0, 0, 1});
     Interval ray_t = {0.0, 5};
 
-    Sphere sphere = {.center = {0, 0, 1}, .radius = 0.25, .mat = {0}};
+    Sphere sphere = {.center = {0, 0, 1}, .radius = 0.25, .mat_id = 0};
     HitRecord rec = {0};
     int tests = 0;
     assert(ray_intersect_sphere(&r, &sphere, &ray_t, &rec, &tests));
@@ -56,48 +147,58 @@ void test_ray_sphere_collisions() {
 }
 
 void test_ray_triangle_collisions() {
-    Ray r = {.origin = {0, 0, 0}, .direction = {0, 0, 1}};
+    Ray r = create_ray((Point3) {0, 0, 0}, (Vec3) {0, 0, 1});
     Interval ray_t = {0.0, 2};
 
-    Triangle triangle = {.v1 = {-1, -1, 1}, .v2 = {0, 1, 1}, .v3 = {1, -1, 1}, .normal = {0, 0, -1}, .mat = {0}};
+    Triangle triangle = {.v1 = {-1, -1, 1}, .v2 = {0, 1, 1}, .v3 = {1, -1, 1}, .normal = {0, 0, -1}, .mat_id = 0};
     HitRecord rec = {0};
     int tests = 0;
     assert(ray_intersect_triangle(&r, &triangle, &ray_t, &rec, &tests));
+    // p = v1 + u * (v2 - v1) + v * (v3 - v1)
+    assert(fabs(rec.u - (real) 0.5) < EXACT_TOL && fabs(rec.v - (real) 0.25) < EXACT_TOL);
+    assert(fabs(rec.p.z - 1) < EXACT_TOL);
+
+    // t is along the raw direction, and hits outside ray_t are rejected
+    r = create_ray((Point3) {0, 0, 0}, (Vec3) {0, 0, 4});
+    assert(ray_intersect_triangle(&r, &triangle, &ray_t, &rec, &tests));
+    assert(fabs(rec.t - (real) 0.25) < EXACT_TOL && fabs(rec.p.z - 1) < EXACT_TOL);
+    ray_t = (Interval) {0, (real) 0.2};
+    assert(!ray_intersect_triangle(&r, &triangle, &ray_t, &rec, &tests));
 
     // NO intersection
-    r = (Ray) {.origin = {0, 0, 0}, .direction = {1, 0, 0}};
+    r = create_ray((Point3) {0, 0, 0}, (Vec3) {1, 0, 0});
     ray_t = (Interval) {0.0, 2};
 
-    triangle = (Triangle) {.v1 = {0, 1, 0}, .v2 = {1, 1, 0}, .v3 = {0, 1, 1}, .normal = {0}, .mat = {0}};
+    triangle = (Triangle) {.v1 = {0, 1, 0}, .v2 = {1, 1, 0}, .v3 = {0, 1, 1}, .normal = {0}, .mat_id = 0};
     rec = (HitRecord) {0};
     tests = 0;
     assert(!ray_intersect_triangle(&r, &triangle, &ray_t, &rec, &tests));
 
     // Triangle in y=1 plane, intersction
-    r = (Ray) {.origin = {0, 0, 0}, .direction = {0, 1, 0}};
+    r = create_ray((Point3) {0, 0, 0}, (Vec3) {0, 1, 0});
     ray_t = (Interval) {0.0, 2};
 
-    triangle = (Triangle) {.v1 = {-1, 1, -1}, .v2 = {1, 1, -1}, .v3 = {0, 1, 1}, .normal = {0}, .mat = {0}};
+    triangle = (Triangle) {.v1 = {-1, 1, -1}, .v2 = {1, 1, -1}, .v3 = {0, 1, 1}, .normal = {0}, .mat_id = 0};
     rec = (HitRecord) {0};
     tests = 0;
     assert(ray_intersect_triangle(&r, &triangle, &ray_t, &rec, &tests));
     //assert(intersectionPoint == Vec3(0, 1, 0)); // Expected intersection at (0, 1, 0)
 
     // Edge intersection, triangle in z=1 plane
-    //r = (Ray) {.origin = {0, 0, 0}, .direction = {0, 0, 1}};
+    //r = create_ray((Point3) {0, 0, 0}, (Vec3) {0, 0, 1});
     //ray_t = (Interval) {0.0, 2};
 
-    //triangle = (Triangle) {.v1 = {-1, -1, 1}, .v2 = {1, -1, 1}, .v3 = {0, 1, 1}, .normal = {0}, .mat = {0}};
+    //triangle = (Triangle) {.v1 = {-1, -1, 1}, .v2 = {1, -1, 1}, .v3 = {0, 1, 1}, .normal = {0}, .mat_id = 0};
     //rec = (HitRecord) {0};
     //tests = 0;
     //assert(ray_intersect_triangle(&r, &triangle, &ray_t, &rec, &tests));
     //assert(intersectionPoint == Vec3(0, 0, 1)); // Expected intersection at the edge
 
     // Ray parallel to triangle, no intersection
-    r = (Ray) {.origin = {0, 0, 0}, .direction = {0, 0, 1}};
+    r = create_ray((Point3) {0, 0, 0}, (Vec3) {0, 0, 1});
     ray_t = (Interval) {0.0, 2};
 
-    triangle = (Triangle) {.v1 = {-1, -1, 0}, .v2 = {1, -1, 0}, .v3 = {0, 1, 0}, .normal = {0}, .mat = {0}};
+    triangle = (Triangle) {.v1 = {-1, -1, 0}, .v2 = {1, -1, 0}, .v3 = {0, 1, 0}, .normal = {0}, .mat_id = 0};
     rec = (HitRecord) {0};
     tests = 0;
     assert(!ray_intersect_triangle(&r, &triangle, &ray_t, &rec, &tests));
@@ -106,28 +207,28 @@ void test_ray_triangle_collisions() {
 
 void buildCubeTriangles(Triangle *cubeTriangles) {
     // Front face
-    cubeTriangles[0] = (Triangle){{-0.5, -0.5,  0.5}, {-0.5,  0.5,  0.5}, { 0.5,  0.5,  0.5}};
-    cubeTriangles[1] = (Triangle){{ 0.5,  0.5,  0.5}, { 0.5, -0.5,  0.5}, {-0.5, -0.5,  0.5}};
+    cubeTriangles[0] = (Triangle) {.v1 = {-0.5, -0.5,  0.5}, .v2 = {-0.5,  0.5,  0.5}, .v3 = { 0.5,  0.5,  0.5}};
+    cubeTriangles[1] = (Triangle) {.v1 = { 0.5,  0.5,  0.5}, .v2 = { 0.5, -0.5,  0.5}, .v3 = {-0.5, -0.5,  0.5}};
 
     // Back face
-    cubeTriangles[2] = (Triangle){{-0.5, -0.5, -0.5}, { 0.5, -0.5, -0.5}, { 0.5,  0.5, -0.5}};
-    cubeTriangles[3] = (Triangle){{ 0.5,  0.5, -0.5}, {-0.5,  0.5, -0.5}, {-0.5, -0.5, -0.5}};
+    cubeTriangles[2] = (Triangle) {.v1 = {-0.5, -0.5, -0.5}, .v2 = { 0.5, -0.5, -0.5}, .v3 = { 0.5,  0.5, -0.5}};
+    cubeTriangles[3] = (Triangle) {.v1 = { 0.5,  0.5, -0.5}, .v2 = {-0.5,  0.5, -0.5}, .v3 = {-0.5, -0.5, -0.5}};
 
     // Left face
-    cubeTriangles[4] = (Triangle){{-0.5, -0.5, -0.5}, {-0.5, -0.5,  0.5}, {-0.5,  0.5,  0.5}};
-    cubeTriangles[5] = (Triangle){{-0.5,  0.5,  0.5}, {-0.5,  0.5, -0.5}, {-0.5, -0.5, -0.5}};
+    cubeTriangles[4] = (Triangle) {.v1 = {-0.5, -0.5, -0.5}, .v2 = {-0.5, -0.5,  0.5}, .v3 = {-0.5,  0.5,  0.5}};
+    cubeTriangles[5] = (Triangle) {.v1 = {-0.5,  0.5,  0.5}, .v2 = {-0.5,  0.5, -0.5}, .v3 = {-0.5, -0.5, -0.5}};
 
     // Right face
-    cubeTriangles[6] = (Triangle){{ 0.5, -0.5, -0.5}, { 0.5,  0.5, -0.5}, { 0.5,  0.5,  0.5}};
-    cubeTriangles[7] = (Triangle){{ 0.5,  0.5,  0.5}, { 0.5, -0.5,  0.5}, { 0.5, -0.5, -0.5}};
+    cubeTriangles[6] = (Triangle) {.v1 = { 0.5, -0.5, -0.5}, .v2 = { 0.5,  0.5, -0.5}, .v3 = { 0.5,  0.5,  0.5}};
+    cubeTriangles[7] = (Triangle) {.v1 = { 0.5,  0.5,  0.5}, .v2 = { 0.5, -0.5,  0.5}, .v3 = { 0.5, -0.5, -0.5}};
 
     // Top face
-    cubeTriangles[8] = (Triangle){{-0.5,  0.5, -0.5}, {-0.5,  0.5,  0.5}, { 0.5,  0.5,  0.5}};
-    cubeTriangles[9] = (Triangle){{ 0.5,  0.5,  0.5}, { 0.5,  0.5, -0.5}, {-0.5,  0.5, -0.5}};
+    cubeTriangles[8] = (Triangle) {.v1 = {-0.5,  0.5, -0.5}, .v2 = {-0.5,  0.5,  0.5}, .v3 = { 0.5,  0.5,  0.5}};
+    cubeTriangles[9] = (Triangle) {.v1 = { 0.5,  0.5,  0.5}, .v2 = { 0.5,  0.5, -0.5}, .v3 = {-0.5,  0.5, -0.5}};
 
     // Bottom face
-    cubeTriangles[10] = (Triangle){{-0.5, -0.5, -0.5}, { 0.5, -0.5, -0.5}, { 0.5, -0.5,  0.5}};
-    cubeTriangles[11] = (Triangle){{ 0.5, -0.5,  0.5}, {-0.5, -0.5,  0.5}, {-0.5, -0.5, -0.5}};
+    cubeTriangles[10] = (Triangle) {.v1 = {-0.5, -0.5, -0.5}, .v2 = { 0.5, -0.5, -0.5}, .v3 = { 0.5, -0.5,  0.5}};
+    cubeTriangles[11] = (Triangle) {.v1 = { 0.5, -0.5,  0.5}, .v2 = {-0.5, -0.5,  0.5}, .v3 = {-0.5, -0.5, -0.5}};
 }
 
 // Test function
@@ -138,13 +239,12 @@ void testCubeIntersection() {
 
     // Define rays
     Vec3 rayOrigin = {0, 0, -1};
-    Ray r1 = {.origin = rayOrigin, .direction = {0, 0, 1}}; // Should intersect
-    Ray r2 = {.origin = rayOrigin, .direction = {1, 0, 0}}; // Should not intersect
+    Ray r1 = create_ray(rayOrigin, (Vec3) {0, 0, 1}); // Should intersect
+    Ray r2 = create_ray(rayOrigin, (Vec3) {1, 0, 0}); // Should not intersect
     Interval ray_t = {0.0, 2};
     HitRecord rec = {0};
     int tests = 0;
 
-    Vec3 intersectionPoint;
     int intersected1 = 0, intersected2 = 0;
 
     for (int i = 0; i < 12; i++) {
@@ -164,3 +264,799 @@ void testCubeIntersection() {
 }
 
 
+
+void count_task(int task, int worker, void *ctx) {
+    int *counts = ctx;
+    __atomic_fetch_add(&counts[task], 1, __ATOMIC_RELAXED);
+}
+
+void test_work_stealing_runs_every_task() {
+    int counts[1000] = {0};
+    assert(run_work_stealing(1000, 8, count_task, counts) == EXIT_SUCCESS);
+    for (int i = 0; i < 1000; i++) {
+        assert(counts[i] == 1);
+    }
+
+    // More workers than tasks
+    int few[3] = {0};
+    assert(run_work_stealing(3, 16, count_task, few) == EXIT_SUCCESS);
+    assert(few[0] == 1 && few[1] == 1 && few[2] == 1);
+    printf("PASSED.\n");
+}
+
+void test_sample_rng_reproducible() {
+    Rng a = create_sample_rng(11, 3, 7, 0);
+    Rng b = create_sample_rng(11, 3, 7, 0);
+    Rng c = create_sample_rng(11, 3, 7, 1);
+
+    bool differs = false;
+    for (int i = 0; i < 100; i++) {
+        double x = random_double(&a);
+        assert(x == random_double(&b));
+        assert(x >= 0.0 && x < 1.0);
+        differs |= x != random_double(&c);
+    }
+    assert(differs);
+    printf("PASSED.\n");
+}
+
+void check_bvh_against_brute_force(const Bvh *bvh, const Sphere spheres[], int length, Rng *rng) {
+    for (int i = 0; i < 500; i++) {
+        Ray r = create_ray(random_vec_interval(rng, -15, 15), random_unit_vector(rng));
+        Interval ray_t = {(real) 0.001, INFINITY};
+        HitRecord expected = {0}, actual = {0};
+        int tests = 0;
+
+        bool hit = ray_intersect_sphere_arr(&r, length, spheres, &ray_t, &expected, &tests);
+        assert(hit == ray_intersect_bvh(bvh, &r, ray_t, &actual, &tests));
+        if (hit) {
+            assert(fabs(expected.t - actual.t) < MATCH_TOL);
+            assert(fabs(expected.normal.y - actual.normal.y) < MATCH_TOL);
+            assert(expected.mat_id == actual.mat_id);
+        }
+
+        // Any-hit queries agree, and nothing blocks the ray before its closest hit
+        assert(hit == ray_occluded_bvh(bvh, &r, ray_t, &tests));
+        assert(hit == ray_occluded_sphere_arr(&r, length, spheres, &ray_t, &tests));
+        if (hit) {
+            assert(!ray_occluded_bvh(bvh, &r, (Interval) {ray_t.min, (real) 0.99 * expected.t}, &tests));
+        }
+    }
+}
+
+void test_bvh_builders_match_brute_force() {
+    Rng rng = create_rng(7, 0);
+    Sphere spheres[200];
+    for (int i = 0; i < 200; i++) {
+        spheres[i] = make_sphere(random_vec_interval(&rng, -10, 10), (real) random_double_interval(&rng, 0.1, 1.0), i);
+    }
+
+    BvhBuildConfig config = {.num_bins = 8, .max_leaf_size = 4};
+    Bvh *bvh = build_bvh_sah(spheres, 200, config);
+    assert(calculate_sah_cost(bvh) > 0);
+    check_bvh_against_brute_force(bvh, spheres, 200, &rng);
+    free_bvh(bvh);
+
+    bvh = build_bvh_sphere_fast(spheres, 200);
+    check_bvh_against_brute_force(bvh, spheres, 200, &rng);
+    free_bvh(bvh);
+
+    // Leaves never hold more than the requested number of primitives
+    bvh = build_bvh(spheres, 200, 3);
+    for (int i = 0; i < bvh->node_count; i++) {
+        assert(bvh->nodes[i].count <= 3);
+    }
+    check_bvh_against_brute_force(bvh, spheres, 200, &rng);
+
+    // Same tree collapsed to the wide form
+    collapse_bvh_wide(bvh);
+    assert(bvh->wide_node_count > 0 && bvh->wide_node_count < bvh->node_count);
+    check_bvh_against_brute_force(bvh, spheres, 200, &rng);
+    free_bvh(bvh);
+
+    // Median selection leaves every centroid on the correct side of the split
+    BvhBuildPrim prims[200];
+    for (int i = 0; i < 200; i++) {
+        prims[i] = make_build_prim(create_aabb_for_sphere(&spheres[i]), i);
+    }
+    select_build_prims(prims, 200, 100, 0);
+    for (int i = 0; i < 200; i++) {
+        assert(i < 100 ? prims[i].centroid.x <= prims[100].centroid.x : prims[i].centroid.x >= prims[100].centroid.x);
+    }
+    printf("PASSED.\n");
+}
+
+void test_flat_bvh_layout() {
+    Triangle cube[12];
+    buildCubeTriangles(cube);
+    Bvh *bvh = build_bvh_tri(cube, 12, 1);
+
+    assert(sizeof(BvhNode) % 32 == 0);
+    assert(((uintptr_t) bvh->nodes) % 32 == 0);
+    assert(bvh->triangle_count == 12);
+
+    // Leaves cover every primitive exactly once, children come after their parent
+    int covered = 0;
+    for (int i = 0; i < bvh->node_count; i++) {
+        const BvhNode *node = &bvh->nodes[i];
+        if (is_leaf(node)) {
+            assert(node->offset == covered);
+            covered += node->count;
+        } else {
+            assert(node->offset > i + 1 && node->offset < bvh->node_count);
+        }
+    }
+    assert(covered == 12);
+
+    free_bvh(bvh);
+    printf("PASSED.\n");
+}
+
+// Spheres with mat_id i and small triangles with mat_id num_spheres + i, scattered
+// over [-extent, extent] on every axis
+void make_random_soup(Rng *rng, real extent, Sphere spheres[], int num_spheres, Triangle triangles[], int num_triangles) {
+    for (int i = 0; i < num_spheres; i++) {
+        spheres[i] = make_sphere(random_vec_interval(rng, -extent, extent), (real) random_double_interval(rng, 0.1, 0.5), i);
+    }
+    for (int i = 0; i < num_triangles; i++) {
+        Point3 p = random_vec_interval(rng, -extent, extent);
+        Point3 v2 = add_vec3(p, random_vec_interval(rng, -1, 1));
+        Point3 v3 = add_vec3(p, random_vec_interval(rng, -1, 1));
+        triangles[i] = (Triangle) {.v1 = p, .v2 = v2, .v3 = v3, .normal = unit_vec(cross(diff_vec3(v2, p), diff_vec3(v3, p))), .mat_id = num_spheres + i};
+    }
+}
+
+// Coherent fans of rays from one origin, every tenth packet only partly filled
+void check_packets_against_single_rays(const Bvh *bvh, Rng *rng) {
+    for (int p = 0; p < 50; p++) {
+        Point3 origin = random_vec_interval(rng, -15, 15);
+        Vec3 towards = diff_vec3(random_vec_interval(rng, -5, 5), origin);
+        int lanes = (p % 10 == 9) ? 3 : RAY_PACKET_SIZE;
+
+        RayPacket packet;
+        init_ray_packet(&packet);
+        for (int lane = 0; lane < lanes; lane++) {
+            Vec3 jitter = scale_vec3(random_vec_interval(rng, -1, 1), (real) 0.05 * length(towards));
+            Ray r = create_ray(origin, add_vec3(towards, jitter));
+            set_packet_ray(&packet, lane, &r, INFINITY);
+        }
+        assert(packet.active == (1 << lanes) - 1);
+
+        int tests = 0;
+        ray_intersect_bvh_packet(bvh, &packet, (real) 0.001, &tests);
+
+        for (int lane = 0; lane < RAY_PACKET_SIZE; lane++) {
+            HitRecord expected = {0}, actual = {0};
+            bool hit = lane < lanes && ray_intersect_bvh(bvh, &packet.rays[lane], (Interval) {(real) 0.001, INFINITY}, &expected, &tests);
+            assert(hit == finalize_packet_hit(bvh, &packet, lane, &actual));
+            if (hit) {
+                assert(fabs(expected.t - actual.t) < MATCH_TOL);
+                assert(fabs(expected.normal.x - actual.normal.x) < MATCH_TOL);
+                assert(expected.front_face == actual.front_face);
+            }
+        }
+    }
+}
+
+void test_ray_packets_match_single_rays() {
+    Rng rng = create_rng(9, 0);
+    Sphere spheres[200];
+    for (int i = 0; i < 200; i++) {
+        spheres[i] = make_sphere(random_vec_interval(&rng, -10, 10), (real) random_double_interval(&rng, 0.1, 1.0), 0);
+    }
+    Bvh *bvh = build_bvh(spheres, 200, 4);
+    check_packets_against_single_rays(bvh, &rng);
+    free_bvh(bvh);
+
+    // Packets take the wide nodes when the tree has them
+    Triangle triangles[200];
+    make_random_soup(&rng, 10, spheres, 100, triangles, 200);
+    BvhPrimitives scene = {.spheres = spheres, .sphere_count = 100, .triangles = triangles, .triangle_count = 200};
+    bvh = build_bvh_primitives(scene, default_bvh_build_config());
+    collapse_bvh_wide(bvh);
+    check_packets_against_single_rays(bvh, &rng);
+    free_bvh(bvh);
+    bvh = build_bvh_primitives(scene, default_bvh_build_config());
+    compress_bvh_wide(bvh);
+    check_packets_against_single_rays(bvh, &rng);
+    free_bvh(bvh);
+    printf("PASSED.\n");
+}
+
+void test_large_sphere_bounce() {
+    // Same as the ground of create_random_spheres_arr
+    Sphere ground = make_sphere((Point3) {0, -1000, 0}, 1000, 0);
+    Rng rng = create_rng(5, 0);
+    int tests = 0;
+
+    for (int i = 0; i < 1000; i++) {
+        Point3 eye = {(real) random_double_interval(&rng, -20, 20), 2, (real) random_double_interval(&rng, -20, 20)};
+        Ray r = create_ray(eye, (Vec3) {(real) random_double_interval(&rng, -1, 1), -1, (real) random_double_interval(&rng, -1, 1)});
+        HitRecord rec = {0};
+        assert(ray_intersect_sphere(&r, &ground, &(Interval) {(real) 0.001, INFINITY}, &rec, &tests));
+        assert(fabs(length(diff_vec3(rec.p, ground.center)) - ground.radius) < (real) 1e-3);
+
+        // A ray leaving the surface must not hit the sphere it starts on
+        Ray bounce = create_ray(rec.p, random_on_hemisphere(&rng, rec.normal));
+        HitRecord again = {0};
+        assert(!ray_intersect_sphere(&bounce, &ground, &(Interval) {(real) 0.001, INFINITY}, &again, &tests));
+    }
+
+    printf("PASSED.\n");
+}
+
+void test_material_table() {
+    clear_materials();
+    int matte = add_material((Material) {.type = LAMBERTIAN, .albedo = {0.5, 0.5, 0.5}});
+    for (int i = 0; i < 100; i++) {
+        add_material((Material) {.type = METAL, .fuzz = i});
+    }
+    int glass = add_material((Material) {.type = DIELECTRIC, .ir = 1.5});
+
+    // Ids stay valid while the table grows
+    assert(matte == 0 && glass == 101);
+    assert(get_material(matte)->type == LAMBERTIAN);
+    assert(get_material(50)->fuzz == 49);
+    assert(get_material(glass)->ir == 1.5);
+
+    // Hits carry the id of the primitive they hit
+    Sphere sphere = make_sphere((Point3) {0, 0, -2}, 0.5, glass);
+    Ray r = create_ray((Point3) {0, 0, 0}, (Vec3) {0, 0, -1});
+    HitRecord rec = {0};
+    int tests = 0;
+    assert(ray_intersect_sphere(&r, &sphere, &(Interval) {(real) 0.001, INFINITY}, &rec, &tests));
+    assert(rec.mat_id == glass);
+
+    clear_materials();
+    printf("PASSED.\n");
+}
+
+void test_occlusion_queries() {
+    Triangle cube[12];
+    buildCubeTriangles(cube);
+    Bvh *bvh = build_bvh_tri(cube, 12, 1);
+    int tests = 0;
+
+    // From outside the cube, towards it and away from it
+    Ray toward = create_ray((Point3) {(real) 0.1, (real) 0.2, -5}, (Vec3) {0, 0, 1});
+    Ray away = create_ray((Point3) {(real) 0.1, (real) 0.2, -5}, (Vec3) {0, 0, -1});
+    Interval ray_t = {(real) 0.001, INFINITY};
+    assert(ray_occluded_triangle_arr(&toward, 12, cube, &ray_t, &tests));
+    assert(!ray_occluded_triangle_arr(&away, 12, cube, &ray_t, &tests));
+    assert(ray_occluded_bvh(bvh, &toward, ray_t, &tests));
+    assert(!ray_occluded_bvh(bvh, &away, ray_t, &tests));
+
+    // A blocker past the end of the interval does not count
+    Interval short_t = {(real) 0.001, 1};
+    assert(!ray_occluded_triangle_arr(&toward, 12, cube, &short_t, &tests));
+    assert(!ray_occluded_bvh(bvh, &toward, short_t, &tests));
+    free_bvh(bvh);
+
+    Quad quad = create_quad((Point3) {-1, -1, 2}, (Vec3) {2, 0, 0}, (Vec3) {0, 2, 0}, 0);
+    Ray r = create_ray((Point3) {0, 0, 0}, (Vec3) {0, 0, 1});
+    ray_t = (Interval) {(real) 0.001, 5};
+    assert(ray_occluded_quad_arr(&r, 1, &quad, &ray_t, &tests));
+    ray_t = (Interval) {(real) 0.001, (real) 1.5};
+    assert(!ray_occluded_quad_arr(&r, 1, &quad, &ray_t, &tests));
+    printf("PASSED.\n");
+}
+
+void test_quad_bvh() {
+    // Plane coordinates run from 0 to 1 along each side
+    Quad quad = create_quad((Point3) {-1, -1, 2}, (Vec3) {4, 0, 0}, (Vec3) {0, 2, 0}, 0);
+    Ray r = create_ray((Point3) {0, 0, 0}, (Vec3) {0, 0, 2});
+    Interval ray_t = {(real) 0.001, 5};
+    HitRecord rec = {0};
+    int tests = 0;
+    assert(ray_intersect_quad(&r, &quad, &ray_t, &rec, &tests));
+    assert(fabs(rec.t - 1) < EXACT_TOL);
+    assert(fabs(rec.u - (real) 0.25) < EXACT_TOL && fabs(rec.v - (real) 0.5) < EXACT_TOL);
+    ray_t = (Interval) {(real) 0.001, (real) 0.5};
+    assert(!ray_intersect_quad(&r, &quad, &ray_t, &rec, &tests));
+
+    // Flat axis-aligned boxes are padded
+    AABB bbox = create_aabb_for_quad(quad);
+    assert(size_interval(bbox.z) > 0);
+
+    Rng rng = create_rng(13, 0);
+    Quad quads[100];
+    for (int i = 0; i < 100; i++) {
+        quads[i] = create_quad(random_vec_interval(&rng, -10, 10), random_vec_interval(&rng, -1, 1), random_vec_interval(&rng, -1, 1), i);
+    }
+    Bvh *bvh = build_bvh_quad(quads, 100, 4);
+    for (int k = 0; k < 2; k++) {
+        for (int i = 0; i < 500; i++) {
+            r = create_ray(random_vec_interval(&rng, -15, 15), random_unit_vector(&rng));
+            ray_t = (Interval) {(real) 0.001, INFINITY};
+            HitRecord expected = {0}, actual = {0};
+
+            bool hit = ray_intersect_quad_arr(&r, 100, quads, &ray_t, &expected, &tests);
+            assert(hit == ray_intersect_bvh(bvh, &r, ray_t, &actual, &tests));
+            assert(hit == ray_occluded_bvh(bvh, &r, ray_t, &tests));
+            if (hit) {
+                assert(fabs(expected.t - actual.t) < MATCH_TOL);
+                assert(fabs(expected.u - actual.u) < MATCH_TOL);
+                assert(expected.mat_id == actual.mat_id);
+            }
+        }
+        collapse_bvh_wide(bvh);
+    }
+    free_bvh(bvh);
+    printf("PASSED.\n");
+}
+
+// Move every sphere and triangle by its own random step of up to step_size per axis
+void perturb_soup(Rng *rng, real step_size, Sphere spheres[], int num_spheres, Triangle triangles[], int num_triangles) {
+    for (int i = 0; i < num_spheres; i++) {
+        spheres[i].center = add_vec3(spheres[i].center, random_vec_interval(rng, -step_size, step_size));
+    }
+    for (int i = 0; i < num_triangles; i++) {
+        Vec3 step = random_vec_interval(rng, -step_size, step_size);
+        triangles[i].v1 = add_vec3(triangles[i].v1, step);
+        triangles[i].v2 = add_vec3(triangles[i].v2, step);
+        triangles[i].v3 = add_vec3(triangles[i].v3, step);
+    }
+}
+
+// Closest hit over the scene's spheres, triangles and quads by brute force
+bool brute_force_hit(const Ray *r, BvhPrimitives scene, HitRecord *expected, int *tests) {
+    Interval ray_t = {(real) 0.001, INFINITY};
+    HitRecord rec = {0};
+    *expected = (HitRecord) {.t = INFINITY};
+    if (ray_intersect_sphere_arr(r, scene.sphere_count, scene.spheres, &ray_t, &rec, tests) && rec.t < expected->t) *expected = rec;
+    if (ray_intersect_triangle_arr(r, scene.triangle_count, scene.triangles, &ray_t, &rec, tests) && rec.t < expected->t) *expected = rec;
+    if (ray_intersect_quad_arr(r, scene.quad_count, scene.quads, &ray_t, &rec, tests) && rec.t < expected->t) *expected = rec;
+    return isfinite(expected->t);
+}
+
+// Random rays find the same closest hit in bvh as by brute force over scene, and are
+// occluded exactly up to it
+void check_bvh_against_scene(const Bvh *bvh, BvhPrimitives scene, Rng *rng) {
+    int tests = 0;
+    for (int i = 0; i < 1000; i++) {
+        Ray r = create_ray(random_vec_interval(rng, -15, 15), random_unit_vector(rng));
+        HitRecord expected, actual = {0};
+        bool hit = brute_force_hit(&r, scene, &expected, &tests);
+        assert(hit == ray_intersect_bvh(bvh, &r, (Interval) {(real) 0.001, INFINITY}, &actual, &tests));
+        assert(hit == ray_occluded_bvh(bvh, &r, (Interval) {(real) 0.001, INFINITY}, &tests));
+        if (hit) {
+            assert(fabs(expected.t - actual.t) < MATCH_TOL && expected.mat_id == actual.mat_id);
+            assert(!ray_occluded_bvh(bvh, &r, (Interval) {(real) 0.001, (real) 0.99 * expected.t}, &tests));
+        }
+    }
+}
+
+void test_mixed_bvh() {
+    Rng rng = create_rng(17, 0);
+    Sphere spheres[50];
+    Triangle triangles[50];
+    Quad quads[50];
+    make_random_soup(&rng, 10, spheres, 50, triangles, 50);
+    for (int i = 0; i < 50; i++) {
+        quads[i] = create_quad(random_vec_interval(&rng, -10, 10), random_vec_interval(&rng, -1, 1), random_vec_interval(&rng, -1, 1), 100 + i);
+    }
+
+    BvhPrimitives scene = {
+        .spheres = spheres, .sphere_count = 50,
+        .triangles = triangles, .triangle_count = 50,
+        .quads = quads, .quad_count = 50
+    };
+    BvhBuildConfig config = default_bvh_build_config();
+    config.max_leaf_size = 4;
+    Bvh *bvh = build_bvh_primitives(scene, config);
+    assert(bvh->prim_count == 150);
+    assert(bvh->sphere_count == 50 && bvh->triangle_count == 50 && bvh->quad_count == 50);
+
+    int tests = 0;
+    int kinds_hit[3] = {0};
+    for (int k = 0; k < 2; k++) {
+        for (int i = 0; i < 1000; i++) {
+            Ray r = create_ray(random_vec_interval(&rng, -15, 15), random_unit_vector(&rng));
+            Interval ray_t = {(real) 0.001, INFINITY};
+            HitRecord expected, actual = {0};
+            bool hit = brute_force_hit(&r, scene, &expected, &tests);
+
+            assert(hit == ray_intersect_bvh(bvh, &r, ray_t, &actual, &tests));
+            assert(hit == ray_occluded_bvh(bvh, &r, ray_t, &tests));
+            if (hit) {
+                assert(fabs(expected.t - actual.t) < MATCH_TOL);
+                assert(expected.mat_id == actual.mat_id);
+                kinds_hit[expected.mat_id / 50]++;
+            }
+        }
+        collapse_bvh_wide(bvh);
+    }
+    assert(kinds_hit[0] > 0 && kinds_hit[1] > 0 && kinds_hit[2] > 0);
+    check_packets_against_single_rays(bvh, &rng);
+    free_bvh(bvh);
+    printf("PASSED.\n");
+}
+
+void test_instanced_bvh() {
+    Rng rng = create_rng(19, 0);
+    Sphere spheres[10];
+    Triangle triangles[30];
+    make_random_soup(&rng, 2, spheres, 10, triangles, 30);
+    BvhBuildConfig config = default_bvh_build_config();
+    Bvh *child = build_bvh_primitives((BvhPrimitives) {
+        .spheres = spheres, .sphere_count = 10, .triangles = triangles, .triangle_count = 30
+    }, config);
+
+    // The same copies placed by hand, to search by brute force
+    Instance instances[8];
+    Sphere flat_spheres[8 * 10];
+    Triangle flat_triangles[8 * 30];
+    for (int k = 0; k < 8; k++) {
+        real scale = (real) random_double_interval(&rng, 0.5, 2.0);
+        Transform rotate = rotate_y_transform(random_double_interval(&rng, 0, 360));
+        Transform resize = scale_transform(scale);
+        Transform move = translate_transform(random_vec_interval(&rng, -10, 10));
+        Transform rotate_scale = compose_transform(&rotate, &resize);
+        instances[k] = (Instance) {.bvh = child, .object_to_world = compose_transform(&move, &rotate_scale)};
+
+        const Transform *m = &instances[k].object_to_world;
+        Transform inverse = invert_transform(m);
+        for (int i = 0; i < 10; i++) {
+            flat_spheres[10 * k + i] = make_sphere(transform_point(m, spheres[i].center), spheres[i].radius * scale, spheres[i].mat_id);
+        }
+        for (int i = 0; i < 30; i++) {
+            const Triangle *t = &triangles[i];
+            flat_triangles[30 * k + i] = (Triangle) {
+                .v1 = transform_point(m, t->v1), .v2 = transform_point(m, t->v2), .v3 = transform_point(m, t->v3),
+                .normal = unit_vec(transform_normal(&inverse, t->normal)), .mat_id = t->mat_id
+            };
+        }
+
+        // Round trip through the inverse
+        Point3 p = random_vec_interval(&rng, -5, 5);
+        Point3 back = transform_point(&inverse, transform_point(m, p));
+        assert(length(diff_vec3(back, p)) < MATCH_TOL);
+    }
+
+    Bvh *bvh = build_bvh_instances(instances, 8, config);
+    assert(bvh->instance_count == 8 && bvh->prim_count == 8);
+    BvhPrimitives flat_scene = {.spheres = flat_spheres, .sphere_count = 80, .triangles = flat_triangles, .triangle_count = 240};
+
+    int tests = 0;
+    int hits = 0;
+    for (int k = 0; k < 2; k++) {
+        for (int i = 0; i < 1000; i++) {
+            Ray r = create_ray(random_vec_interval(&rng, -15, 15), random_unit_vector(&rng));
+            Interval ray_t = {(real) 0.001, INFINITY};
+            HitRecord expected, actual = {0};
+            bool hit = brute_force_hit(&r, flat_scene, &expected, &tests);
+
+            assert(hit == ray_intersect_bvh(bvh, &r, ray_t, &actual, &tests));
+            assert(hit == ray_occluded_bvh(bvh, &r, ray_t, &tests));
+            if (hit) {
+                assert(fabs(expected.t - actual.t) < MATCH_TOL);
+                assert(expected.mat_id == actual.mat_id);
+                assert(expected.front_face == actual.front_face);
+                assert(length(diff_vec3(expected.p, actual.p)) < MATCH_TOL);
+                assert(length(diff_vec3(expected.normal, actual.normal)) < MATCH_TOL);
+                hits++;
+            }
+        }
+        collapse_bvh_wide(bvh);
+    }
+    assert(hits > 0);
+    check_packets_against_single_rays(bvh, &rng);
+    free_bvh(bvh);
+    free_bvh(child);
+    printf("PASSED.\n");
+}
+
+void test_bvh_refit() {
+    Rng rng = create_rng(20, 0);
+    Sphere spheres[100];
+    Triangle triangles[100];
+    make_random_soup(&rng, 10, spheres, 100, triangles, 100);
+    BvhPrimitives scene = {.spheres = spheres, .sphere_count = 100, .triangles = triangles, .triangle_count = 100};
+    Bvh *bvh = build_bvh_primitives(scene, default_bvh_build_config());
+    collapse_bvh_wide(bvh);
+    BvhNode *nodes = bvh->nodes;
+    WideBvhNode *wide_nodes = bvh->wide_nodes;
+    int wide_node_count = bvh->wide_node_count;
+
+    // A small step keeps the tree in shape
+    perturb_soup(&rng, (real) 0.3, spheres, 100, triangles, 100);
+    refit_bvh(bvh, scene);
+    assert(bvh->nodes == nodes && bvh->wide_nodes == wide_nodes && bvh->wide_node_count == wide_node_count);
+    assert(!bvh_needs_rebuild(bvh, BVH_DEFAULT_SAH_GROWTH));
+
+    for (int k = 0; k < 2; k++) {
+        check_bvh_against_scene(bvh, scene, &rng);
+        // Check the binary nodes the second time round
+        free(bvh->wide_nodes);
+        bvh->wide_nodes = NULL;
+        bvh->wide_node_count = 0;
+    }
+
+    // Scattering everything leaves the old topology far worse than a new build
+    for (int i = 0; i < 100; i++) {
+        Vec3 jump = random_vec_interval(&rng, -10, 10);
+        spheres[i].center = jump;
+        triangles[i].v2 = add_vec3(jump, diff_vec3(triangles[i].v2, triangles[i].v1));
+        triangles[i].v3 = add_vec3(jump, diff_vec3(triangles[i].v3, triangles[i].v1));
+        triangles[i].v1 = add_vec3(jump, random_vec_interval(&rng, -0.5, 0.5));
+    }
+    refit_bvh(bvh, scene);
+    assert(bvh_needs_rebuild(bvh, BVH_DEFAULT_SAH_GROWTH));
+    bvh = update_bvh(bvh, scene, BVH_DEFAULT_SAH_GROWTH);
+    assert(!bvh_needs_rebuild(bvh, 1.0 + 1e-9));
+    check_bvh_against_scene(bvh, scene, &rng);
+
+    // Moving an instance moves it in the top-level tree
+    int tests = 0;
+    Instance instance = {.bvh = bvh, .object_to_world = identity_transform()};
+    Bvh *top = build_bvh_instances(&instance, 1, default_bvh_build_config());
+    Ray r = create_ray(add_vec3(spheres[0].center, (Vec3) {0, 0, 50}), (Vec3) {0, 0, -1});
+    HitRecord rec = {0};
+    assert(ray_intersect_bvh(top, &r, (Interval) {(real) 0.001, INFINITY}, &rec, &tests));
+    instance.object_to_world = translate_transform((Vec3) {100, 0, 0});
+    refit_bvh(top, (BvhPrimitives) {.instances = &instance, .instance_count = 1});
+    assert(!ray_intersect_bvh(top, &r, (Interval) {(real) 0.001, INFINITY}, &rec, &tests));
+    r = create_ray(add_vec3(spheres[0].center, (Vec3) {100, 0, 50}), (Vec3) {0, 0, -1});
+    assert(ray_intersect_bvh(top, &r, (Interval) {(real) 0.001, INFINITY}, &rec, &tests));
+    free_bvh(top);
+    free_bvh(bvh);
+
+    // A ground sphere dwarfs the decay of everything else, a tree of the moving spheres
+    // alone shows it. This is how the bouncing testcase splits its scene.
+    Sphere grounded[101];
+    make_random_soup(&rng, 10, spheres, 100, NULL, 0);
+    grounded[0] = make_sphere((Point3) {0, -1000, 0}, 1000, 100);
+    memcpy(&grounded[1], spheres, sizeof(spheres));
+    Bvh *alone = build_bvh_primitives((BvhPrimitives) {.spheres = spheres, .sphere_count = 100}, default_bvh_build_config());
+    Bvh *with_ground = build_bvh_primitives((BvhPrimitives) {.spheres = grounded, .sphere_count = 101}, default_bvh_build_config());
+
+    // Spheres trading places keep the root box but mix up every leaf
+    for (int i = 0; i < 100; i++) {
+        int j = (int) (rng_next(&rng) % 100);
+        Point3 center = spheres[i].center;
+        spheres[i].center = spheres[j].center;
+        spheres[j].center = center;
+    }
+    memcpy(&grounded[1], spheres, sizeof(spheres));
+    refit_bvh(with_ground, (BvhPrimitives) {.spheres = grounded, .sphere_count = 101});
+    refit_bvh(alone, (BvhPrimitives) {.spheres = spheres, .sphere_count = 100});
+    assert(!bvh_needs_rebuild(with_ground, BVH_DEFAULT_SAH_GROWTH));
+    assert(bvh_needs_rebuild(alone, BVH_DEFAULT_SAH_GROWTH));
+    alone = update_bvh(alone, (BvhPrimitives) {.spheres = spheres, .sphere_count = 100}, BVH_DEFAULT_SAH_GROWTH);
+    assert(!bvh_needs_rebuild(alone, 1.0 + 1e-9));
+    free_bvh(with_ground);
+    free_bvh(alone);
+
+    printf("PASSED.\n");
+}
+
+void test_sphere_blocks() {
+    Rng rng = create_rng(21, 0);
+    Sphere spheres[37];
+    SphereBlock blocks[sphere_block_count(37)];
+    for (int i = 0; i < 37; i++) {
+        spheres[i] = make_sphere(random_vec_interval(&rng, -5, 5), (real) random_double_interval(&rng, 0.2, 2.0), i);
+        set_block_sphere(blocks, i, spheres[i].center, spheres[i].radius);
+    }
+
+    // Every range, including ones that start or end inside a block, against one sphere at a time
+    int hits = 0;
+    for (int i = 0; i < 2000; i++) {
+        Ray r = create_ray(random_vec_interval(&rng, -8, 8), random_vec_interval(&rng, -1, 1));
+        Interval ray_t = {(real) 0.001, (real) random_double_interval(&rng, 1, 20)};
+        int first = (int) (rng_next(&rng) % 37);
+        int count = 1 + (int) (rng_next(&rng) % (uint32_t) (37 - first));
+
+        int expected = -1;
+        real expected_t = 0;
+        Interval cur_interval = ray_t;
+        for (int k = first; k < first + count; k++) {
+            SphereGeom geom = get_block_sphere(blocks, k);
+            if (intersect_sphere_geom(&r, &geom, &cur_interval, &expected_t)) {
+                cur_interval.max = expected_t;
+                expected = k;
+            }
+        }
+
+        real t;
+        int actual = intersect_sphere_blocks(&r, blocks, first, count, &ray_t, &t);
+        assert(actual == expected);
+        if (expected >= 0) {
+            assert(fabs(t - expected_t) < MATCH_TOL);
+            hits++;
+        }
+
+        // The whole array through blocks from make_sphere_blocks
+        SphereBlock *made = make_sphere_blocks(spheres, 37);
+        HitRecord rec_arr = {0}, rec_blocks = {0};
+        int tests_arr = 0, tests_blocks = 0;
+        bool hit_arr = ray_intersect_sphere_arr(&r, 37, spheres, &ray_t, &rec_arr, &tests_arr);
+        bool hit_blocks = ray_intersect_sphere_blocks(&r, 37, made, spheres, &ray_t, &rec_blocks, &tests_blocks);
+        assert(hit_arr == hit_blocks && tests_arr == tests_blocks);
+        if (hit_arr) {
+            assert(fabs(rec_arr.t - rec_blocks.t) < MATCH_TOL);
+            assert(rec_arr.mat_id == rec_blocks.mat_id && rec_arr.front_face == rec_blocks.front_face);
+        }
+        free(made);
+    }
+    assert(hits > 0);
+
+    // No spheres, no blocks
+    SphereBlock *none = make_sphere_blocks(spheres, 0);
+    Ray r = create_ray((Point3) {0, 0, -10}, (Vec3) {0, 0, 1});
+    HitRecord rec = {0};
+    int tests = 0;
+    assert(none == NULL);
+    assert(!ray_intersect_sphere_blocks(&r, 0, none, spheres, &(Interval) {(real) 0.001, INFINITY}, &rec, &tests));
+    printf("PASSED.\n");
+}
+
+void test_triangle_blocks() {
+    Rng rng = create_rng(22, 0);
+    Triangle triangles[29];
+    TriangleBlock blocks[triangle_block_count(29)];
+    for (int i = 0; i < 29; i++) {
+        Point3 v1 = random_vec_interval(&rng, -4, 4);
+        triangles[i] = (Triangle) {
+            .v1 = v1,
+            .v2 = add_vec3(v1, random_vec_interval(&rng, -2, 2)),
+            .v3 = add_vec3(v1, random_vec_interval(&rng, -2, 2)),
+            .normal = {0, 1, 0},
+            .mat_id = i
+        };
+        TriangleGeom geom = make_triangle_geom(&triangles[i]);
+        set_block_triangle(blocks, i, &geom);
+    }
+
+    // Every range, including ones that start or end inside a block, against one triangle at a time.
+    // Half the rays aim at a triangle so plenty of them hit.
+    int hits = 0;
+    for (int i = 0; i < 4000; i++) {
+        Point3 origin = random_vec_interval(&rng, -8, 8);
+        Vec3 direction = random_vec_interval(&rng, -1, 1);
+        if (i % 2) {
+            direction = diff_vec3(center_triangle(triangles[rng_next(&rng) % 29]), origin);
+        }
+        Ray r = create_ray(origin, direction);
+        Interval ray_t = {(real) 0.001, (real) random_double_interval(&rng, 0.5, 20)};
+        int first = (int) (rng_next(&rng) % 29);
+        int count = 1 + (int) (rng_next(&rng) % (uint32_t) (29 - first));
+
+        int expected = -1;
+        real expected_t = 0, expected_u = 0, expected_v = 0;
+        Interval cur_interval = ray_t;
+        for (int k = first; k < first + count; k++) {
+            TriangleGeom geom = get_block_triangle(blocks, k);
+            if (intersect_triangle_geom(&r, &geom, &cur_interval, &expected_t, &expected_u, &expected_v)) {
+                cur_interval.max = expected_t;
+                expected = k;
+            }
+        }
+
+        real t, u, v;
+        int actual = intersect_triangle_blocks(&r, blocks, first, count, &ray_t, &t, &u, &v);
+        assert(actual == expected);
+        if (expected >= 0) {
+            assert(fabs(t - expected_t) < MATCH_TOL);
+            assert(fabs(u - expected_u) < MATCH_TOL && fabs(v - expected_v) < MATCH_TOL);
+            hits++;
+        }
+
+        // The whole array through blocks from make_triangle_blocks
+        TriangleBlock *made = make_triangle_blocks(triangles, 29);
+        HitRecord rec_arr = {0}, rec_blocks = {0};
+        int tests_arr = 0, tests_blocks = 0;
+        bool hit_arr = ray_intersect_triangle_arr(&r, 29, triangles, &ray_t, &rec_arr, &tests_arr);
+        bool hit_blocks = ray_intersect_triangle_blocks(&r, 29, made, triangles, &ray_t, &rec_blocks, &tests_blocks);
+        assert(hit_arr == hit_blocks && tests_arr == tests_blocks);
+        if (hit_arr) {
+            assert(fabs(rec_arr.t - rec_blocks.t) < MATCH_TOL);
+            assert(rec_arr.mat_id == rec_blocks.mat_id && rec_arr.front_face == rec_blocks.front_face);
+        }
+        free(made);
+    }
+    assert(hits > 100);
+
+    // No triangles, no blocks
+    TriangleBlock *none = make_triangle_blocks(triangles, 0);
+    Ray r = create_ray((Point3) {0, 0, -10}, (Vec3) {0, 0, 1});
+    HitRecord rec = {0};
+    int tests = 0;
+    assert(none == NULL);
+    assert(!ray_intersect_triangle_blocks(&r, 0, none, triangles, &(Interval) {(real) 0.001, INFINITY}, &rec, &tests));
+    printf("PASSED.\n");
+}
+
+void test_compressed_bvh() {
+    Rng rng = create_rng(24, 0);
+    Sphere spheres[150];
+    Triangle triangles[150];
+    make_random_soup(&rng, 10, spheres, 150, triangles, 150);
+    BvhPrimitives scene = {.spheres = spheres, .sphere_count = 150, .triangles = triangles, .triangle_count = 150};
+    Bvh *wide = build_bvh_primitives(scene, default_bvh_build_config());
+    collapse_bvh_wide(wide);
+    Bvh *bvh = build_bvh_primitives(scene, default_bvh_build_config());
+    compress_bvh_wide(bvh);
+    assert(bvh->wide_nodes == NULL && bvh->compressed_node_count == wide->wide_node_count);
+    assert(bvh_traversal_node_bytes(bvh) < bvh_traversal_node_bytes(wide));
+
+    // Same children, and every quantized box holds the exact one
+    for (int i = 0; i < bvh->compressed_node_count; i++) {
+        const CompressedBvhNode *node = &bvh->compressed_nodes[i];
+        const WideBvhNode *exact = &wide->wide_nodes[i];
+        assert(node->child_count == exact->child_count);
+        for (int j = 0; j < node->child_count; j++) {
+            assert(node->child[j] == exact->child[j] && node->count[j] == exact->count[j]);
+            assert(node->origin[0] + node->min_x[j] * node->scale[0] <= exact->min_x[j]);
+            assert(node->origin[1] + node->min_y[j] * node->scale[1] <= exact->min_y[j]);
+            assert(node->origin[2] + node->min_z[j] * node->scale[2] <= exact->min_z[j]);
+            assert(node->origin[0] + node->max_x[j] * node->scale[0] >= exact->max_x[j]);
+            assert(node->origin[1] + node->max_y[j] * node->scale[1] >= exact->max_y[j]);
+            assert(node->origin[2] + node->max_z[j] * node->scale[2] >= exact->max_z[j]);
+        }
+    }
+    free_bvh(wide);
+
+    // Hits match brute force before and after a refit, which quantizes again in place
+    CompressedBvhNode *compressed_nodes = bvh->compressed_nodes;
+    int compressed_node_count = bvh->compressed_node_count;
+    for (int k = 0; k < 2; k++) {
+        check_bvh_against_scene(bvh, scene, &rng);
+        perturb_soup(&rng, (real) 0.3, spheres, 150, triangles, 150);
+        refit_bvh(bvh, scene);
+        assert(bvh->compressed_nodes == compressed_nodes && bvh->compressed_node_count == compressed_node_count);
+        assert(bvh->wide_nodes == NULL);
+    }
+
+    free_bvh(bvh);
+    printf("PASSED.\n");
+}
+
+void test_spatial_split_bvh() {
+    // Long thin slanted triangles, the case object splits handle worst
+    Rng rng = create_rng(25, 0);
+    Sphere spheres[50];
+    Triangle triangles[200];
+    make_random_soup(&rng, 10, spheres, 50, NULL, 0);
+    for (int i = 0; i < 200; i++) {
+        Point3 p = random_vec_interval(&rng, -10, 10);
+        Point3 v2 = add_vec3(p, scale_vec3(random_unit_vector(&rng), 8));
+        Point3 v3 = add_vec3(v2, random_vec_interval(&rng, -0.1, 0.1));
+        triangles[i] = (Triangle) {.v1 = p, .v2 = v2, .v3 = v3, .normal = unit_vec(cross(diff_vec3(v2, p), diff_vec3(v3, p))), .mat_id = 100 + i};
+    }
+    BvhPrimitives scene = {.spheres = spheres, .sphere_count = 50, .triangles = triangles, .triangle_count = 200};
+
+    Bvh *sah = build_bvh_primitives(scene, default_bvh_build_config());
+    BvhBuildConfig config = default_bvh_build_config();
+    config.split_method = BVH_SPLIT_SPATIAL;
+    Bvh *bvh = build_bvh_primitives(scene, config);
+
+    // Duplicated references stay within the budget and pay for themselves
+    assert(bvh->source_count == 250 && bvh->prim_count > 250 && bvh->prim_count <= 250 + (int) (0.25 * 250));
+    assert(bvh->sphere_count + bvh->triangle_count == bvh->prim_count);
+    assert(calculate_sah_cost(bvh) < calculate_sah_cost(sah));
+    assert(calculate_total_overlap(bvh) < calculate_total_overlap(sah));
+    free_bvh(sah);
+
+    // Refitting gives the clipped leaves whole primitive boxes, which must not read as decay
+    double clipped_cost = calculate_sah_cost(bvh);
+    assert(bvh->build_sah_cost > clipped_cost);
+
+    // Without a budget there is nothing to duplicate
+    config.spatial_split_budget = 0;
+    Bvh *unsplit = build_bvh_primitives(scene, config);
+    assert(unsplit->prim_count == 250);
+    free_bvh(unsplit);
+
+    // Binary, wide and compressed nodes find the same hits as brute force, also after a refit
+    for (int k = 0; k < 4; k++) {
+        if (k == 1) collapse_bvh_wide(bvh);
+        if (k == 2) compress_bvh_wide(bvh);
+        if (k == 3) refit_bvh(bvh, scene);
+        check_bvh_against_scene(bvh, scene, &rng);
+    }
+    assert(!bvh_needs_rebuild(bvh, 1.0 + 1e-9));
+
+    free_bvh(bvh);
+    printf("PASSED.\n");
+}